@@ -10,9 +10,17 @@ int main(int argc, char **argv)
   options *opts = create_options();
 
   int opt;
-  const char *shortopts = "+b:qvh";
+  const char *shortopts = "+b:j:t:m:P:e:A:Hfqvh";
   const struct option longopts[] = {
     {"bands",   required_argument,  NULL,   'b'},
+    {"jobs",    required_argument,  NULL,   'j'},
+    {"threads", required_argument,  NULL,   't'},
+    {"cache",   required_argument,  NULL,   'm'},
+    {"png-profile", required_argument, NULL, 'P'},
+    {"png-encoder", required_argument, NULL, 'e'},
+    {"archive", required_argument,  NULL,   'A'},
+    {"hash",    no_argument,        NULL,   'H'},
+    {"force",   no_argument,        NULL,   'f'},
     {"quiet",   no_argument,        NULL,   'q'},
     {"version", no_argument,        NULL,   'v'},
     {"help",    no_argument,        NULL,   'h'},
@@ -25,6 +33,52 @@ int main(int argc, char **argv)
       if (parse_bands(opts, optarg))
         exit(EXIT_FAILURE);
       break;
+    case 'j':
+      opts->jobs = atoi(optarg);
+      if (opts->jobs <= 0) {
+        fprintf(stderr, "ERROR: Either specified less than 1 job or conversion of '%s' to integer failed\n", optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 't':
+      opts->threads = atoi(optarg);
+      if (opts->threads <= 0) {
+        fprintf(stderr, "ERROR: Either specified less than 1 thread or conversion of '%s' to integer failed\n", optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'm':
+      opts->cache_size = (size_t) atol(optarg) * 1024 * 1024;
+      if (opts->cache_size == 0) {
+        fprintf(stderr, "ERROR: Either specified 0 MB as cache size or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'P':
+      if (parse_png_profile(opts, optarg)) {
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'e':
+      if (parse_png_backend(opts, optarg)) {
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'A':
+      opts->archive = optarg;
+      break;
+    case 'H':
+      opts->hash_sources = 1;
+      break;
+    case 'f':
+      opts->force = 1;
+      break;
     case 'q':
       opts->verbose = 1;
       break;
@@ -52,6 +106,12 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  if (opts->threads > 1 && opts->png_backend == PNG_BACKEND_LIBDEFLATE) {
+    fprintf(stderr, "ERROR: -t|--threads compresses with zlib and cannot be combined with the libdeflate encoder\n");
+    destroy_options(opts);
+    return 1;
+  }
+
   if (opts->verbose)
     print_options(opts);
 
@@ -67,7 +127,7 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  List *files = gather_files(opts->indir);
+  List *files = expand_tile_archives(gather_files(opts->indir));
 
   convert_files(files, opts);
   delete_list(files);
@@ -14,13 +14,19 @@ int main(int argc, char *argv[])
 {
   options *request_opts = create_options();
   int opt;
-  const char *shortopts = "+t:y:r:opqvh";
+  const char *shortopts = "+t:y:r:b:a:opj:s:x:nqvh";
   const struct option longopts[] = {
     {"type",    required_argument,  NULL,   't'},
     {"year",    required_argument,  NULL,   'y'},
     {"region",  required_argument,  NULL,   'r'},
+    {"bbox",    required_argument,  NULL,   'b'},
+    {"aoi",     required_argument,  NULL,   'a'},
     {"ortho",   no_argument,        NULL,   'o'},
     {"png",     no_argument,        NULL,   'p'},
+    {"jobs",    required_argument,  NULL,   'j'},
+    {"segments", required_argument, NULL,   's'},
+    {"extract", required_argument,  NULL,   'x'},
+    {"no-archive", no_argument,     NULL,   'n'},
     {"quiet",   no_argument,        NULL,   'q'},
     {"version", no_argument,        NULL,   'v'},
     {"help",    no_argument,        NULL,   'h'},
@@ -50,12 +56,50 @@ int main(int argc, char *argv[])
         return 1;
       }
       break;
+    case 'b':
+      if (parse_bbox(request_opts, optarg)) {
+        destroy_options(request_opts);
+        return 1;
+      }
+      break;
+    case 'a':
+      if (parse_aoi(request_opts, optarg)) {
+        destroy_options(request_opts);
+        return 1;
+      }
+      break;
     case 'o':
       request_opts->allow_non_rectified = 1;
       break;
     case 'p':
       request_opts->convert_to_png = 1;
       break;
+    case 'j':
+      request_opts->jobs = atoi(optarg);
+      if (request_opts->jobs <= 0) {
+        fprintf(stderr,
+                "ERROR: Either specified less than 1 concurrent download or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(request_opts);
+        return 1;
+      }
+      break;
+    case 's':
+      request_opts->segments = atoi(optarg);
+      if (request_opts->segments <= 0) {
+        fprintf(stderr,
+                "ERROR: Either specified less than 1 segment per file or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(request_opts);
+        return 1;
+      }
+      break;
+    case 'x':
+      request_opts->extract_dir = optarg;
+      break;
+    case 'n':
+      request_opts->keep_archive = 0;
+      break;
     case 'q':
       request_opts->verbose = 1;
       break;
@@ -81,6 +125,17 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  if (!request_opts->keep_archive && request_opts->extract_dir == NULL) {
+    fprintf(stderr, "ERROR: -n|--no-archive requires -x|--extract\n");
+    destroy_options(request_opts);
+    return 1;
+  }
+
+  if (select_regions(request_opts)) {
+    destroy_options(request_opts);
+    return 1;
+  }
+
   if (request_opts->verbose)
     print_options(request_opts);
 
@@ -90,6 +145,12 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  if (request_opts->extract_dir && check_dir(request_opts->extract_dir)) {
+    fprintf(stderr, "ERROR: Could not access directory '%s'\n", request_opts->extract_dir);
+    destroy_options(request_opts);
+    return 1;
+  }
+
   switch (curl_global_init(CURL_GLOBAL_ALL)) {
   case CURLE_FAILED_INIT:
     fprintf(stderr, "ERROR: CURL failed to initialize properly\n");
@@ -100,7 +161,7 @@ int main(int argc, char *argv[])
   };
 
   Node *download_queue = queue_from_options(request_opts);
-  download_datasets(download_queue, request_opts->outdir, request_opts->verbose);
+  download_datasets(download_queue, request_opts, NULL, NULL);
 
   destroy_options(request_opts);
   curl_global_cleanup();
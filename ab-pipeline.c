@@ -0,0 +1,455 @@
+#include <curl/curl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <gdal/gdal.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "src/aerial-berlin.h"
+#include "src/download.h"
+#include "src/pipeline.h"
+#include "src/tile.h"
+
+typedef struct
+{
+  options *download_opts;
+  options tile_opts;
+  options convert_opts;
+  // archives are handed over without ever blocking the download loop, tiles without blocking a tiler that holds
+  // memory from the budget; only the rasters waiting to be tiled are bounded
+  work_queue *archives;
+  work_queue *rasters;
+  work_queue *tiles;
+  memory_budget *budget;
+  size_t failed;
+  pthread_mutex_t lock;
+} pipeline;
+
+// list node for a single file, with the base name derived like gather_files does
+static List *make_item(const char *path)
+{
+  const char *name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+
+  List *node = calloc(1, sizeof(List));
+  if (node == NULL)
+    return NULL;
+  node->file = strdup(path);
+  node->base = strdup(name);
+  if (node->file == NULL || node->base == NULL) {
+    delete_list(node);
+    return NULL;
+  }
+
+  char *file_extension = strrchr(node->base, '.');
+  if (file_extension)
+    *file_extension = '\0';
+
+  return node;
+}
+
+static void count_failure(pipeline *p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->failed++;
+  pthread_mutex_unlock(&p->lock);
+}
+
+// download stage -> expand stage; called from the download loop, so it only queues the archive
+static void on_archive(const char *path, void *user)
+{
+  pipeline *p = (pipeline *) user;
+  List *archive = make_item(path);
+
+  if (archive == NULL || work_queue_push(p->archives, archive)) {
+    fprintf(stderr, "ERROR: Failed to queue '%s' for tiling\n", path);
+    delete_list(archive);
+    count_failure(p);
+  }
+}
+
+// tile stage -> convert stage
+static void on_tile(const char *path, void *user)
+{
+  pipeline *p = (pipeline *) user;
+  List *tile = make_item(path);
+
+  if (tile == NULL || work_queue_push(p->tiles, tile)) {
+    fprintf(stderr, "ERROR: Failed to queue '%s' for conversion\n", path);
+    delete_list(tile);
+    count_failure(p);
+  }
+}
+
+static void *download_stage(void *arg)
+{
+  pipeline *p = (pipeline *) arg;
+
+  Node *download_queue = queue_from_options(p->download_opts);
+  download_datasets(download_queue, p->download_opts, on_archive, p);
+  work_queue_close(p->archives);
+
+  return NULL;
+}
+
+// expand stage -> tile stage: every raster inside a finished archive becomes one work item. Waits for the tilers
+// whenever enough rasters are queued, while the downloads carry on
+static void *expand_stage(void *arg)
+{
+  pipeline *p = (pipeline *) arg;
+  List *archive;
+
+  while ((archive = work_queue_pop(p->archives))) {
+    List *members = expand_archives(archive);
+    while (members) {
+      List *member = members;
+      members = members->next;
+      if (work_queue_push(p->rasters, member)) {
+        member->next = NULL;
+        delete_list(member);
+      }
+    }
+  }
+  work_queue_close(p->rasters);
+
+  return NULL;
+}
+
+static void *tile_stage(void *arg)
+{
+  pipeline *p = (pipeline *) arg;
+  List *raster;
+
+  while ((raster = work_queue_pop(p->rasters))) {
+    size_t footprint = tile_file_footprint(raster->file, &p->tile_opts);
+    memory_budget_acquire(p->budget, footprint);
+    if (tile_file(raster->file, raster->base, &p->tile_opts, p->convert_opts.convert_to_png ? on_tile : NULL, p)) {
+      fprintf(stderr, "ERROR: Skipping '%s'\n", raster->file);
+      count_failure(p);
+    }
+    memory_budget_release(p->budget, footprint);
+    delete_list(raster);
+  }
+
+  return NULL;
+}
+
+// PNGs are encoded within the same budget as the rasters being tiled
+static void *convert_stage(void *arg)
+{
+  pipeline *p = (pipeline *) arg;
+  List *tile;
+
+  while ((tile = work_queue_pop(p->tiles))) {
+    size_t footprint = convert_file_footprint(tile->file, &p->convert_opts);
+    memory_budget_acquire(p->budget, footprint);
+    if (convert_file(tile->file, tile->base, &p->convert_opts)) {
+      fprintf(stderr, "ERROR: Skipping '%s'\n", tile->file);
+      count_failure(p);
+    }
+    memory_budget_release(p->budget, footprint);
+    delete_list(tile);
+  }
+
+  return NULL;
+}
+
+// creates '<outdir>/<name>' if needed and returns its path
+static char *stage_directory(const char *outdir, const char *name)
+{
+  char *path = calloc(1024, sizeof(char));
+  if (path == NULL)
+    return NULL;
+
+  if (snprintf(path, 1024, "%s%s%s", outdir, outdir[strlen(outdir) - 1] == '/' ? "" : "/", name) >= 1024 ||
+      (mkdir(path, 0755) != 0 && errno != EEXIST) || check_dir(path)) {
+    fprintf(stderr, "ERROR: Could not create directory '%s'\n", path);
+    free(path);
+    return NULL;
+  }
+
+  return path;
+}
+
+int main(int argc, char *argv[])
+{
+  options *opts = create_options();
+  int opt;
+  const char *shortopts = "+t:y:r:oj:s:pb:P:R:C:w:T:m:qvh";
+  const struct option longopts[] = {
+    {"type",     required_argument,  NULL,   't'},
+    {"year",     required_argument,  NULL,   'y'},
+    {"region",   required_argument,  NULL,   'r'},
+    {"ortho",    no_argument,        NULL,   'o'},
+    {"jobs",     required_argument,  NULL,   'j'},
+    {"segments", required_argument,  NULL,   's'},
+    {"png",      no_argument,        NULL,   'p'},
+    {"bands",    required_argument,  NULL,   'b'},
+    {"prefix",   required_argument,  NULL,   'P'},
+    {"row",      required_argument,  NULL,   'R'},
+    {"column",   required_argument,  NULL,   'C'},
+    {"workers",  required_argument,  NULL,   'w'},
+    {"threads",  required_argument,  NULL,   'T'},
+    {"memory",   required_argument,  NULL,   'm'},
+    {"quiet",    no_argument,        NULL,   'q'},
+    {"version",  no_argument,        NULL,   'v'},
+    {"help",     no_argument,        NULL,   'h'},
+    {0,          0,                  0,      0}
+  };
+
+  while ((opt = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1) {
+    switch (opt) {
+    case 't':
+      if (parse_image_types(opts, optarg)) {
+        fprintf(stderr, "ERROR: Failed to parse requested image types: '%s'\n", optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'y':
+      if (parse_image_years(opts, optarg)) {
+        fprintf(stderr, "ERROR: Failed to parse requested image years: '%s'\n", optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'r':
+      if (parse_image_regions(opts, optarg)) {
+        fprintf(stderr, "ERROR: Failed to parse requested image regions: '%s'\n", optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'o':
+      opts->allow_non_rectified = 1;
+      break;
+    case 'j':
+      opts->jobs = atoi(optarg);
+      if (opts->jobs <= 0) {
+        fprintf(stderr,
+                "ERROR: Either specified less than 1 concurrent download or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 's':
+      opts->segments = atoi(optarg);
+      if (opts->segments <= 0) {
+        fprintf(stderr,
+                "ERROR: Either specified less than 1 segment per file or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'p':
+      opts->convert_to_png = 1;
+      break;
+    case 'b':
+      if (parse_bands(opts, optarg)) {
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'P':
+      opts->prefix = optarg;
+      break;
+    case 'R':
+      opts->rsize = atoi(optarg);
+      if (opts->rsize <= 0) {
+        fprintf(stderr,
+                "ERROR: Either specified 0 as number of rows per tile or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'C':
+      opts->csize = atoi(optarg);
+      if (opts->csize <= 0) {
+        fprintf(stderr,
+                "ERROR: Either specified 0 as number of columns per tile or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'w':
+      opts->workers = atoi(optarg);
+      if (opts->workers <= 0) {
+        fprintf(stderr, "ERROR: Either specified less than 1 worker or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'T':
+      opts->threads = atoi(optarg);
+      if (opts->threads <= 0) {
+        fprintf(stderr, "ERROR: Either specified less than 1 thread or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'm':
+      opts->memory_limit = (size_t) atol(optarg) * 1024 * 1024;
+      if (opts->memory_limit == 0) {
+        fprintf(stderr, "ERROR: Either specified 0 MB as memory cap or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'q':
+      opts->verbose = 1;
+      break;
+    case 'v':
+      print_version();
+      destroy_options(opts);
+      return 0;
+    case 'h':
+      print_pipeline_help();
+      destroy_options(opts);
+      return 0;
+    case '?':
+      break;
+    }
+  }
+
+  if (argc - optind == 1) {
+    opts->outdir = argv[optind];
+  } else {
+    fprintf(stderr, "ERROR: Expected 1 positional argument: output directory. Found %d\n", argc - optind);
+    destroy_options(opts);
+    return 1;
+  }
+
+  if (opts->rsize == 0 || opts->csize == 0) {
+    fprintf(stderr, "ERROR: Tile size must be given with -R|--row and -C|--column\n");
+    destroy_options(opts);
+    return 1;
+  }
+
+  if (opts->convert_to_png && opts->bands_count == 0 && parse_bands(opts, "1,2,3")) {
+    destroy_options(opts);
+    return 1;
+  }
+
+  if (opts->verbose)
+    print_options(opts);
+
+  if (check_dir(opts->outdir)) {
+    fprintf(stderr, "ERROR: Could not access directory '%s'\n", opts->outdir);
+    destroy_options(opts);
+    return 1;
+  }
+
+  char *tile_dir = stage_directory(opts->outdir, "tiles");
+  char *png_dir = opts->convert_to_png ? stage_directory(opts->outdir, "png") : NULL;
+  if (tile_dir == NULL || (opts->convert_to_png && png_dir == NULL)) {
+    free(tile_dir);
+    free(png_dir);
+    destroy_options(opts);
+    return 1;
+  }
+
+  if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
+    fprintf(stderr, "ERROR: CURL failed to initialize properly\n");
+    free(tile_dir);
+    free(png_dir);
+    destroy_options(opts);
+    return 1;
+  }
+  GDALAllRegister();
+
+  // a quarter of the cap goes to GDAL's block cache, the rest to the rasters held by the tile stage and the PNGs
+  // being encoded by the convert stage
+  GDALSetCacheMax64((GIntBig) (opts->memory_limit / 4));
+
+  pipeline p = { 0 };
+  p.download_opts = opts;
+  p.tile_opts = *opts;
+  p.tile_opts.outdir = tile_dir;
+  p.convert_opts = *opts;
+  p.convert_opts.outdir = png_dir;
+  p.convert_opts.threads = 1;
+  p.archives = create_work_queue(0);
+  p.rasters = create_work_queue(64);
+  p.tiles = create_work_queue(0);
+  p.budget = create_memory_budget(opts->memory_limit - opts->memory_limit / 4);
+  pthread_mutex_init(&p.lock, NULL);
+
+  int status = 0;
+  if (p.archives == NULL || p.rasters == NULL || p.tiles == NULL || p.budget == NULL) {
+    status = 1;
+  } else {
+    pthread_t downloader, expander;
+    pthread_t *tilers = calloc(opts->workers, sizeof(pthread_t));
+    pthread_t *converters = calloc(opts->workers, sizeof(pthread_t));
+    int downloading = 0, expanding = 0, tiling = 0, converting = 0;
+
+    if (tilers == NULL || converters == NULL) {
+      fprintf(stderr, "ERROR: Failed to allocate worker threads.\n");
+      status = 1;
+    } else {
+      // a stage that cannot start closes the queue it would have fed, so the stages after it still finish
+      downloading = pthread_create(&downloader, NULL, download_stage, &p) == 0;
+      if (!downloading)
+        work_queue_close(p.archives);
+      expanding = pthread_create(&expander, NULL, expand_stage, &p) == 0;
+      if (!expanding)
+        work_queue_close(p.rasters);
+      while (tiling < opts->workers && pthread_create(&tilers[tiling], NULL, tile_stage, &p) == 0)
+        tiling++;
+      if (tiling == 0)
+        work_queue_close(p.rasters);
+      while (opts->convert_to_png && converting < opts->workers &&
+             pthread_create(&converters[converting], NULL, convert_stage, &p) == 0)
+        converting++;
+      if (opts->convert_to_png && converting == 0)
+        work_queue_close(p.tiles);
+
+      if (!downloading || !expanding || tiling < opts->workers ||
+          (opts->convert_to_png && converting < opts->workers)) {
+        fprintf(stderr, "ERROR: Failed to start worker threads.\n");
+        status = 1;
+      }
+
+      if (downloading)
+        pthread_join(downloader, NULL);
+      if (expanding)
+        pthread_join(expander, NULL);
+      for (int i = 0; i < tiling; i++)
+        pthread_join(tilers[i], NULL);
+      work_queue_close(p.tiles);
+      for (int i = 0; i < converting; i++)
+        pthread_join(converters[i], NULL);
+    }
+
+    free(tilers);
+    free(converters);
+  }
+
+  // like ab-tile and ab-convert, failed rasters or tiles do not stop the others, only change the exit status
+  if (status == 0 && p.failed) {
+    fprintf(stderr, "ERROR: %zu rasters or tiles failed\n", p.failed);
+    status = 69;
+  }
+
+  destroy_work_queue(p.archives);
+  destroy_work_queue(p.rasters);
+  destroy_work_queue(p.tiles);
+  destroy_memory_budget(p.budget);
+  pthread_mutex_destroy(&p.lock);
+  free(tile_dir);
+  free(png_dir);
+  destroy_options(opts);
+  curl_global_cleanup();
+
+  return status;
+}
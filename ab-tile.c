@@ -6,6 +6,7 @@
 #include <gdal/gdal.h>
 #include <gdal/cpl_conv.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "src/aerial-berlin.h"
@@ -15,11 +16,34 @@ int main(int argc, char **argv)
 {
   options *opts = create_options();
   int opt;
-  const char *shortopts = "+p:r:c:qvh";
+  const char *shortopts = "+p:r:c:t:j:m:z:P:l:B:N:K:s::E:F:O:L:V:A:S:M:d:b:a:Hfqvh";
   const struct option longopts[] = {
     {"prefix",  required_argument,  NULL,   'p'},
     {"row",     required_argument,  NULL,   'r'},
     {"column",  required_argument,  NULL,   'c'},
+    {"threads", required_argument,  NULL,   't'},
+    {"jobs",    required_argument,  NULL,   'j'},
+    {"cache",   required_argument,  NULL,   'm'},
+    {"compress", required_argument, NULL,   'z'},
+    {"predictor", required_argument, NULL,  'P'},
+    {"level",   required_argument,  NULL,   'l'},
+    {"blocksize", required_argument, NULL,  'B'},
+    {"compress-threads", required_argument, NULL, 'N'},
+    {"co",      required_argument,  NULL,   'K'},
+    {"skip-empty", optional_argument, NULL, 's'},
+    {"edge",    required_argument,  NULL,   'E'},
+    {"fill",    required_argument,  NULL,   'F'},
+    {"overlap", required_argument,  NULL,   'O'},
+    {"pyramid", required_argument,  NULL,   'L'},
+    {"vrt",     required_argument,  NULL,   'V'},
+    {"archive", required_argument,  NULL,   'A'},
+    {"scratch", required_argument,  NULL,   'S'},
+    {"scratch-size", required_argument, NULL, 'M'},
+    {"scale",   required_argument,  NULL,   'd'},
+    {"bbox",    required_argument,  NULL,   'b'},
+    {"aoi",     required_argument,  NULL,   'a'},
+    {"hash",    no_argument,        NULL,   'H'},
+    {"force",   no_argument,        NULL,   'f'},
     {"quiet",   no_argument,        NULL,   'q'},
     {"version", no_argument,        NULL,   'v'},
     {"help",    no_argument,        NULL,   'h'},
@@ -49,6 +73,167 @@ int main(int argc, char **argv)
         destroy_options(opts);
       }
       break;
+    case 't':
+      opts->threads = atoi(optarg);
+      if (opts->threads <= 0) {
+        fprintf(stderr, "ERROR: Either specified less than 1 thread or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'j':
+      opts->jobs = atoi(optarg);
+      if (opts->jobs <= 0) {
+        fprintf(stderr, "ERROR: Either specified less than 1 job or conversion of '%s' to integer failed\n", optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'm':
+      opts->cache_size = (size_t) atol(optarg) * 1024 * 1024;
+      if (opts->cache_size == 0) {
+        fprintf(stderr, "ERROR: Either specified 0 MB as cache size or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'z':
+      if (parse_compression(opts, optarg)) {
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'P':
+      opts->predictor = atoi(optarg);
+      if (opts->predictor < 1 || opts->predictor > 3) {
+        fprintf(stderr, "ERROR: Predictor must be 1, 2 or 3, got '%s'\n", optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'l':
+      opts->level = atoi(optarg);
+      if (opts->level <= 0) {
+        fprintf(stderr, "ERROR: Either specified compression level below 1 or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'B':
+      opts->blocksize = atoi(optarg);
+      if (opts->blocksize <= 0 || opts->blocksize % 16 != 0) {
+        fprintf(stderr, "ERROR: Block size must be a positive multiple of 16, got '%s'\n", optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'N':
+      opts->compress_threads = atoi(optarg);
+      if (opts->compress_threads <= 0) {
+        fprintf(stderr, "ERROR: Either specified less than 1 thread or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'K':
+      if (parse_creation_option(opts, optarg)) {
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 's':
+      opts->skip_empty = 1;
+      if (optarg) {
+        char *end;
+        long threshold = strtol(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || threshold < 0 || threshold > 255) {
+          fprintf(stderr, "ERROR: Empty tile threshold must be between 0 and 255, got '%s'\n", optarg);
+          destroy_options(opts);
+          return 1;
+        }
+        opts->empty_threshold = (int) threshold;
+      }
+      break;
+    case 'E':
+      if (parse_edge_mode(opts, optarg)) {
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'F': {
+      char *end;
+      long fill = strtol(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0' || fill < 0 || fill > 255) {
+        fprintf(stderr, "ERROR: Fill value must be between 0 and 255, got '%s'\n", optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      opts->fill = (int) fill;
+      break;
+    }
+    case 'O':
+      opts->overlap = atoi(optarg);
+      if (opts->overlap <= 0) {
+        fprintf(stderr, "ERROR: Either specified an overlap below 1 or conversion of '%s' to integer failed\n", optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'L':
+      opts->pyramid = atoi(optarg);
+      if (opts->pyramid <= 0) {
+        fprintf(stderr, "ERROR: Either specified less than 1 overview level or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'V':
+      opts->vrt = optarg;
+      break;
+    case 'A':
+      opts->archive = optarg;
+      break;
+    case 'S':
+      opts->scratch = optarg;
+      break;
+    case 'M':
+      opts->scratch_limit = (size_t) atol(optarg) * 1024 * 1024;
+      if (opts->scratch_limit == 0) {
+        fprintf(stderr, "ERROR: Either specified 0 MB as scratch cache size or conversion of '%s' to integer failed\n",
+                optarg);
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'd':
+      if (parse_scale(opts, optarg)) {
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'b':
+      if (parse_bbox(opts, optarg)) {
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'a':
+      if (parse_aoi(opts, optarg)) {
+        destroy_options(opts);
+        return 1;
+      }
+      break;
+    case 'H':
+      opts->hash_sources = 1;
+      break;
+    case 'f':
+      opts->force = 1;
+      break;
     case 'q':
       opts->verbose = 1;
       break;
@@ -76,6 +261,33 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  if ((opts->predictor || opts->level) && (opts->compress == NULL || strcmp(opts->compress, "NONE") == 0)) {
+    fprintf(stderr, "ERROR: -P|--predictor and -l|--level require -z|--compress\n");
+    destroy_options(opts);
+    return 1;
+  }
+  if (opts->level && strcmp(opts->compress, "LZW") == 0) {
+    fprintf(stderr, "ERROR: LZW compression does not take a level\n");
+    destroy_options(opts);
+    return 1;
+  }
+
+  if (opts->overlap && (opts->overlap >= opts->rsize || opts->overlap >= opts->csize)) {
+    fprintf(stderr, "ERROR: -O|--overlap must be smaller than the tile size\n");
+    destroy_options(opts);
+    return 1;
+  }
+  if (opts->pyramid && (opts->overlap || opts->rsize % 2 != 0)) {
+    fprintf(stderr, "ERROR: -L|--pyramid requires an even number of rows per tile and no -O|--overlap\n");
+    destroy_options(opts);
+    return 1;
+  }
+  if (opts->fill >= 0 && opts->edge != EDGE_PAD && !opts->has_bbox) {
+    fprintf(stderr, "ERROR: -F|--fill requires -E|--edge pad or -b|--bbox\n");
+    destroy_options(opts);
+    return 1;
+  }
+
   if (opts->verbose)
     print_options(opts);
 
@@ -91,7 +303,13 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  List *file_list = gather_files(opts->indir);
+  if (opts->scratch && check_dir(opts->scratch)) {
+    fprintf(stderr, "ERROR: Could not access directory '%s'\n", opts->scratch);
+    destroy_options(opts);
+    return 1;
+  }
+
+  List *file_list = expand_archives(gather_files(opts->indir));
 
   tile_files(file_list, opts);
 
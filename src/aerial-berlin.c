@@ -1,7 +1,10 @@
+#include <ctype.h>
+#include <float.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <unistd.h>
 
@@ -12,20 +15,36 @@ char *base_url = "https://fbinter.stadt-berlin.de/fb/atom";
 void print_download_help(void)
 {
   printf(
-    "Usage: ab-download [-t|--type] [-y|--year] [-r|--regions] [-p|--png] [-v|--verbose] [-v|--version] [-h|--help] output-directory\n\n"
+    "Usage: ab-download [-t|--type] [-y|--year] [-r|--regions] [-b|--bbox] [-a|--aoi] [-p|--png] [-j|--jobs] [-s|--segments] [-x|--extract] [-n|--no-archive] [-v|--verbose] [-v|--version] [-h|--help] output-directory\n\n"
     "Keyword parameters and optional flags:\n"
     "\t-t|--type       Indicating if RGB, CIR or Grayscale datasets should be downloaded.\n"
     "\t                For 2021 and 2023, the data is offered as four band stack (RGBI).\n"
     "\t                For 1928, the data is offered in grayscale only. Thus, this option is ignored when year = 1928.\n"
     "\t-y|--year       Indicating which year's images should be downloaded. Possible values: 1928, 2020, 2021, 2023.\n"
     "\t-r|--regions    Indicating regions to download. Possible values: Mitte, Nord, Nordost, Nordwest, Ost, Sued, Suedost, Suedwest, West.\n"
+    "\t-b|--bbox       Only download the regions intersecting this area of interest, given as minx,miny,maxx,maxy in\n"
+    "\t                EPSG:25833. Chooses among -r|--regions, or all regions if none are given. Region extents are\n"
+    "\t                not published and only approximated by a 3x3 grid over Berlin, each cell widened by 2 km, so\n"
+    "\t                an area near a border also keeps the neighbouring regions. A region reaching further than 2 km\n"
+    "\t                past its cell may still be missed; pass -r|--regions without -b|--bbox if every raster has to\n"
+    "\t                be complete.\n"
+    "\t-a|--aoi        Like -b|--bbox, with the bounding box of the coordinates in this GeoJSON file (in EPSG:25833).\n"
     "\t-o|--ortho      Download non-orthorectified images. By default, only orthorectified images are requested.\n"
     "\t-p|--png        Indicating if the tiled GeoTiffs get converted to PNG. If not present: False\n"
+    "\t-j|--jobs       Number of concurrent downloads. Connections to the server are reused between files. Default: 1\n"
+    "\t-s|--segments   Split each file into up to this many byte ranges downloaded over separate connections. Not used with -x|--extract\n"
+    "\t                or when resuming a partial file. An interrupted split download keeps only the bytes up to its first\n"
+    "\t                missing range, which the next run resumes over a single connection. Default: 1\n"
+    "\t-x|--extract    Directory to extract ECW/JP2 files into while downloading, ready for ab-tile. Must exist prior to invocation.\n"
+    "\t-n|--no-archive Do not keep downloaded zip files. Requires -x|--extract. Disables resuming and skipping of unchanged files.\n"
     "\t-v|--verbose    Verbose output. Default: False\n"
     "\t-v|--version    Print version and exit.\n"
     "\t-h|--help       Print this help and exit.\n\n"
     "Positional arguments:\n"
     "\toutput-directory Path, where all final and intermediate outputs should be saved. Must exist prior to invocation.\n\n"
+    "Interrupted downloads are kept as '*.zip.part' files next to a '*.zip.part.journal' and are resumed by the next run.\n"
+    "Completed downloads are recorded in '.ab-download-manifest' and only transferred again if they changed upstream\n"
+    "or their local copy no longer matches the recorded size and CRC-32.\n\n"
     "Copyright: Florian Katerndahl (2023-*)\n\n"
     "Known Issues: URL formatting for RGBI imagery form 2021 is broken. You need to request RGB images instead of RGBI images to download four-band datasets.\n"
   );
@@ -34,16 +53,60 @@ void print_download_help(void)
 void print_tile_help(void)
 {
   printf(
-    "Usage: ab-tile [-p|--prefix] [-r|--row] [-c|--column] [-v|--verbose] [-h|--help] [-v|--version] input-directory output-directory\n\n"
+    "Usage: ab-tile [-p|--prefix] [-r|--row] [-c|--column] [-t|--threads] [-j|--jobs] [-m|--cache] [-z|--compress] [-P|--predictor] [-l|--level] [-B|--blocksize] [-N|--compress-threads] [-K|--co] [-s|--skip-empty[=threshold]] [-E|--edge] [-F|--fill] [-O|--overlap] [-L|--pyramid] [-V|--vrt] [-A|--archive] [-S|--scratch] [-M|--scratch-size] [-d|--scale] [-b|--bbox] [-a|--aoi] [-H|--hash] [-f|--force] [-v|--verbose] [-h|--help] [-v|--version] input-directory output-directory\n\n"
     "Keyword parameters and optional flags:\n"
     "\t-p|--prefix     Prefix to tiles outputs. Default: NULL\n"
-    "\t-r|--row        Number row-wise pixels per output chunk. Must be evenly divisble by input size. To resample the file, use GDAL utilities.\n"
-    "\t-c|--column     Number column-wise pixels per output chunk. Must be evenly divisble by input size. To resample the file, use GDAL utilities.\n"
+    "\t-r|--row        Number row-wise pixels per output chunk. Must be evenly divisble by input size unless -E|--edge is given.\n"
+    "\t-c|--column     Number column-wise pixels per output chunk. Must be evenly divisble by input size unless -E|--edge is given.\n"
+    "\t-t|--threads    Number of threads writing the tiles of one raster. Default: 1\n"
+    "\t-j|--jobs       Number of strips tiled concurrently. Strips of all rasters are shared among jobs, largest rasters first. Default: 1\n"
+    "\t-m|--cache      GDAL block cache per job in MB. Default: 64\n"
+    "\t-z|--compress   Compression of output tiles, one of none, lzw, deflate, zstd. Default: none\n"
+    "\t-P|--predictor  TIFF predictor for compressed tiles (1: none, 2: horizontal differencing). Default: 2\n"
+    "\t-l|--level      Compression level for deflate (1-12) and zstd (1-22). Default: GDAL's\n"
+    "\t-B|--blocksize  Write internally tiled GeoTIFFs with square blocks of this size. Must be a multiple of 16. Default: stripped\n"
+    "\t-N|--compress-threads Number of threads GDAL uses to compress the blocks of one tile. Default: 1\n"
+    "\t-K|--co         Additional GTiff creation option KEY=VALUE. May be given multiple times; overrides the options above.\n"
+    "\t-s|--skip-empty Do not write tiles whose samples all lie within threshold of their first pixel, band by band,\n"
+    "\t                e.g. all-zero or nodata tiles at the city boundary. Written as -s5 or --skip-empty=5. Default threshold: 0\n"
+    "\t-E|--edge       Handling of rasters not evenly divisible into tiles: pad (full size edge tiles, filled with -F|--fill),\n"
+    "\t                truncate (smaller edge tiles) or error. Default: error\n"
+    "\t-F|--fill       Value (0-255) the padding of edge tiles is filled with, given -E|--edge pad or -b|--bbox. It is also set as nodata value of those tiles. Default: 0, no nodata\n"
+    "\t-O|--overlap    Number of pixels neighbouring tiles share, like gdal_retile.py -overlap. Default: 0\n"
+    "\t-L|--pyramid    Also write this many overview levels, each averaging 2x2 pixels of the level above, as\n"
+    "\t                '<prefix>-<name>-L<level>-X<column>_Y<row>.tif' with the same tile size. Built from the strips\n"
+    "\t                already in memory, holding a quarter of each raster in flight. Requires an even row size. Default: 0\n"
+    "\t-V|--vrt        Also write a VRT mosaic of all level 0 tiles to this file, from the tiles' metadata collected\n"
+    "\t                while writing them, instead of running gdalbuildvrt afterwards.\n"
+  );
+  printf(
+    "\t-A|--archive    Append all tiles to this single file (e.g. tiles.abt) instead of writing one file per tile. Its index\n"
+    "\t                of name, source, level, column, row, offset and length comes last; each tile can be read in place\n"
+    "\t                as '/vsisubfile/<offset>_<length>,<archive>', which is also how a -V|--vrt mosaic refers to it.\n"
+    "\t                The archive is written anew on every run, without consulting the manifest.\n"
+    "\t-S|--scratch    Directory keeping the decoded pixels of each raster in a raw, memory-mapped file. Later runs\n"
+    "\t                on the same rasters, e.g. with another tile size, map these files instead of decoding again.\n"
+    "\t-M|--scratch-size Size limit of -S|--scratch in MB; the least recently used rasters are removed first. Default: 16384\n"
+    "\t-d|--scale      Tile the rasters at 1/N of their resolution, written as 1/2, 1/4, 1/8, ... GDAL then decodes\n"
+    "\t                ECW/JP2 from the matching wavelet level or overview, skipping the finer ones. -r|--row and\n"
+    "\t                -c|--column refer to the reduced rasters. Default: 1/1\n"
+    "\t-b|--bbox       Only tile the area of interest minx,miny,maxx,maxy in EPSG:25833. Just the part of each raster\n"
+    "\t                below the intersecting tiles is decoded, and only those tiles are written. Rasters outside of it\n"
+    "\t                are skipped. Tiles follow a global grid starting at easting 0 and northing 10000 km rather than\n"
+    "\t                each raster's upper left corner, and X<column>_Y<row> counts from there, so neighbouring rasters\n"
+    "\t                write tiles of the same footprint. Tiles reaching past a raster's edge are always padded with\n"
+    "\t                -F|--fill, whatever -E|--edge says.\n"
+    "\t-a|--aoi        Like -b|--bbox, with the bounding box of the coordinates in this GeoJSON file (in EPSG:25833).\n"
+    "\t-H|--hash       Also compare a CRC-32 of each raster's content to decide whether it changed, not only size and mtime.\n"
+    "\t-f|--force      Tile all rasters, even those the output directory's manifest lists as unchanged.\n"
     "\t-v|--verbose    Verbose output. Default: False\n"
     "\t-v|--version    Print version and exit.\n"
     "\t-h|--help       Print this help and exit.\n\n"
+    "After tiling, the number and size of written tiles and the throughput are reported for the chosen compression.\n"
+    "Rasters are listed with their tiles in '.ab-tile-manifest' inside the output directory. Rerunning skips rasters\n"
+    "tiled before with the same settings and removes the old tiles of changed ones before tiling them again.\n\n"
     "Positional arguments:\n"
-    "\tinput-directory Path to unziped ortho-images\n"
+    "\tinput-directory Path to ortho-images. ECW/JP2 files inside zip archives (e.g. ab-download outputs) are read without unzipping.\n"
     "\toutput-directory Path, where all final and intermediate outputs should be saved. Must exist prior to invocation.\n\n"
     "Copyright: Florian Katerndahl (2023-*)\n\n"
   );
@@ -52,20 +115,65 @@ void print_tile_help(void)
 void print_convert_help(void)
 {
   printf(
-    "Usage: ab-tile [-b|--bands] [-v|--verbose] [-h|--help] [-v|--version] input-directory output-directory\n\n"
+    "Usage: ab-tile [-b|--bands] [-j|--jobs] [-t|--threads] [-m|--cache] [-P|--png-profile] [-e|--png-encoder] [-A|--archive] [-H|--hash] [-f|--force] [-v|--verbose] [-h|--help] [-v|--version] input-directory output-directory\n\n"
     "Keyword parameters and optional flags:\n"
-    "\t-b|--bands      List of bands to export. Must be a list of three integers. Note, that GDAL starts counting bands from 1.\n"
+    "\t-b|--bands      List of bands to export. Must be a list of one, three or four integers, written as gray, RGB or RGBA. Note, that GDAL starts counting bands from 1.\n"
+    "\t-j|--jobs       Number of tiles converted concurrently, largest first. Default: 1\n"
+    "\t-t|--threads    Number of threads compressing one PNG. The filtered image is deflated in independent pieces\n"
+    "\t                that are joined into a single zlib stream. Not available with libdeflate. Above 1, the whole\n"
+    "\t                filtered image is held in memory until it is compressed, height * (width * bands + 1) bytes\n"
+    "\t                (about 19 MB for a 2500x2500 RGB tile) per job on top of the PNG itself. Default: 1\n"
+    "\t-m|--cache      GDAL block cache per job in MB. Default: 64\n"
+    "\t-P|--png-profile Compression settings, one of fast (zlib level 1, RLE, sub filter), balanced (level 6, adaptive filters) or small (level 9, all filters). Default: libpng's defaults\n"
+    "\t-e|--png-encoder Library compressing the image data, libpng or libdeflate (only if built with 'make LIBDEFLATE=1'). libdeflate\n"
+    "\t                compresses the whole image at once and buffers it like -t|--threads above 1. Default: libpng\n"
+    "\t-A|--archive    Append all PNGs to this single file (e.g. png.abt) instead of writing one file per tile, see ab-tile.\n"
+    "\t-H|--hash       Also compare a CRC-32 of each tile's content to decide whether it changed, not only size and mtime.\n"
+    "\t-f|--force      Convert all tiles, even those the output directory's manifest lists as unchanged.\n"
     "\t-v|--verbose    Verbose output. Default: False\n"
     "\t-v|--version    Print version and exit.\n"
     "\t-h|--help       Print this help and exit.\n\n"
     "Positional arguments:\n"
-    "\tinput-directory Path to unziped ortho-images\n"
+    "\tinput-directory Path to GeoTIFF tiles. The tiles inside tile archives (.abt) written by ab-tile are read in place.\n"
     "\toutput-directory Path, where all final and intermediate outputs should be saved. Must exist prior to invocation.\n\n"
+    "Like ab-tile, tiles converted before with the same settings are skipped, see '.ab-convert-manifest'.\n\n"
     "Copyright: Florian Katerndahl (2023-*)\n\n"
     "Note: Ordering in output file is dependent of order in [-b|--bands]\n"
   );
 }
 
+void print_pipeline_help(void)
+{
+  printf(
+    "Usage: ab-pipeline [-t|--type] [-y|--year] [-r|--regions] [-j|--jobs] [-s|--segments] -R|--row -C|--column [-P|--prefix] [-p|--png] [-b|--bands] [-w|--workers] [-T|--threads] [-m|--memory] [-v|--verbose] [-v|--version] [-h|--help] output-directory\n\n"
+    "Downloads, tiles and (optionally) converts at the same time: regions are tiled as soon as their archive is complete\n"
+    "and tiles are converted as soon as they are written. Stages are linked by bounded queues.\n\n"
+    "Keyword parameters and optional flags:\n"
+    "\t-t|--type       Image types to download, see ab-download.\n"
+    "\t-y|--year       Image years to download, see ab-download.\n"
+    "\t-r|--regions    Regions to download, see ab-download.\n"
+    "\t-o|--ortho      Download non-orthorectified images.\n"
+    "\t-j|--jobs       Number of concurrent downloads. Default: 1\n"
+    "\t-s|--segments   Split each file into up to this many byte ranges downloaded over separate connections. An interrupted\n"
+    "\t                split download keeps only the bytes up to its first missing range, which the next run resumes over\n"
+    "\t                a single connection. Default: 1\n"
+    "\t-R|--row        Number row-wise pixels per output chunk. Must be evenly divisble by input size.\n"
+    "\t-C|--column     Number column-wise pixels per output chunk. Must be evenly divisble by input size.\n"
+    "\t-P|--prefix     Prefix to tiles outputs. Default: NULL\n"
+    "\t-p|--png        Convert tiles to PNG. If not present: False\n"
+    "\t-b|--bands      List of bands to export to PNG, see ab-convert. Default: 1,2,3\n"
+    "\t-w|--workers    Number of tiling and of converting threads each. Default: 1\n"
+    "\t-T|--threads    Number of threads writing the tiles of one raster, per tiling worker. Default: 1\n"
+    "\t-m|--memory     Memory cap in MB for decoded rasters, the PNGs being encoded and GDAL's block cache. A single raster larger than the cap is still processed, alone. Default: 2048\n"
+    "\t-v|--verbose    Verbose output. Default: False\n"
+    "\t-v|--version    Print version and exit.\n"
+    "\t-h|--help       Print this help and exit.\n\n"
+    "Positional arguments:\n"
+    "\toutput-directory Path for downloaded archives. Tiles are written to 'tiles/' and PNGs to 'png/' below it. Must exist prior to invocation.\n\n"
+    "Copyright: Florian Katerndahl (2023-*)\n\n"
+  );
+}
+
 void print_version(void)
 {
   printf("version: %s\n", VERSION);
@@ -92,6 +200,10 @@ void print_options(const options *option)
     printf("\n");
 
     printf("\tConvert tiles to PNG: %d\n", option->convert_to_png);
+    printf("\tConcurrent downloads: %d\n", option->jobs);
+    printf("\tSegments per file:    %d\n", option->segments);
+    if (option->extract_dir)
+      printf("\tExtract rasters to: %s (keep archive: %d)\n", option->extract_dir, option->keep_archive);
   }
 
   if (option->prefix)
@@ -109,6 +221,58 @@ void print_options(const options *option)
     printf("\n");
   }
 
+  if (option->workers > 1)
+    printf("\tWorker threads: %d\n", option->workers);
+
+  if (option->threads > 1)
+    printf("\tThreads per raster: %d\n", option->threads);
+
+  if (option->compress)
+    printf("\tCompression: %s (predictor: %d, level: %d)\n", option->compress, option->predictor, option->level);
+
+  if (option->blocksize)
+    printf("\tInternal tiles: %dx%d\n", option->blocksize, option->blocksize);
+
+  for (size_t i = 0; i < option->creation_option_count; i++)
+    printf("\tCreation option: %s\n", option->creation_options[i]);
+
+  if (option->edge || option->overlap)
+    printf("\tEdge tiles: %s (fill: %d, overlap: %d)\n",
+           option->edge == EDGE_PAD ? "pad" : option->edge == EDGE_TRUNCATE ? "truncate" : "error", option->fill,
+           option->overlap);
+
+  if (option->vrt)
+    printf("\tVRT mosaic: %s\n", option->vrt);
+
+  if (option->archive)
+    printf("\tTile archive: %s\n", option->archive);
+
+  if (option->scale > 1)
+    printf("\tScale: 1/%d\n", option->scale);
+
+  if (option->has_bbox)
+    printf("\tArea of interest: %.1f,%.1f,%.1f,%.1f\n", option->bbox[0], option->bbox[1], option->bbox[2],
+           option->bbox[3]);
+
+  if (option->scratch)
+    printf("\tScratch cache: %s (%zu MB)\n", option->scratch, option->scratch_limit / (1024 * 1024));
+
+  if (option->pyramid)
+    printf("\tOverview levels: %d\n", option->pyramid);
+
+  if (option->hash_sources || option->force)
+    printf("\tUnchanged sources: %s\n", option->force ? "processed again" : "skipped, compared by CRC-32");
+
+  if (option->skip_empty)
+    printf("\tSkip empty tiles: threshold %d\n", option->empty_threshold);
+
+  if (option->png_profile || option->png_backend)
+    printf("\tPNG profile: %d (encoder: %s)\n", option->png_profile,
+           option->png_backend == PNG_BACKEND_LIBDEFLATE ? "libdeflate" : "libpng");
+
+  if (option->indir && option->jobs > 1)
+    printf("\tJobs: %d (GDAL cache per job: %zu MB)\n", option->jobs, option->cache_size / (1024 * 1024));
+
   if (option->indir)
     printf("\tInput directory:  %s\n", option->indir);
 
@@ -125,7 +289,18 @@ options *create_options(void)
     exit(EXIT_FAILURE);
   }
 
-  option->bands = calloc(3, sizeof(int));
+  option->jobs = 1;
+  option->segments = 1;
+  option->keep_archive = 1;
+  option->workers = 1;
+  option->threads = 1;
+  option->memory_limit = (size_t) 2048 * 1024 * 1024;
+  option->cache_size = (size_t) 64 * 1024 * 1024;
+  option->fill = -1;
+  option->scratch_limit = (size_t) 16384 * 1024 * 1024;
+  option->scale = 1;
+
+  option->bands = calloc(4, sizeof(int));
   if (option->bands == NULL) {
     fprintf(stderr, "ERROR: Fauiled to allocate options member");
     exit(EXIT_FAILURE);
@@ -141,7 +316,11 @@ void destroy_options(options *option)
   for (size_t type = 0; type < option->type_count; type++)
     free(option->requested_type[type]);
 
+  for (size_t co = 0; co < option->creation_option_count; co++)
+    free(option->creation_options[co]);
+
   free(option->year);
+  free(option->creation_options);
   free(option->requested_region);
   free(option->requested_type);
   free(option->bands);
@@ -342,7 +521,7 @@ int parse_bands(options *option, const char *optstring)
   int bands_given = 0;
   long int band_index;
 
-  while (*ptr && bands_given < 3) {
+  while (*ptr && bands_given < 4) {
     band_index = strtol(ptr, &endptr, 10);
 
     if ((band_index == 0 && ptr == endptr) || band_index == LONG_MIN || band_index == LONG_MAX) {
@@ -360,8 +539,9 @@ int parse_bands(options *option, const char *optstring)
     ptr++;
   }
 
-  if (bands_given != 3 && bands_given != 1) {
-    fprintf(stderr, "ERROR: Did not provide correct number of band indicies. Must be 1 or 3, got %d\n", bands_given);
+  if (bands_given != 4 && bands_given != 3 && bands_given != 1) {
+    fprintf(stderr, "ERROR: Did not provide correct number of band indicies. Must be 1, 3 or 4, got %d\n",
+            bands_given);
     return 1;
   }
 
@@ -369,3 +549,258 @@ int parse_bands(options *option, const char *optstring)
 
   return 0;
 }
+
+int parse_compression(options *option, const char *optstring)
+{
+  const char *allowed_codecs[] = { "NONE", "LZW", "DEFLATE", "ZSTD" };
+
+  for (size_t i = 0; i < sizeof(allowed_codecs) / sizeof(allowed_codecs[0]); i++)
+    if (strcasecmp(optstring, allowed_codecs[i]) == 0) {
+      option->compress = allowed_codecs[i];
+      return 0;
+    }
+
+  fprintf(stderr, "ERROR: Compression '%s' not allowed. Must be one of none, lzw, deflate or zstd\n", optstring);
+  return 1;
+}
+
+// GTiff creation option in the form KEY=VALUE, passed on to GDAL as-is
+int parse_creation_option(options *option, const char *optstring)
+{
+  char **newmem;
+  const char *equals = strchr(optstring, '=');
+
+  if (equals == NULL || equals == optstring) {
+    fprintf(stderr, "ERROR: Creation option '%s' is not of the form KEY=VALUE\n", optstring);
+    return 1;
+  }
+
+  newmem = realloc(option->creation_options, (option->creation_option_count + 1) * sizeof(char *));
+  if (newmem == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate memory for creation options.\n");
+    return 1;
+  }
+  option->creation_options = newmem;
+  option->creation_options[option->creation_option_count] = strdup(optstring);
+  if (option->creation_options[option->creation_option_count] == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate memory for creation option.\n");
+    return 1;
+  }
+  option->creation_option_count++;
+
+  return 0;
+}
+
+int parse_edge_mode(options *option, const char *optstring)
+{
+  const char *allowed_modes[] = { [EDGE_ERROR] = "error", [EDGE_PAD] = "pad", [EDGE_TRUNCATE] = "truncate" };
+
+  for (int i = EDGE_ERROR; i <= EDGE_TRUNCATE; i++)
+    if (strcmp(optstring, allowed_modes[i]) == 0) {
+      option->edge = i;
+      return 0;
+    }
+
+  fprintf(stderr, "ERROR: Edge mode '%s' not allowed. Must be one of pad, truncate or error\n", optstring);
+  return 1;
+}
+
+// '1/N' or 'N' for a power of two N; wavelet codecs and overviews halve the resolution level by level
+int parse_scale(options *option, const char *optstring)
+{
+  const char *denominator = strncmp(optstring, "1/", 2) == 0 ? optstring + 2 : optstring;
+  char *end = NULL;
+  long scale = strtol(denominator, &end, 10);
+
+  if (!isdigit((unsigned char) *denominator) || *end != '\0' || scale < 1 || scale > 64 || (scale & (scale - 1)) != 0) {
+    fprintf(stderr, "ERROR: Scale '%s' not allowed. Must be 1/N for N one of 1, 2, 4, ..., 64\n", optstring);
+    return 1;
+  }
+  option->scale = (int) scale;
+
+  return 0;
+}
+
+// 'minx,miny,maxx,maxy' in EPSG:25833, the coordinates of the tiles
+int parse_bbox(options *option, const char *optstring)
+{
+  double bbox[4];
+  int end = 0;
+
+  if (sscanf(optstring, "%lf,%lf,%lf,%lf%n", &bbox[0], &bbox[1], &bbox[2], &bbox[3], &end) != 4 ||
+      optstring[end] != '\0' || bbox[0] >= bbox[2] || bbox[1] >= bbox[3]) {
+    fprintf(stderr, "ERROR: Bounding box '%s' not allowed. Must be minx,miny,maxx,maxy in EPSG:25833\n", optstring);
+    return 1;
+  }
+  memcpy(option->bbox, bbox, sizeof(bbox));
+  option->has_bbox = 1;
+
+  return 0;
+}
+
+// envelope of all positions in the "coordinates" of a GeoJSON file, whatever geometries they belong to. Only the
+// first two values of a position are used; they need to be EPSG:25833, not the longitude and latitude RFC 7946 asks for
+int parse_aoi(options *option, const char *path)
+{
+  FILE *in = fopen(path, "r");
+  if (in == NULL) {
+    fprintf(stderr, "ERROR: Could not open area of interest '%s'\n", path);
+    return 1;
+  }
+
+  char *text = NULL;
+  long size = -1;
+  if (fseek(in, 0, SEEK_END) == 0 && (size = ftell(in)) >= 0 && fseek(in, 0, SEEK_SET) == 0)
+    text = malloc(size + 1);
+  if (text == NULL || fread(text, 1, size, in) != (size_t) size) {
+    fprintf(stderr, "ERROR: Could not read area of interest '%s'\n", path);
+    free(text);
+    fclose(in);
+    return 1;
+  }
+  text[size] = '\0';
+  fclose(in);
+
+  double bbox[4] = { DBL_MAX, DBL_MAX, -DBL_MAX, -DBL_MAX };
+  size_t positions = 0;
+  for (const char *key = strstr(text, "\"coordinates\""); key; key = strstr(key + 1, "\"coordinates\"")) {
+    const char *at = strchr(key, '[');
+    int depth = 0;
+    int axis = 0;
+    double x = 0;
+    while (at && *at) {
+      if (*at == '[' || *at == ']') {
+        depth += *at == '[' ? 1 : -1;
+        axis = 0;
+        at++;
+        if (depth == 0)
+          break;
+      } else if (*at == '-' || isdigit((unsigned char) *at)) {
+        char *end;
+        double value = strtod(at, &end);
+        if (axis == 0) {
+          x = value;
+        } else if (axis == 1) {
+          bbox[0] = x < bbox[0] ? x : bbox[0];
+          bbox[1] = value < bbox[1] ? value : bbox[1];
+          bbox[2] = x > bbox[2] ? x : bbox[2];
+          bbox[3] = value > bbox[3] ? value : bbox[3];
+          positions++;
+        }
+        axis++;
+        at = end > at ? end : at + 1;
+      } else {
+        at++;
+      }
+    }
+  }
+  free(text);
+
+  if (positions == 0) {
+    fprintf(stderr, "ERROR: No coordinates found in area of interest '%s'\n", path);
+    return 1;
+  }
+  if (bbox[0] >= -180 && bbox[2] <= 180 && bbox[1] >= -90 && bbox[3] <= 90) {
+    fprintf(stderr, "ERROR: Area of interest '%s' looks like longitude and latitude, expected EPSG:25833\n", path);
+    return 1;
+  }
+  memcpy(option->bbox, bbox, sizeof(bbox));
+  option->has_bbox = 1;
+
+  return 0;
+}
+
+/*
+ * The regions are offered as separate downloads without published extents. They are approximated by a 3x3 grid
+ * over Berlin in EPSG:25833, each cell widened by 2 km since the actual borders follow district lines, so an
+ * area near a line between two cells keeps the regions on both sides. A region is rather downloaded needlessly
+ * than missed.
+ */
+#define BERLIN_MIN_X 370000.0
+#define BERLIN_MAX_X 416000.0
+#define BERLIN_MIN_Y 5799000.0
+#define BERLIN_MAX_Y 5837000.0
+#define REGION_MARGIN 2000.0
+
+// drops the requested regions, all of them if none were given, that do not intersect option->bbox
+int select_regions(options *option)
+{
+  // column from west to east, row from south to north
+  const struct
+  {
+    const char *name;
+    int column;
+    int row;
+  } region_grid[] = {
+    { "Suedwest", 0, 0 }, { "Sued", 1, 0 }, { "Suedost", 2, 0 },
+    { "West", 0, 1 }, { "Mitte", 1, 1 }, { "Ost", 2, 1 },
+    { "Nordwest", 0, 2 }, { "Nord", 1, 2 }, { "Nordost", 2, 2 },
+  };
+  const double cell_x = (BERLIN_MAX_X - BERLIN_MIN_X) / 3;
+  const double cell_y = (BERLIN_MAX_Y - BERLIN_MIN_Y) / 3;
+
+  if (!option->has_bbox)
+    return 0;
+  if (option->region_count == 0 && parse_image_regions(option, "all"))
+    return 1;
+
+  size_t kept = 0;
+  for (size_t i = 0; i < option->region_count; i++) {
+    int intersects = 0;
+    for (size_t j = 0; j < sizeof(region_grid) / sizeof(region_grid[0]); j++) {
+      if (strcmp(option->requested_region[i], region_grid[j].name) != 0)
+        continue;
+      double min_x = BERLIN_MIN_X + region_grid[j].column * cell_x - REGION_MARGIN;
+      double min_y = BERLIN_MIN_Y + region_grid[j].row * cell_y - REGION_MARGIN;
+      intersects = option->bbox[0] < min_x + cell_x + 2 * REGION_MARGIN && option->bbox[2] > min_x &&
+                   option->bbox[1] < min_y + cell_y + 2 * REGION_MARGIN && option->bbox[3] > min_y;
+    }
+    if (intersects)
+      option->requested_region[kept++] = option->requested_region[i];
+    else
+      free(option->requested_region[i]);
+  }
+  option->region_count = kept;
+
+  if (kept == 0) {
+    fprintf(stderr, "ERROR: The area of interest lies outside of all requested regions\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+int parse_png_profile(options *option, const char *optstring)
+{
+  const char *allowed_profiles[] = { [PNG_PROFILE_FAST] = "fast", [PNG_PROFILE_BALANCED] = "balanced", [PNG_PROFILE_SMALL] = "small" };
+
+  for (int i = PNG_PROFILE_FAST; i <= PNG_PROFILE_SMALL; i++)
+    if (strcmp(optstring, allowed_profiles[i]) == 0) {
+      option->png_profile = i;
+      return 0;
+    }
+
+  fprintf(stderr, "ERROR: PNG profile '%s' not allowed. Must be one of fast, balanced or small\n", optstring);
+  return 1;
+}
+
+int parse_png_backend(options *option, const char *optstring)
+{
+  if (strcmp(optstring, "libpng") == 0) {
+    option->png_backend = PNG_BACKEND_LIBPNG;
+    return 0;
+  }
+
+  if (strcmp(optstring, "libdeflate") == 0) {
+#ifdef HAVE_LIBDEFLATE
+    option->png_backend = PNG_BACKEND_LIBDEFLATE;
+    return 0;
+#else
+    fprintf(stderr, "ERROR: PNG encoder 'libdeflate' not available. Rebuild with 'make LIBDEFLATE=1'\n");
+    return 1;
+#endif // HAVE_LIBDEFLATE
+  }
+
+  fprintf(stderr, "ERROR: PNG encoder '%s' not allowed. Must be one of libpng or libdeflate\n", optstring);
+  return 1;
+}
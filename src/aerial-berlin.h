@@ -10,6 +10,15 @@
 
 extern char *base_url;
 
+// zlib level, strategy and row filters used for PNGs; PNG_PROFILE_DEFAULT keeps libpng's own choices
+enum png_profile { PNG_PROFILE_DEFAULT = 0, PNG_PROFILE_FAST, PNG_PROFILE_BALANCED, PNG_PROFILE_SMALL };
+
+// library producing the compressed PNG stream; libdeflate is only available when built with LIBDEFLATE=1
+enum png_backend { PNG_BACKEND_LIBPNG = 0, PNG_BACKEND_LIBDEFLATE };
+
+// what ab-tile does when tiles do not fit a raster exactly: abort, pad the edge tiles to full size or write them smaller
+enum edge_mode { EDGE_ERROR = 0, EDGE_PAD, EDGE_TRUNCATE };
+
 typedef struct
 {
   size_t type_count;
@@ -21,6 +30,39 @@ typedef struct
   int allow_non_rectified;
   int convert_to_png;
   int verbose;
+  int jobs;
+  int segments;
+  char *extract_dir;
+  int keep_archive;
+  int workers;
+  int threads;
+  size_t memory_limit;
+  size_t cache_size;
+  const char *compress;
+  int predictor;
+  int level;
+  int blocksize;
+  int compress_threads;
+  size_t creation_option_count;
+  char **creation_options;
+  int skip_empty;
+  int empty_threshold;
+  int edge;
+  int fill;
+  int overlap;
+  int pyramid;
+  char *vrt;
+  char *archive;
+  char *scratch;
+  size_t scratch_limit;
+  int scale;
+  // area of interest in EPSG:25833 as min x, min y, max x, max y; only used if has_bbox is set
+  double bbox[4];
+  int has_bbox;
+  int hash_sources;
+  int force;
+  int png_profile;
+  int png_backend;
   char *prefix;
   int rsize;
   int csize;
@@ -36,6 +78,8 @@ void print_tile_help(void);
 
 void print_convert_help(void);
 
+void print_pipeline_help(void);
+
 void print_version(void);
 
 void print_options(const options *option);
@@ -52,4 +96,22 @@ int parse_image_regions(options *option, const char *optstring);
 
 int parse_bands(options *option, const char *optstring);
 
+int parse_compression(options *option, const char *optstring);
+
+int parse_creation_option(options *option, const char *optstring);
+
+int parse_edge_mode(options *option, const char *optstring);
+
+int parse_scale(options *option, const char *optstring);
+
+int parse_bbox(options *option, const char *optstring);
+
+int parse_aoi(options *option, const char *path);
+
+int select_regions(options *option);
+
+int parse_png_profile(options *option, const char *optstring);
+
+int parse_png_backend(options *option, const char *optstring);
+
 #endif // AERIAL_BERLIN_H
\ No newline at end of file
@@ -0,0 +1,389 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "archive.h"
+
+/*
+ * Layout, all integers little endian:
+ *   header   "ABTILES\0", u32 version, u32 reserved
+ *   tiles    the tiles' file contents back to back, in the order they were appended
+ *   index    per tile: u64 offset, u64 size, i32 level, i32 x, i32 y, u16 name length, u16 source length, name, source
+ *   footer   u64 index offset, u64 tile count, "ABINDEX\0"
+ * The index is sorted by source, level, y and x, so lookups are a binary search.
+ */
+#define ARCHIVE_MAGIC "ABTILES"
+#define ARCHIVE_INDEX_MAGIC "ABINDEX"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_HEADER_SIZE 16
+#define ARCHIVE_FOOTER_SIZE 24
+#define ARCHIVE_ENTRY_SIZE 32
+
+static void put_u16(uint8_t *out, uint16_t value)
+{
+  out[0] = value & 0xff;
+  out[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *out, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+    out[i] = (value >> (8 * i)) & 0xff;
+}
+
+static void put_u64(uint8_t *out, uint64_t value)
+{
+  for (int i = 0; i < 8; i++)
+    out[i] = (value >> (8 * i)) & 0xff;
+}
+
+static uint16_t get_u16(const uint8_t *in)
+{
+  return (uint16_t) (in[0] | in[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *in)
+{
+  uint32_t value = 0;
+  for (int i = 3; i >= 0; i--)
+    value = value << 8 | in[i];
+  return value;
+}
+
+static uint64_t get_u64(const uint8_t *in)
+{
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--)
+    value = value << 8 | in[i];
+  return value;
+}
+
+// like pwrite/pread, but retried until all of 'size' bytes are transferred
+static int write_at(int fd, const uint8_t *data, size_t size, uint64_t offset)
+{
+  while (size) {
+    ssize_t written = pwrite(fd, data, size, (off_t) offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return 1;
+    data += written;
+    size -= (size_t) written;
+    offset += (uint64_t) written;
+  }
+  return 0;
+}
+
+static int read_at(int fd, uint8_t *data, size_t size, uint64_t offset)
+{
+  while (size) {
+    ssize_t read = pread(fd, data, size, (off_t) offset);
+    if (read < 0 && errno == EINTR)
+      continue;
+    if (read <= 0)
+      return 1;
+    data += read;
+    size -= (size_t) read;
+    offset += (uint64_t) read;
+  }
+  return 0;
+}
+
+static int compare_key(const char *source, int level, int x, int y, const archive_entry *entry)
+{
+  int order = strcmp(source, entry->source);
+  if (order == 0)
+    order = (level > entry->level) - (level < entry->level);
+  if (order == 0)
+    order = (y > entry->y) - (y < entry->y);
+  if (order == 0)
+    order = (x > entry->x) - (x < entry->x);
+  return order;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+  const archive_entry *left = (const archive_entry *) a;
+  return compare_key(left->source, left->level, left->x, left->y, (const archive_entry *) b);
+}
+
+// archives are referred to by absolute path, so that /vsisubfile/ names stay valid from any directory
+static tile_archive *allocate_archive(const char *path)
+{
+  tile_archive *archive = calloc(1, sizeof(tile_archive));
+  char *resolved = realpath(path, NULL);
+  if (archive == NULL || resolved == NULL) {
+    fprintf(stderr, "ERROR: Failed to open tile archive '%s'\n", path);
+    free(archive);
+    free(resolved);
+    return NULL;
+  }
+  archive->path = resolved;
+  archive->fd = -1;
+  pthread_mutex_init(&archive->lock, NULL);
+
+  return archive;
+}
+
+// creates or truncates 'path'; tiles are appended by tile_archive_append and indexed by close_tile_archive
+tile_archive *create_tile_archive(const char *path)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: Could not create tile archive '%s'\n", path);
+    return NULL;
+  }
+
+  tile_archive *archive = allocate_archive(path);
+  if (archive == NULL) {
+    close(fd);
+    unlink(path);
+    return NULL;
+  }
+  archive->fd = fd;
+  archive->writable = 1;
+
+  uint8_t header[ARCHIVE_HEADER_SIZE] = ARCHIVE_MAGIC;
+  put_u32(header + 8, ARCHIVE_VERSION);
+  if (write_at(fd, header, sizeof(header), 0)) {
+    fprintf(stderr, "ERROR: Could not write tile archive '%s'\n", path);
+    destroy_tile_archive(archive);
+    return NULL;
+  }
+  archive->end = ARCHIVE_HEADER_SIZE;
+
+  return archive;
+}
+
+// safe to call from several threads: space is reserved under the lock, the tile itself is written outside of it.
+// The offset of the tile within the archive is stored in 'offset' unless it is NULL
+int tile_archive_append(tile_archive *archive, const char *name, const char *source, int level, int x, int y,
+                        const uint8_t *data, size_t size, uint64_t *offset)
+{
+  archive_entry entry = {
+    .name = strdup(name), .source = strdup(source), .level = level, .x = x, .y = y, .size = size
+  };
+  if (entry.name == NULL || entry.source == NULL || strlen(name) > UINT16_MAX || strlen(source) > UINT16_MAX) {
+    fprintf(stderr, "ERROR: Failed to add '%s' to tile archive\n", name);
+    free(entry.name);
+    free(entry.source);
+    return 1;
+  }
+
+  pthread_mutex_lock(&archive->lock);
+  entry.offset = archive->end;
+  archive->end += size;
+  pthread_mutex_unlock(&archive->lock);
+
+  if (write_at(archive->fd, data, size, entry.offset)) {
+    fprintf(stderr, "ERROR: Could not write '%s' to tile archive '%s'\n", name, archive->path);
+    free(entry.name);
+    free(entry.source);
+    return 1;
+  }
+
+  pthread_mutex_lock(&archive->lock);
+  if (archive->count == archive->capacity) {
+    size_t capacity = archive->capacity ? 2 * archive->capacity : 1024;
+    archive_entry *entries = realloc(archive->entries, capacity * sizeof(archive_entry));
+    if (entries == NULL) {
+      pthread_mutex_unlock(&archive->lock);
+      fprintf(stderr, "ERROR: Failed to add '%s' to tile archive\n", name);
+      free(entry.name);
+      free(entry.source);
+      return 1;
+    }
+    archive->entries = entries;
+    archive->capacity = capacity;
+  }
+  archive->entries[archive->count++] = entry;
+  pthread_mutex_unlock(&archive->lock);
+
+  if (offset)
+    *offset = entry.offset;
+
+  return 0;
+}
+
+// writes the index and footer after the last tile. Frees the archive either way
+int close_tile_archive(tile_archive *archive)
+{
+  if (archive->count)
+    qsort(archive->entries, archive->count, sizeof(archive_entry), compare_entries);
+
+  size_t index_size = ARCHIVE_FOOTER_SIZE;
+  for (size_t i = 0; i < archive->count; i++)
+    index_size += ARCHIVE_ENTRY_SIZE + strlen(archive->entries[i].name) + strlen(archive->entries[i].source);
+
+  uint8_t *index = malloc(index_size);
+  if (index == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate index of tile archive '%s'\n", archive->path);
+    destroy_tile_archive(archive);
+    return 1;
+  }
+
+  uint8_t *cursor = index;
+  for (size_t i = 0; i < archive->count; i++) {
+    const archive_entry *entry = &archive->entries[i];
+    size_t name_length = strlen(entry->name);
+    size_t source_length = strlen(entry->source);
+    put_u64(cursor, entry->offset);
+    put_u64(cursor + 8, entry->size);
+    put_u32(cursor + 16, (uint32_t) entry->level);
+    put_u32(cursor + 20, (uint32_t) entry->x);
+    put_u32(cursor + 24, (uint32_t) entry->y);
+    put_u16(cursor + 28, (uint16_t) name_length);
+    put_u16(cursor + 30, (uint16_t) source_length);
+    memcpy(cursor + ARCHIVE_ENTRY_SIZE, entry->name, name_length);
+    memcpy(cursor + ARCHIVE_ENTRY_SIZE + name_length, entry->source, source_length);
+    cursor += ARCHIVE_ENTRY_SIZE + name_length + source_length;
+  }
+  put_u64(cursor, archive->end);
+  put_u64(cursor + 8, archive->count);
+  memcpy(cursor + 16, ARCHIVE_INDEX_MAGIC, 8);
+
+  int status = write_at(archive->fd, index, index_size, archive->end) || close(archive->fd) != 0;
+  archive->fd = -1;
+  free(index);
+  if (status)
+    fprintf(stderr, "ERROR: Could not write index of tile archive '%s'\n", archive->path);
+
+  // without its index the archive is unusable and removed
+  archive->writable = status;
+  destroy_tile_archive(archive);
+
+  return status;
+}
+
+// reads the index of a closed archive; the tiles themselves stay on disk
+tile_archive *open_tile_archive(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: Could not open tile archive '%s'\n", path);
+    return NULL;
+  }
+
+  tile_archive *archive = allocate_archive(path);
+  if (archive == NULL) {
+    close(fd);
+    return NULL;
+  }
+  archive->fd = fd;
+
+  uint8_t header[ARCHIVE_HEADER_SIZE];
+  uint8_t footer[ARCHIVE_FOOTER_SIZE];
+  off_t end = lseek(fd, 0, SEEK_END);
+  if (end < ARCHIVE_HEADER_SIZE + ARCHIVE_FOOTER_SIZE || read_at(fd, header, sizeof(header), 0) ||
+      read_at(fd, footer, sizeof(footer), (uint64_t) end - ARCHIVE_FOOTER_SIZE) ||
+      memcmp(header, ARCHIVE_MAGIC, 8) != 0 || get_u32(header + 8) != ARCHIVE_VERSION ||
+      memcmp(footer + 16, ARCHIVE_INDEX_MAGIC, 8) != 0) {
+    fprintf(stderr, "ERROR: '%s' is not a complete tile archive\n", path);
+    destroy_tile_archive(archive);
+    return NULL;
+  }
+
+  archive->end = get_u64(footer);
+  uint64_t count = get_u64(footer + 8);
+  uint64_t index_size = (uint64_t) end - ARCHIVE_FOOTER_SIZE - archive->end;
+  uint8_t *index = archive->end <= (uint64_t) end - ARCHIVE_FOOTER_SIZE && count <= index_size / ARCHIVE_ENTRY_SIZE ?
+                   malloc(index_size ? index_size : 1) : NULL;
+  archive->entries = index ? calloc(count ? count : 1, sizeof(archive_entry)) : NULL;
+  if (archive->entries == NULL || read_at(fd, index, index_size, archive->end)) {
+    fprintf(stderr, "ERROR: Could not read index of tile archive '%s'\n", path);
+    free(index);
+    destroy_tile_archive(archive);
+    return NULL;
+  }
+
+  const uint8_t *cursor = index;
+  const uint8_t *index_end = index + index_size;
+  int corrupt = 0;
+  while (archive->count < count && !corrupt) {
+    archive_entry *entry = &archive->entries[archive->count++];
+    if (index_end - cursor < ARCHIVE_ENTRY_SIZE) {
+      corrupt = 1;
+      break;
+    }
+    size_t name_length = get_u16(cursor + 28);
+    size_t source_length = get_u16(cursor + 30);
+    if ((size_t) (index_end - cursor) < ARCHIVE_ENTRY_SIZE + name_length + source_length) {
+      corrupt = 1;
+      break;
+    }
+    entry->offset = get_u64(cursor);
+    entry->size = get_u64(cursor + 8);
+    entry->level = (int32_t) get_u32(cursor + 16);
+    entry->x = (int32_t) get_u32(cursor + 20);
+    entry->y = (int32_t) get_u32(cursor + 24);
+    entry->name = strndup((const char *) cursor + ARCHIVE_ENTRY_SIZE, name_length);
+    entry->source = strndup((const char *) cursor + ARCHIVE_ENTRY_SIZE + name_length, source_length);
+    corrupt = entry->name == NULL || entry->source == NULL || entry->offset + entry->size > archive->end;
+    cursor += ARCHIVE_ENTRY_SIZE + name_length + source_length;
+  }
+  free(index);
+
+  if (corrupt) {
+    fprintf(stderr, "ERROR: Corrupt index in tile archive '%s'\n", path);
+    destroy_tile_archive(archive);
+    return NULL;
+  }
+
+  return archive;
+}
+
+// NULL if the archive holds no such tile
+const archive_entry *tile_archive_find(const tile_archive *archive, const char *source, int level, int x, int y)
+{
+  size_t low = 0;
+  size_t high = archive->count;
+
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    int order = compare_key(source, level, x, y, &archive->entries[middle]);
+    if (order == 0)
+      return &archive->entries[middle];
+    if (order < 0)
+      high = middle;
+    else
+      low = middle + 1;
+  }
+
+  return NULL;
+}
+
+// GDAL path reading the 'size' bytes at 'offset' in place: '/vsisubfile/<offset>_<size>,<archive>'
+int tile_archive_subfile(const tile_archive *archive, uint64_t offset, uint64_t size, char *path, size_t path_size)
+{
+  int written = snprintf(path, path_size, "/vsisubfile/%llu_%llu,%s", (unsigned long long) offset,
+                         (unsigned long long) size, archive->path);
+  if (written < 0 || (size_t) written >= path_size) {
+    fprintf(stderr, "ERROR: Path into tile archive '%s' too long\n", archive->path);
+    return 1;
+  }
+
+  return 0;
+}
+
+// an archive still open for writing has no index and is removed
+void destroy_tile_archive(tile_archive *archive)
+{
+  if (archive == NULL)
+    return;
+  if (archive->fd >= 0)
+    close(archive->fd);
+  if (archive->writable)
+    unlink(archive->path);
+  for (size_t i = 0; i < archive->count; i++) {
+    free(archive->entries[i].name);
+    free(archive->entries[i].source);
+  }
+  free(archive->entries);
+  free(archive->path);
+  pthread_mutex_destroy(&archive->lock);
+  free(archive);
+}
@@ -0,0 +1,49 @@
+#ifndef _ARCHIVE_H
+#define _ARCHIVE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// one tile stored in the archive: its file name, the raster and grid position it came from and where its bytes are
+typedef struct
+{
+  char *name;
+  char *source;
+  int level;
+  int x;
+  int y;
+  uint64_t offset;
+  uint64_t size;
+} archive_entry;
+
+// single file holding many tiles back to back, followed by an index of all of them written on close. Tiles are
+// appended from any thread; once closed, every tile can be read in place, e.g. through GDAL's /vsisubfile/.
+typedef struct
+{
+  char *path;
+  int fd;
+  int writable;
+  uint64_t end;
+  archive_entry *entries;
+  size_t count;
+  size_t capacity;
+  pthread_mutex_t lock;
+} tile_archive;
+
+tile_archive *create_tile_archive(const char *path);
+
+int tile_archive_append(tile_archive *archive, const char *name, const char *source, int level, int x, int y,
+                        const uint8_t *data, size_t size, uint64_t *offset);
+
+int close_tile_archive(tile_archive *archive);
+
+tile_archive *open_tile_archive(const char *path);
+
+const archive_entry *tile_archive_find(const tile_archive *archive, const char *source, int level, int x, int y);
+
+int tile_archive_subfile(const tile_archive *archive, uint64_t offset, uint64_t size, char *path, size_t path_size);
+
+void destroy_tile_archive(tile_archive *archive);
+
+#endif // _ARCHIVE_H
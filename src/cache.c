@@ -0,0 +1,311 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "cache.h"
+
+/*
+ * Every cache entry is one file: a page sized header describing the raster and the source it was decoded from,
+ * followed by all of its pixels as rows of pixel-interleaved bytes, so that a strip is a plain slice of the mapping.
+ * Entries are written to '<name>.tmp' and renamed once complete. Using an entry updates its mtime, which orders
+ * the eviction.
+ */
+#define CACHE_MAGIC "ABRAW01"
+#define CACHE_HEADER_SIZE 4096
+#define CACHE_EXTENSION ".raw"
+
+typedef struct
+{
+  char magic[8];
+  int32_t columns;
+  int32_t rows;
+  int32_t nbands;
+  int32_t reserved;
+  double geo_transform[6];
+  int64_t source_size;
+  int64_t source_mtime;
+  char source[CACHE_HEADER_SIZE - 88];
+} cache_header;
+
+_Static_assert(sizeof(cache_header) == CACHE_HEADER_SIZE, "cache header must fill one page");
+
+struct cache_writer
+{
+  char path[1024];
+  char tmp_path[1024 + 4];
+  int fd;
+  size_t row_size;
+  int strips_left;
+  int failed;
+  pthread_mutex_t lock;
+};
+
+raster_cache *create_raster_cache(const char *directory, size_t limit)
+{
+  raster_cache *cache = calloc(1, sizeof(raster_cache));
+  if (cache == NULL || (cache->directory = strdup(directory)) == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate raster cache.\n");
+    free(cache);
+    return NULL;
+  }
+  cache->limit = limit;
+
+  return cache;
+}
+
+size_t raster_cache_entry_size(int columns, int rows, int nbands)
+{
+  return CACHE_HEADER_SIZE + (size_t) columns * rows * nbands;
+}
+
+// '<directory>/<file name of the source>-<CRC-32 of its path>-<columns>x<rows>.raw', readable yet unique for sources
+// of equal name and for the scales a source is decoded at
+static int entry_path(const raster_cache *cache, const char *source, int columns, int rows, char *path, size_t size)
+{
+  const char *name = strrchr(source, '/');
+  name = name ? name + 1 : source;
+  uLong checksum = crc32(crc32(0L, Z_NULL, 0), (const Bytef *) source, (uInt) strlen(source));
+
+  int written = snprintf(path, size, "%s%s%s-%08lx-%dx%d%s", cache->directory,
+                         cache->directory[strlen(cache->directory) - 1] == '/' ? "" : "/", name, checksum, columns,
+                         rows, CACHE_EXTENSION);
+  if (written < 0 || (size_t) written >= size) {
+    fprintf(stderr, "ERROR: Cache path for '%s' too long\n", source);
+    return 1;
+  }
+
+  return 0;
+}
+
+static void fill_header(cache_header *header, const char *source, const source_stamp *stamp, int columns, int rows,
+                        int nbands, const double geo_transform[6])
+{
+  memset(header, 0, sizeof(cache_header));
+  memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+  header->columns = columns;
+  header->rows = rows;
+  header->nbands = nbands;
+  memcpy(header->geo_transform, geo_transform, sizeof(header->geo_transform));
+  header->source_size = stamp->size;
+  header->source_mtime = stamp->mtime;
+  snprintf(header->source, sizeof(header->source), "%s", source);
+}
+
+// maps the decoded pixels of 'source' if the cache holds them for the source as it is now; 0 on a hit
+int raster_cache_map(const raster_cache *cache, const char *source, const source_stamp *stamp, int columns,
+                     int rows, int nbands, const double geo_transform[6], cached_raster *raster)
+{
+  char path[1024];
+  struct stat entry_stat;
+  size_t size = raster_cache_entry_size(columns, rows, nbands);
+
+  if (entry_path(cache, source, columns, rows, path, sizeof(path)))
+    return 1;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 1;
+  if (fstat(fd, &entry_stat) != 0 || (size_t) entry_stat.st_size != size) {
+    close(fd);
+    return 1;
+  }
+
+  void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 1;
+
+  cache_header expected;
+  fill_header(&expected, source, stamp, columns, rows, nbands, geo_transform);
+  if (memcmp(map, &expected, sizeof(cache_header)) != 0) {
+    munmap(map, size);
+    return 1;
+  }
+
+  // strips are taken from top to bottom
+  madvise(map, size, MADV_SEQUENTIAL);
+  // most recently used entries are evicted last
+  utimensat(AT_FDCWD, path, NULL, 0);
+
+  raster->map = map;
+  raster->map_size = size;
+  raster->pixels = (const uint8_t *) map + CACHE_HEADER_SIZE;
+
+  return 0;
+}
+
+void raster_cache_unmap(cached_raster *raster)
+{
+  if (raster->map)
+    munmap(raster->map, raster->map_size);
+  *raster = (cached_raster) {
+    0
+  };
+}
+
+// 'strips' calls of cache_writer_put complete the entry; NULL if it cannot be created
+cache_writer *raster_cache_begin(const raster_cache *cache, const char *source, const source_stamp *stamp,
+                                 int columns, int rows, int nbands, const double geo_transform[6], int strips)
+{
+  cache_writer *writer = calloc(1, sizeof(cache_writer));
+  if (writer == NULL)
+    return NULL;
+  if (entry_path(cache, source, columns, rows, writer->path, sizeof(writer->path))) {
+    free(writer);
+    return NULL;
+  }
+  snprintf(writer->tmp_path, sizeof(writer->tmp_path), "%s.tmp", writer->path);
+
+  cache_header header;
+  fill_header(&header, source, stamp, columns, rows, nbands, geo_transform);
+  writer->fd = open(writer->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (writer->fd < 0 || ftruncate(writer->fd, (off_t) raster_cache_entry_size(columns, rows, nbands)) != 0 ||
+      pwrite(writer->fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+    fprintf(stderr, "WARNING: Could not create cache entry '%s'\n", writer->tmp_path);
+    if (writer->fd >= 0) {
+      close(writer->fd);
+      unlink(writer->tmp_path);
+    }
+    free(writer);
+    return NULL;
+  }
+  writer->row_size = (size_t) columns * nbands;
+  writer->strips_left = strips;
+  pthread_mutex_init(&writer->lock, NULL);
+
+  return writer;
+}
+
+// stores 'rows' decoded rows starting at 'row'; safe to call from several threads. The call storing the last strip
+// publishes the entry. A failed write only drops the entry, tiling carries on
+int cache_writer_put(cache_writer *writer, int row, const uint8_t *data, int rows)
+{
+  size_t size = (size_t) rows * writer->row_size;
+  off_t offset = (off_t) (CACHE_HEADER_SIZE + (size_t) row * writer->row_size);
+  int failed = 0;
+
+  while (size && !failed) {
+    ssize_t written = pwrite(writer->fd, data, size, offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    failed = written <= 0;
+    if (!failed) {
+      data += written;
+      size -= (size_t) written;
+      offset += written;
+    }
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  writer->failed |= failed;
+  int complete = --writer->strips_left == 0;
+  pthread_mutex_unlock(&writer->lock);
+  if (!complete)
+    return 0;
+
+  if (close(writer->fd) != 0 || writer->failed || rename(writer->tmp_path, writer->path) != 0) {
+    fprintf(stderr, "WARNING: Could not write cache entry '%s'\n", writer->path);
+    writer->failed = 1;
+  }
+  writer->fd = -1;
+
+  return writer->failed;
+}
+
+// an entry that did not receive all of its strips is discarded
+void cache_writer_close(cache_writer *writer)
+{
+  if (writer == NULL)
+    return;
+  if (writer->fd >= 0) {
+    close(writer->fd);
+    unlink(writer->tmp_path);
+  } else if (writer->failed) {
+    unlink(writer->tmp_path);
+  }
+  pthread_mutex_destroy(&writer->lock);
+  free(writer);
+}
+
+typedef struct
+{
+  char *path;
+  size_t size;
+  struct timespec used;
+} cache_file;
+
+static int least_recently_used_first(const void *a, const void *b)
+{
+  const struct timespec *left = &((const cache_file *) a)->used;
+  const struct timespec *right = &((const cache_file *) b)->used;
+
+  if (left->tv_sec != right->tv_sec)
+    return (left->tv_sec > right->tv_sec) - (left->tv_sec < right->tv_sec);
+  return (left->tv_nsec > right->tv_nsec) - (left->tv_nsec < right->tv_nsec);
+}
+
+static int is_entry(const char *name)
+{
+  size_t length = strlen(name);
+  return length > strlen(CACHE_EXTENSION) && strcmp(name + length - strlen(CACHE_EXTENSION), CACHE_EXTENSION) == 0;
+}
+
+// removes the least recently used entries until those left take up at most 'keep' bytes
+void raster_cache_trim(const raster_cache *cache, size_t keep)
+{
+  DIR *dir = opendir(cache->directory);
+  if (dir == NULL)
+    return;
+
+  cache_file *files = NULL;
+  size_t count = 0, capacity = 0, total = 0;
+  struct dirent *d_entry;
+  while ((d_entry = readdir(dir))) {
+    char path[1024];
+    struct stat entry_stat;
+    if (!is_entry(d_entry->d_name) ||
+        snprintf(path, sizeof(path), "%s/%s", cache->directory, d_entry->d_name) >= (int) sizeof(path) ||
+        stat(path, &entry_stat) != 0)
+      continue;
+    if (count == capacity) {
+      capacity = capacity ? 2 * capacity : 64;
+      cache_file *grown = realloc(files, capacity * sizeof(cache_file));
+      if (grown == NULL)
+        break;
+      files = grown;
+    }
+    files[count].path = strdup(path);
+    if (files[count].path == NULL)
+      break;
+    files[count].size = (size_t) entry_stat.st_size;
+    files[count].used = entry_stat.st_mtim;
+    total += files[count].size;
+    count++;
+  }
+  closedir(dir);
+
+  if (count)
+    qsort(files, count, sizeof(cache_file), least_recently_used_first);
+  for (size_t i = 0; i < count && total > keep; i++) {
+    if (unlink(files[i].path) == 0)
+      total -= files[i].size;
+  }
+
+  for (size_t i = 0; i < count; i++)
+    free(files[i].path);
+  free(files);
+}
+
+void destroy_raster_cache(raster_cache *cache)
+{
+  if (cache == NULL)
+    return;
+  free(cache->directory);
+  free(cache);
+}
@@ -0,0 +1,48 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "manifest.h"
+
+// directory of decoded source rasters, kept below 'limit' bytes by evicting the least recently used ones
+typedef struct
+{
+  char *directory;
+  size_t limit;
+} raster_cache;
+
+// decoded pixels of one raster, pixel-interleaved bytes as read by tile_files, mapped from the cache
+typedef struct
+{
+  const uint8_t *pixels;
+  void *map;
+  size_t map_size;
+} cached_raster;
+
+// fills a new cache entry from the strips of a raster as they are decoded, possibly by several threads
+typedef struct cache_writer cache_writer;
+
+raster_cache *create_raster_cache(const char *directory, size_t limit);
+
+int raster_cache_map(const raster_cache *cache, const char *source, const source_stamp *stamp, int columns,
+                     int rows, int nbands, const double geo_transform[6], cached_raster *raster);
+
+void raster_cache_unmap(cached_raster *raster);
+
+cache_writer *raster_cache_begin(const raster_cache *cache, const char *source, const source_stamp *stamp,
+                                 int columns, int rows, int nbands, const double geo_transform[6], int strips);
+
+int cache_writer_put(cache_writer *writer, int row, const uint8_t *data, int rows);
+
+void cache_writer_close(cache_writer *writer);
+
+size_t raster_cache_entry_size(int columns, int rows, int nbands);
+
+void raster_cache_trim(const raster_cache *cache, size_t keep);
+
+void destroy_raster_cache(raster_cache *cache);
+
+#endif // _CACHE_H
@@ -1,9 +1,19 @@
+#define _GNU_SOURCE  // fallocate
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <curl/curl.h>
 #include <curl/easy.h>
+#include <curl/multi.h>
+#include <stdio.h>
+#include <zlib.h>
 
 #include "download.h"
+#include "zipstream.h"
 #include "aerial-berlin.h"
 
 Node *queue_from_options(const options *option)
@@ -46,92 +56,1146 @@ Node *dequeue(Node **queue)
   return item;
 }
 
-void download_datasets(Node *queue, const char *to, const int verbose)
+// copies a header value without the trailing CRLF, returns 1 if it did not fit
+static int copy_header_value(char *dst, size_t size, const char *value, size_t length)
+{
+  while (length && (value[length - 1] == '\r' || value[length - 1] == '\n' || value[length - 1] == ' '))
+    length--;
+  while (length && *value == ' ') {
+    value++;
+    length--;
+  }
+  if (length >= size)
+    return 1;
+  memcpy(dst, value, length);
+  dst[length] = '\0';
+  return 0;
+}
+
+/*
+ * The manifest lives in the output directory and remembers what was downloaded from where.
+ * One tab-separated line per URL: url, local file, size, CRC-32 of the local file, ETag and Last-Modified.
+ * Files that still match their entry are requested conditionally and left untouched on 304.
+ */
+#define MANIFEST_NAME ".ab-download-manifest"
+#define MANIFEST_HEADER "# ab-download manifest v1"
+
+typedef struct
+{
+  char *url;
+  char *file;
+  curl_off_t size;
+  unsigned long checksum;
+  char etag[256];
+  char last_modified[64];
+} manifest_entry;
+
+typedef struct
+{
+  char *path;
+  manifest_entry *entries;
+  size_t count;
+} manifest;
+
+static manifest_entry *manifest_lookup(const manifest *cache, const char *url)
+{
+  for (size_t i = 0; i < cache->count; i++)
+    if (strcmp(cache->entries[i].url, url) == 0)
+      return &cache->entries[i];
+  return NULL;
+}
+
+static manifest_entry *manifest_insert(manifest *cache, const char *url, const char *file)
+{
+  manifest_entry *entry = manifest_lookup(cache, url);
+  if (entry) {
+    if (strcmp(entry->file, file) != 0) {
+      char *copy = strdup(file);
+      if (copy == NULL)
+        return NULL;
+      free(entry->file);
+      entry->file = copy;
+    }
+    return entry;
+  }
+
+  manifest_entry *newmem = realloc(cache->entries, (cache->count + 1) * sizeof(manifest_entry));
+  if (newmem == NULL)
+    return NULL;
+  cache->entries = newmem;
+
+  entry = &cache->entries[cache->count];
+  memset(entry, 0, sizeof(manifest_entry));
+  entry->url = strdup(url);
+  entry->file = strdup(file);
+  if (entry->url == NULL || entry->file == NULL) {
+    free(entry->url);
+    free(entry->file);
+    return NULL;
+  }
+  cache->count++;
+
+  return entry;
+}
+
+static manifest *load_manifest(const char *directory)
+{
+  char line[2048];
+  manifest *cache = calloc(1, sizeof(manifest));
+  if (cache == NULL)
+    return NULL;
+
+  cache->path = calloc(1024, sizeof(char));
+  if (cache->path == NULL || snprintf(cache->path, 1024, "%s/%s", directory, MANIFEST_NAME) >= 1024) {
+    free(cache->path);
+    free(cache);
+    return NULL;
+  }
+
+  FILE *in = fopen(cache->path, "r");
+  if (in == NULL)
+    return cache;
+
+  while (fgets(line, sizeof(line), in)) {
+    char *cursor = line;
+    char *fields[6];
+    int nfields = 0;
+
+    if (*line == '#')
+      continue;
+    line[strcspn(line, "\n")] = '\0';
+    while (nfields < 6 && (fields[nfields] = strsep(&cursor, "\t")) != NULL)
+      nfields++;
+    if (nfields != 6)
+      continue;
+
+    manifest_entry *entry = manifest_insert(cache, fields[0], fields[1]);
+    if (entry == NULL)
+      break;
+    entry->size = strtoll(fields[2], NULL, 10);
+    entry->checksum = strtoul(fields[3], NULL, 16);
+    copy_header_value(entry->etag, sizeof(entry->etag), fields[4], strlen(fields[4]));
+    copy_header_value(entry->last_modified, sizeof(entry->last_modified), fields[5], strlen(fields[5]));
+  }
+  fclose(in);
+
+  return cache;
+}
+
+// written to a temporary file first so an interrupted run never leaves a truncated manifest
+static int save_manifest(const manifest *cache)
+{
+  char tmp_path[1024 + 4];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache->path);
+
+  FILE *out = fopen(tmp_path, "w");
+  if (out == NULL)
+    return 1;
+
+  fprintf(out, "%s\n", MANIFEST_HEADER);
+  for (size_t i = 0; i < cache->count; i++) {
+    const manifest_entry *entry = &cache->entries[i];
+    fprintf(out, "%s\t%s\t%" CURL_FORMAT_CURL_OFF_T "\t%08lx\t%s\t%s\n",
+            entry->url, entry->file, entry->size, entry->checksum, entry->etag, entry->last_modified);
+  }
+
+  if (fclose(out) != 0 || rename(tmp_path, cache->path) != 0) {
+    unlink(tmp_path);
+    return 1;
+  }
+
+  return 0;
+}
+
+static void destroy_manifest(manifest *cache)
+{
+  if (cache == NULL)
+    return;
+  for (size_t i = 0; i < cache->count; i++) {
+    free(cache->entries[i].url);
+    free(cache->entries[i].file);
+  }
+  free(cache->entries);
+  free(cache->path);
+  free(cache);
+}
+
+// smallest byte range worth its own connection when splitting a file with --segments
+#define SEGMENT_MIN_SIZE (4L * 1024 * 1024)
+
+// one byte range of a segmented transfer, written with pwrite into the preallocated .part file
+typedef struct
+{
+  CURL *handle;
+  struct transfer *owner;
+  curl_off_t start;
+  curl_off_t offset;  // next byte to be written
+  curl_off_t end;     // inclusive
+  unsigned long checksum;
+  int started;
+  int done;
+} segment;
+
+// a single in-flight request; owned by the multi loop in download_datasets
+typedef struct transfer
 {
   Node *item;
+  CURL *handle;
+  FILE *fout;
+  char *request_url;
+  char *out_path;
+  char *part_path;
+  char *journal_path;
+  struct curl_slist *headers;
+  curl_off_t resume_from;
+  curl_off_t expected_size;
+  char etag[256];
+  char last_modified[64];
+  int journaled;
+  int conditional;
+  unsigned long checksum;
+  manifest *cache;
+  zipstream *zs;
+  int started;
+  int accept_ranges;
+  int probing;
+  const options *option;
+  download_callback on_download;
+  void *user;
+  int fd;
+  segment *segments;
+  int segment_count;
+  int segments_left;
+  CURLcode segment_result;
+} transfer;
 
-  CURL *handle = curl_easy_init();
-  curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
-
-  while (1) {
-    item = dequeue(&queue);
-    int written = 0;
-    char *request_url = calloc(1024, sizeof(char));
-    if (*item->year != 1928) {
-      written = snprintf(request_url, 1024, "%s/DOP/dop20%s%s_%d/%s.zip",
-                         base_url,
-                         *item->non_rectified ? "" : "true_",
-                         item->type,
+// returns NULL once the queue is drained; the last node is detected by being the queue root itself
+static Node *next_item(Node **queue)
+{
+  if (*queue == NULL)
+    return NULL;
+
+  Node *item = dequeue(queue);
+  if (item == *queue)
+    *queue = NULL;
+
+  return item;
+}
+
+static int build_request_url(const Node *item, char *buffer, size_t size)
+{
+  int written;
+
+  if (*item->year != 1928) {
+    written = snprintf(buffer, size, "%s/DOP/dop20%s%s_%d/%s.zip",
+                       base_url,
+                       *item->non_rectified ? "" : "true_",
+                       item->type,
+                       *item->year,
+                       item->region);
+  } else {
+    written = snprintf(buffer, size, "%s/luftbilder/1928/%s.zip",
+                       base_url,
+                       item->region);
+  }
+
+  return written < 0 || (size_t) written >= size;
+}
+
+static int build_output_path(const Node *item, const char *to, char *buffer, size_t size)
+{
+  int written = snprintf(buffer, size, "%s/%d-%s-%s.zip",
+                         to,
                          *item->year,
+                         item->type,
                          item->region);
-      if (written >= 1024) {
-        fprintf(stderr, "ERROR: Request URL longer than 1024 bytes. Not performing request.\n");
-        free(request_url);
-        break;
+
+  return written < 0 || (size_t) written >= size;
+}
+
+/*
+ * The journal sits next to a .part file and records what the partial data belongs to:
+ *   size <expected total size in bytes>
+ *   etag <strong entity tag, may be empty>
+ *   last-modified <HTTP date, may be empty>
+ * Without a validator a partial file cannot be resumed safely and is discarded.
+ */
+static int write_journal(const transfer *t)
+{
+  FILE *journal = fopen(t->journal_path, "w");
+  if (journal == NULL)
+    return 1;
+
+  fprintf(journal, "size %" CURL_FORMAT_CURL_OFF_T "\n", t->expected_size);
+  fprintf(journal, "etag %s\n", t->etag);
+  fprintf(journal, "last-modified %s\n", t->last_modified);
+
+  return fclose(journal) != 0;
+}
+
+static int read_journal(transfer *t)
+{
+  char line[512];
+  FILE *journal = fopen(t->journal_path, "r");
+  if (journal == NULL)
+    return 1;
+
+  t->expected_size = -1;
+  while (fgets(line, sizeof(line), journal)) {
+    if (strncmp(line, "size ", 5) == 0)
+      t->expected_size = strtoll(line + 5, NULL, 10);
+    else if (strncmp(line, "etag ", 5) == 0)
+      copy_header_value(t->etag, sizeof(t->etag), line + 5, strlen(line + 5));
+    else if (strncmp(line, "last-modified ", 14) == 0)
+      copy_header_value(t->last_modified, sizeof(t->last_modified), line + 14, strlen(line + 14));
+  }
+  fclose(journal);
+
+  return t->expected_size < 0 || (*t->etag == '\0' && *t->last_modified == '\0');
+}
+
+static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+  transfer *t = (transfer *) userdata;
+  size_t length = size * nitems;
+
+  // a new status line (e.g. after a redirect) invalidates everything seen so far,
+  // except that a partial response keeps validating against the journal if it omits validators
+  if (length > 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+    char *status = memchr(buffer, ' ', length);
+    if (status == NULL || atoi(status + 1) != 206) {
+      *t->etag = '\0';
+      *t->last_modified = '\0';
+    }
+    t->expected_size = -1;
+    t->accept_ranges = 0;
+  } else if (length > 14 && strncasecmp(buffer, "Accept-Ranges:", 14) == 0) {
+    t->accept_ranges = memmem(buffer + 14, length - 14, "bytes", 5) != NULL;
+  } else if (length > 5 && strncasecmp(buffer, "ETag:", 5) == 0) {
+    // weak validators must not be used with If-Range
+    if (copy_header_value(t->etag, sizeof(t->etag), buffer + 5, length - 5) || strncmp(t->etag, "W/", 2) == 0)
+      *t->etag = '\0';
+  } else if (length > 14 && strncasecmp(buffer, "Last-Modified:", 14) == 0) {
+    if (copy_header_value(t->last_modified, sizeof(t->last_modified), buffer + 14, length - 14))
+      *t->last_modified = '\0';
+  } else if (length > 15 && strncasecmp(buffer, "Content-Length:", 15) == 0) {
+    if (t->expected_size < 0)
+      t->expected_size = strtoll(buffer + 15, NULL, 10);
+  } else if (length > 14 && strncasecmp(buffer, "Content-Range:", 14) == 0) {
+    // bytes <first>-<last>/<total>; the total is what the journal needs
+    char *total = memchr(buffer, '/', length);
+    if (total && total[1] != '*')
+      t->expected_size = strtoll(total + 1, NULL, 10);
+  }
+
+  return length;
+}
+
+// opens the .part file once the response status is known so a full (200) reply replaces stale data
+static size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+  transfer *t = (transfer *) userdata;
+
+  if (!t->started) {
+    long status = 0;
+    t->started = 1;
+    curl_easy_getinfo(t->handle, CURLINFO_RESPONSE_CODE, &status);
+    if (status != 206 && t->resume_from) {
+      t->resume_from = 0;
+      t->checksum = crc32(0L, Z_NULL, 0);
+      // the replayed partial data belonged to another version of the archive
+      if (t->zs) {
+        zipstream_destroy(t->zs);
+        t->zs = zipstream_create(t->option->extract_dir, t->option->verbose);
+        if (t->zs == NULL)
+          return CURL_WRITEFUNC_ERROR;
       }
-    } else {
-      snprintf(request_url, 1024, "%s/luftbilder/1928/%s.zip",
-               base_url,
-               item->region);
     }
 
-    if (curl_easy_setopt(handle, CURLOPT_URL, request_url) != CURLE_OK) {
-      fprintf(stderr, "ERROR: Failed to set URL for request.\n");
+    if (t->option->keep_archive) {
+      t->fout = fopen(t->part_path, t->resume_from ? "ab" : "wb");
+      if (t->fout == NULL) {
+        fprintf(stderr, "ERROR: Failed to open output file %s\n", t->part_path);
+        return CURL_WRITEFUNC_ERROR;
+      }
 
-      curl_easy_cleanup(handle);
-      return;
+      if (*t->etag || *t->last_modified) {
+        if (write_journal(t))
+          fprintf(stderr, "WARNING: Failed to write download journal %s\n", t->journal_path);
+        t->journaled = 1;
+      } else {
+        unlink(t->journal_path);
+      }
     }
+  }
 
-    char *out_path = calloc(1024, sizeof(char));
-    written = snprintf(out_path, 1024, "%s/%d-%s-%s.zip",
-                       to,
-                       *item->year,
-                       item->type,
-                       item->region);
+  t->checksum = crc32_z(t->checksum, (const Bytef *) ptr, size * nmemb);
 
-    if (written >= 1024) {
-      fprintf(stderr, "ERROR: Local output path is to long. Not performing request.\n");
-      free(request_url);
-      free(out_path);
-      break;
+  if (t->zs && zipstream_feed(t->zs, (const unsigned char *) ptr, size * nmemb)) {
+    if (!t->option->keep_archive)
+      return CURL_WRITEFUNC_ERROR;
+    fprintf(stderr, "WARNING: Failed to extract from '%s' while downloading, keeping the archive only\n",
+            t->out_path);
+    zipstream_destroy(t->zs);
+    t->zs = NULL;
+  }
+
+  if (t->fout == NULL)
+    return size * nmemb;
+  return fwrite(ptr, size, nmemb, t->fout);
+}
+
+// continues the running checksum (and extraction) over data received by an earlier run
+static int replay_part(transfer *t)
+{
+  unsigned char buffer[1 << 16];
+  size_t nread;
+  FILE *in = fopen(t->part_path, "rb");
+  if (in == NULL)
+    return 1;
+
+  int failed = 0;
+  while (!failed && (nread = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+    t->checksum = crc32_z(t->checksum, buffer, nread);
+    if (t->zs)
+      failed = zipstream_feed(t->zs, buffer, nread);
+  }
+
+  failed |= ferror(in);
+  fclose(in);
+  return failed;
+}
+
+// feeds the unchanged archive on disk to the extractor, as if it had just been downloaded
+static int extract_local(transfer *t)
+{
+  unsigned char buffer[1 << 16];
+  size_t nread;
+  FILE *in = fopen(t->out_path, "rb");
+  if (in == NULL)
+    return 1;
+
+  int failed = 0;
+  while (!failed && (nread = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    failed = zipstream_feed(t->zs, buffer, nread);
+
+  failed |= ferror(in);
+  fclose(in);
+  return failed;
+}
+
+// decides whether an existing .part file can be continued; stale or unverifiable leftovers are removed
+static void prepare_resume(transfer *t)
+{
+  struct stat part_stat;
+
+  t->resume_from = 0;
+  t->expected_size = -1;
+  t->checksum = crc32(0L, Z_NULL, 0);
+
+  if (stat(t->part_path, &part_stat) != 0)
+    return;
+
+  if (read_journal(t) || part_stat.st_size > t->expected_size || replay_part(t)) {
+    unlink(t->part_path);
+    unlink(t->journal_path);
+    *t->etag = '\0';
+    *t->last_modified = '\0';
+    t->expected_size = -1;
+    t->checksum = crc32(0L, Z_NULL, 0);
+    if (t->zs) {
+      zipstream_destroy(t->zs);
+      t->zs = zipstream_create(t->option->extract_dir, t->option->verbose);
     }
+    return;
+  }
 
-    FILE *fout = fopen(out_path, "wb");
-    if (fout == NULL) {
-      fprintf(stderr, "ERROR: Failed to open output file %s\n", out_path);
-      free(request_url);
-      free(out_path);
-      break;
+  t->resume_from = part_stat.st_size;
+}
+
+static void destroy_transfer(transfer *t)
+{
+  if (t->handle)
+    curl_easy_cleanup(t->handle);
+  curl_slist_free_all(t->headers);
+  zipstream_destroy(t->zs);
+  for (int i = 0; i < t->segment_count; i++)
+    if (t->segments[i].handle)
+      curl_easy_cleanup(t->segments[i].handle);
+  free(t->segments);
+  if (t->fd >= 0)
+    close(t->fd);
+  free(t->request_url);
+  free(t->out_path);
+  free(t->part_path);
+  free(t->journal_path);
+  free(t->item);
+  free(t);
+}
+
+// hands an archive that is complete on disk to the caller of download_datasets
+static void archive_ready(const transfer *t)
+{
+  if (t->on_download)
+    t->on_download(t->out_path, t->user);
+}
+
+// moves a complete .part file into place, drops its journal and records the result in the manifest. A connection
+// closed early but cleanly leaves a short file behind, which is kept with its journal for the next run to resume
+static int finalize_part(const transfer *t)
+{
+  struct stat out_stat;
+
+  if (stat(t->part_path, &out_stat) != 0) {
+    fprintf(stderr, "ERROR: Could not access '%s'\n", t->part_path);
+    return 1;
+  }
+  if (t->expected_size >= 0 && out_stat.st_size != t->expected_size) {
+    fprintf(stderr, "WARNING: '%s' holds %lld of %" CURL_FORMAT_CURL_OFF_T " bytes. %s\n", t->part_path,
+            (long long) out_stat.st_size, t->expected_size,
+            t->journaled && out_stat.st_size < t->expected_size ? "Partial data is kept for the next run." :
+            "Discarding it.");
+    if (!t->journaled || out_stat.st_size > t->expected_size) {
+      unlink(t->part_path);
+      unlink(t->journal_path);
     }
+    return 1;
+  }
 
-    curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *) fout);
-    CURLcode result = curl_easy_perform(handle);
+  if (rename(t->part_path, t->out_path) != 0) {
+    fprintf(stderr, "ERROR: Failed to move '%s' to '%s'\n", t->part_path, t->out_path);
+    return 1;
+  }
+  unlink(t->journal_path);
 
-    switch (result) {
-    case CURLE_OK:
-      if (verbose)
-        printf("Sucessfully downloaded file '%s'\n", out_path);
-      break;
-    case CURLE_HTTP_RETURNED_ERROR:
-      printf("WARNING: Failed to download file '%s' from %s\n", out_path, request_url);
-      fclose(fout);
-      unlink(out_path);
+  if (stat(t->out_path, &out_stat) != 0)
+    return 1;
+
+  manifest_entry *entry = manifest_insert(t->cache, t->request_url, t->out_path);
+  if (entry == NULL) {
+    fprintf(stderr, "WARNING: Failed to record '%s' in download manifest\n", t->out_path);
+    return 0;
+  }
+  entry->size = out_stat.st_size;
+  entry->checksum = t->checksum;
+  strcpy(entry->etag, t->etag);
+  strcpy(entry->last_modified, t->last_modified);
+  if (save_manifest(t->cache))
+    fprintf(stderr, "WARNING: Failed to write download manifest %s\n", t->cache->path);
+
+  return 0;
+}
+
+// CRC-32 of a whole file, as finalize_part records it in the manifest
+static int file_checksum(const char *path, unsigned long *checksum)
+{
+  unsigned char buffer[1 << 16];
+  size_t nread;
+  FILE *in = fopen(path, "rb");
+  if (in == NULL)
+    return 1;
+
+  *checksum = crc32(0L, Z_NULL, 0);
+  while ((nread = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    *checksum = crc32_z(*checksum, buffer, nread);
+
+  int failed = ferror(in);
+  fclose(in);
+  return failed;
+}
+
+// asks the server to skip the body if the local copy still matches what the manifest recorded, by size and content
+static void prepare_conditional(transfer *t)
+{
+  struct stat out_stat;
+  unsigned long checksum;
+  char header[300];
+  const manifest_entry *entry = manifest_lookup(t->cache, t->request_url);
+
+  if (t->conditional || entry == NULL || stat(t->out_path, &out_stat) != 0 || out_stat.st_size != entry->size)
+    return;
+  if (file_checksum(t->out_path, &checksum) || checksum != entry->checksum) {
+    fprintf(stderr, "WARNING: '%s' does not match its checksum in the download manifest, downloading it again\n",
+            t->out_path);
+    return;
+  }
+
+  if (*entry->etag) {
+    snprintf(header, sizeof(header), "If-None-Match: %s", entry->etag);
+    t->headers = curl_slist_append(t->headers, header);
+    t->conditional = 1;
+  }
+  if (*entry->last_modified) {
+    snprintf(header, sizeof(header), "If-Modified-Since: %s", entry->last_modified);
+    t->headers = curl_slist_append(t->headers, header);
+    t->conditional = 1;
+  }
+}
+
+static size_t segment_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+  segment *seg = (segment *) userdata;
+  size_t length = size * nmemb;
+  size_t written = 0;
+
+  if (!seg->started) {
+    long status = 0;
+    seg->started = 1;
+    curl_easy_getinfo(seg->handle, CURLINFO_RESPONSE_CODE, &status);
+    // anything but a partial response means the file changed after it was probed
+    if (status != 206)
+      return CURL_WRITEFUNC_ERROR;
+  }
+
+  if (seg->offset + (curl_off_t) length > seg->end + 1)
+    return CURL_WRITEFUNC_ERROR;
+
+  while (written < length) {
+    ssize_t n = pwrite(seg->owner->fd, ptr + written, length - written, seg->offset + (off_t) written);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "ERROR: Failed to write to %s\n", seg->owner->part_path);
+      return CURL_WRITEFUNC_ERROR;
+    }
+    written += (size_t) n;
+  }
+
+  seg->checksum = crc32_z(seg->checksum, (const Bytef *) ptr, length);
+  seg->offset += (curl_off_t) length;
+  return length;
+}
+
+typedef enum
+{
+  SEGMENTS_STARTED,
+  SEGMENTS_DONE,
+  SEGMENTS_FALLBACK
+} segments_status;
+
+/*
+ * Splits a download into byte ranges fetched on separate connections. A HEAD request (carrying
+ * the conditional headers from the manifest) runs on the multi handle like any other transfer, see start_probe.
+ * Its answer provides size, range support and the validator every range is bound to via If-Range.
+ * Files the server cannot split are left to a regular transfer.
+ */
+static int start_probe(CURLM *multi, transfer *t)
+{
+  t->handle = curl_easy_init();
+  if (t->handle == NULL)
+    return 1;
+
+  prepare_conditional(t);
+  curl_easy_setopt(t->handle, CURLOPT_URL, t->request_url);
+  curl_easy_setopt(t->handle, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(t->handle, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(t->handle, CURLOPT_PRIVATE, (void *) t);
+  curl_easy_setopt(t->handle, CURLOPT_HEADERFUNCTION, header_callback);
+  curl_easy_setopt(t->handle, CURLOPT_HEADERDATA, (void *) t);
+  curl_easy_setopt(t->handle, CURLOPT_HTTPHEADER, t->headers);
+  if (curl_multi_add_handle(multi, t->handle) != CURLM_OK) {
+    curl_easy_cleanup(t->handle);
+    t->handle = NULL;
+    return 1;
+  }
+  t->probing = 1;
+
+  return 0;
+}
+
+// starts the ranges once the probe answered with 'result' and HTTP 'status'
+static segments_status start_segments(CURLM *multi, transfer *t, CURLcode result, long status)
+{
+  const options *option = t->option;
+
+  if (result == CURLE_HTTP_RETURNED_ERROR) {
+    printf("WARNING: Failed to download file '%s' from %s\n", t->out_path, t->request_url);
+    return SEGMENTS_DONE;
+  }
+  if (result != CURLE_OK)
+    return SEGMENTS_FALLBACK;
+  if (t->conditional && status == 304) {
+    if (option->verbose)
+      printf("File '%s' is up to date\n", t->out_path);
+    archive_ready(t);
+    return SEGMENTS_DONE;
+  }
+  if (!t->accept_ranges || t->expected_size < 2 * SEGMENT_MIN_SIZE || (*t->etag == '\0' && *t->last_modified == '\0'))
+    return SEGMENTS_FALLBACK;
+
+  int count = option->segments;
+  if (t->expected_size / SEGMENT_MIN_SIZE < count)
+    count = (int) (t->expected_size / SEGMENT_MIN_SIZE);
+
+  t->fd = open(t->part_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (t->fd < 0) {
+    fprintf(stderr, "ERROR: Failed to open output file %s\n", t->part_path);
+    return SEGMENTS_DONE;
+  }
+  // reserve the whole file up front, filesystems without fallocate get a sparse file instead
+  if (fallocate(t->fd, 0, 0, t->expected_size) != 0 &&
+      ((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(t->fd, t->expected_size) != 0)) {
+    fprintf(stderr, "ERROR: Failed to allocate %" CURL_FORMAT_CURL_OFF_T " bytes for %s\n", t->expected_size,
+            t->part_path);
+    unlink(t->part_path);
+    return SEGMENTS_DONE;
+  }
+
+  // the ranges must not be conditional on the manifest, only bound to the probed version
+  char if_range[300];
+  snprintf(if_range, sizeof(if_range), "If-Range: %s", *t->etag ? t->etag : t->last_modified);
+  curl_slist_free_all(t->headers);
+  t->headers = curl_slist_append(NULL, if_range);
+  t->conditional = 0;
+
+  t->segments = calloc(count, sizeof(segment));
+  if (t->segments == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate memory for segments.\n");
+    unlink(t->part_path);
+    return SEGMENTS_DONE;
+  }
+  t->segment_count = count;
+
+  for (int i = 0; i < count; i++) {
+    char range[64];
+    segment *seg = &t->segments[i];
+    seg->owner = t;
+    seg->start = t->expected_size / count * i;
+    seg->offset = seg->start;
+    seg->end = i == count - 1 ? t->expected_size - 1 : t->expected_size / count * (i + 1) - 1;
+    seg->checksum = crc32(0L, Z_NULL, 0);
+    snprintf(range, sizeof(range), "%" CURL_FORMAT_CURL_OFF_T "-%" CURL_FORMAT_CURL_OFF_T, seg->start, seg->end);
+
+    seg->handle = curl_easy_init();
+    if (seg->handle == NULL) {
+      fprintf(stderr, "ERROR: Failed to initialize CURL handle.\n");
       break;
-    default:
-      fprintf(stderr, "WARNING: Uncaught CURL return %d\n", result);
+    }
+    curl_easy_setopt(seg->handle, CURLOPT_URL, t->request_url);
+    curl_easy_setopt(seg->handle, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(seg->handle, CURLOPT_PRIVATE, (void *) t);
+    curl_easy_setopt(seg->handle, CURLOPT_RANGE, range);
+    curl_easy_setopt(seg->handle, CURLOPT_HTTPHEADER, t->headers);
+    curl_easy_setopt(seg->handle, CURLOPT_WRITEFUNCTION, segment_write_callback);
+    curl_easy_setopt(seg->handle, CURLOPT_WRITEDATA, (void *) seg);
+    if (curl_multi_add_handle(multi, seg->handle) != CURLM_OK) {
+      fprintf(stderr, "ERROR: Failed to schedule request for %s\n", t->request_url);
+      curl_easy_cleanup(seg->handle);
+      seg->handle = NULL;
       break;
     }
+    t->segments_left++;
+  }
 
-    free(request_url);
-    free(out_path);
-    if (result != CURLE_HTTP_RETURNED_ERROR)
-      fclose(fout);
-    if (item->oldest == NULL) {
-      free(item);
-      break;
+  if (t->segments_left != count) {
+    for (int i = 0; i < count; i++)
+      if (t->segments[i].handle)
+        curl_multi_remove_handle(multi, t->segments[i].handle);
+    unlink(t->part_path);
+    return SEGMENTS_DONE;
+  }
+
+  if (option->verbose)
+    printf("Downloading '%s' in %d segments\n", t->out_path, count);
+
+  return SEGMENTS_STARTED;
+}
+
+// returns 1 once every segment of the transfer completed or the transfer was given up
+static int finish_segment(CURLM *multi, transfer *t, CURL *handle, CURLcode result)
+{
+  segment *seg = NULL;
+  for (int i = 0; i < t->segment_count; i++)
+    if (t->segments[i].handle == handle)
+      seg = &t->segments[i];
+  if (seg == NULL || seg->done)
+    return t->segments_left == 0;
+
+  curl_multi_remove_handle(multi, handle);
+  seg->done = 1;
+  t->segments_left--;
+
+  if (result == CURLE_OK && seg->offset != seg->end + 1)
+    result = CURLE_PARTIAL_FILE;
+
+  if (result != CURLE_OK && t->segment_result == CURLE_OK) {
+    t->segment_result = result;
+    // a single missing range makes the file useless, stop the others right away
+    for (int i = 0; i < t->segment_count; i++) {
+      if (!t->segments[i].done) {
+        curl_multi_remove_handle(multi, t->segments[i].handle);
+        t->segments[i].done = 1;
+        t->segments_left--;
+      }
     }
+  }
+
+  return t->segments_left == 0;
+}
+
+// registers the GET request of a transfer with the multi handle, resuming or conditional where possible
+static int start_request(CURLM *multi, transfer *t)
+{
+  const options *option = t->option;
+
+  t->handle = curl_easy_init();
+  if (t->handle == NULL) {
+    fprintf(stderr, "ERROR: Failed to initialize CURL handle.\n");
+    return 1;
+  }
+
+  curl_easy_setopt(t->handle, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(t->handle, CURLOPT_PRIVATE, (void *) t);
+  if (curl_easy_setopt(t->handle, CURLOPT_URL, t->request_url) != CURLE_OK) {
+    fprintf(stderr, "ERROR: Failed to set URL for request.\n");
+    return 1;
+  }
+
+  curl_easy_setopt(t->handle, CURLOPT_HEADERFUNCTION, header_callback);
+  curl_easy_setopt(t->handle, CURLOPT_HEADERDATA, (void *) t);
+  curl_easy_setopt(t->handle, CURLOPT_WRITEFUNCTION, write_callback);
+  curl_easy_setopt(t->handle, CURLOPT_WRITEDATA, (void *) t);
+
+  if (t->resume_from) {
+    // If-Range makes the server send the full, current file instead of a range of a changed one.
+    // CURLOPT_RANGE (unlike CURLOPT_RESUME_FROM_LARGE) accepts such a 200 reply, see write_callback
+    char if_range[300];
+    char range[32];
+    snprintf(if_range, sizeof(if_range), "If-Range: %s", *t->etag ? t->etag : t->last_modified);
+    snprintf(range, sizeof(range), "%" CURL_FORMAT_CURL_OFF_T "-", t->resume_from);
+    t->headers = curl_slist_append(t->headers, if_range);
+    curl_easy_setopt(t->handle, CURLOPT_HTTPHEADER, t->headers);
+    curl_easy_setopt(t->handle, CURLOPT_RANGE, range);
+    if (option->verbose)
+      printf("Resuming '%s' at byte %" CURL_FORMAT_CURL_OFF_T "\n", t->out_path, t->resume_from);
+  } else if (option->keep_archive) {
+    prepare_conditional(t);
+    curl_easy_setopt(t->handle, CURLOPT_HTTPHEADER, t->headers);
+  }
+
+  if (curl_multi_add_handle(multi, t->handle) != CURLM_OK) {
+    fprintf(stderr, "ERROR: Failed to schedule request for %s\n", t->request_url);
+    return 1;
+  }
+
+  return 0;
+}
+
+// prepares and registers one request with the multi handle; the item is consumed in any case
+static transfer *start_transfer(CURLM *multi, Node *item, manifest *cache, const options *option,
+                                download_callback on_download, void *user)
+{
+  transfer *t = calloc(1, sizeof(transfer));
+  if (t == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate memory for transfer.\n");
     free(item);
+    return NULL;
+  }
+  t->item = item;
+  t->cache = cache;
+  t->option = option;
+  t->on_download = on_download;
+  t->user = user;
+  t->fd = -1;
+
+  t->request_url = calloc(1024, sizeof(char));
+  t->out_path = calloc(1024, sizeof(char));
+  t->part_path = calloc(1024 + 5, sizeof(char));
+  t->journal_path = calloc(1024 + 13, sizeof(char));
+  if (t->request_url == NULL || t->out_path == NULL || t->part_path == NULL || t->journal_path == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate memory for request.\n");
+    destroy_transfer(t);
+    return NULL;
+  }
+
+  if (build_request_url(item, t->request_url, 1024)) {
+    fprintf(stderr, "ERROR: Request URL longer than 1024 bytes. Not performing request.\n");
+    destroy_transfer(t);
+    return NULL;
+  }
+
+  if (build_output_path(item, option->outdir, t->out_path, 1024)) {
+    fprintf(stderr, "ERROR: Local output path is to long. Not performing request.\n");
+    destroy_transfer(t);
+    return NULL;
   }
+  sprintf(t->part_path, "%s.part", t->out_path);
+  sprintf(t->journal_path, "%s.part.journal", t->out_path);
 
-  curl_easy_cleanup(handle);
-}
\ No newline at end of file
+  if (option->extract_dir) {
+    t->zs = zipstream_create(option->extract_dir, option->verbose);
+    if (t->zs == NULL) {
+      destroy_transfer(t);
+      return NULL;
+    }
+  }
+
+  // without an archive on disk there is nothing to resume from or to validate against
+  if (option->keep_archive)
+    prepare_resume(t);
+  if (t->resume_from && t->resume_from == t->expected_size) {
+    // an earlier run received every byte but did not get to rename the file
+    if (finalize_part(t) == 0) {
+      if (option->verbose)
+        printf("Sucessfully downloaded file '%s'\n", t->out_path);
+      archive_ready(t);
+    }
+    destroy_transfer(t);
+    return NULL;
+  }
+
+  // extraction needs the archive in order, resuming continues a single stream
+  if (option->segments > 1 && option->keep_archive && t->zs == NULL && t->resume_from == 0 &&
+      start_probe(multi, t) == 0)
+    return t;
+
+  if (start_request(multi, t)) {
+    destroy_transfer(t);
+    return NULL;
+  }
+
+  return t;
+}
+
+// completes extraction once the whole archive went through the zipstream
+static void finish_extraction(transfer *t, const int verbose)
+{
+  if (zipstream_finish(t->zs))
+    fprintf(stderr, "WARNING: Archive '%s' ended before its central directory, extraction may be incomplete\n",
+            t->out_path);
+  if (verbose)
+    printf("Extracted %zu raster files from '%s' into '%s'\n", zipstream_extracted(t->zs), t->request_url,
+           t->option->extract_dir);
+}
+
+// the probe decided how to fetch the file: in segments, as a single request or not at all. Returns 1 if the transfer
+// is finished, 0 if it goes on
+static int finish_probe(CURLM *multi, transfer *t, CURLcode result)
+{
+  long status = 0;
+  curl_easy_getinfo(t->handle, CURLINFO_RESPONSE_CODE, &status);
+  curl_multi_remove_handle(multi, t->handle);
+  curl_easy_cleanup(t->handle);
+  t->handle = NULL;
+  t->probing = 0;
+
+  switch (start_segments(multi, t, result, status)) {
+  case SEGMENTS_STARTED:
+    return 0;
+  case SEGMENTS_FALLBACK:
+    if (start_request(multi, t) == 0)
+      return 0;
+    break;
+  case SEGMENTS_DONE:
+    break;
+  }
+
+  destroy_transfer(t);
+  return 1;
+}
+
+/*
+ * The ranges of a segmented transfer land all over its preallocated .part file, whose size says nothing about what
+ * arrived, so it gets no journal while they run and a leftover .part from a killed run is discarded. When the
+ * transfer fails, the bytes up to its first gap are kept as an ordinary .part file with journal instead, which the
+ * next run resumes as a single stream; what the later ranges received is dropped.
+ */
+static void keep_segment_prefix(transfer *t)
+{
+  curl_off_t prefix = 0;
+  for (int i = 0; i < t->segment_count && t->segments[i].start == prefix; i++)
+    prefix = t->segments[i].offset;
+
+  if (prefix == 0 || truncate(t->part_path, prefix) != 0 || write_journal(t))
+    return;
+  t->journaled = 1;
+}
+
+// returns 1 once the transfer is done with and destroyed, 0 if it continues with further requests
+static int finish_transfer(CURLM *multi, transfer *t, CURLcode result, const int verbose)
+{
+  if (t->probing)
+    return finish_probe(multi, t, result);
+
+  long status = 0;
+  if (t->handle) {
+    curl_easy_getinfo(t->handle, CURLINFO_RESPONSE_CODE, &status);
+    curl_multi_remove_handle(multi, t->handle);
+  }
+
+  // the preallocated file has its full size either way, so every range is checked for having all of its bytes. Their
+  // checksums chain up to the checksum of the whole file
+  if (t->segment_count && result == CURLE_OK) {
+    t->checksum = crc32(0L, Z_NULL, 0);
+    for (int i = 0; i < t->segment_count && result == CURLE_OK; i++) {
+      const segment *seg = &t->segments[i];
+      if (seg->offset - seg->start != seg->end - seg->start + 1) {
+        fprintf(stderr, "ERROR: Segment %d of '%s' received %" CURL_FORMAT_CURL_OFF_T " of %" CURL_FORMAT_CURL_OFF_T
+                " bytes\n", i, t->out_path, seg->offset - seg->start, seg->end - seg->start + 1);
+        result = CURLE_PARTIAL_FILE;
+      }
+      t->checksum = crc32_combine(t->checksum, seg->checksum, seg->end - seg->start + 1);
+    }
+  }
+  if (t->fd >= 0) {
+    if (close(t->fd) != 0 && result == CURLE_OK)
+      result = CURLE_WRITE_ERROR;
+    t->fd = -1;
+  }
+  if (t->segment_count && result != CURLE_OK && result != CURLE_HTTP_RETURNED_ERROR)
+    keep_segment_prefix(t);
+
+  if (result == CURLE_OK && t->conditional && status == 304) {
+    if (verbose)
+      printf("File '%s' is up to date\n", t->out_path);
+    // a rerun adding -x|--extract still needs the rasters of an archive downloaded before
+    if (t->zs && extract_local(t))
+      fprintf(stderr, "WARNING: Failed to extract from '%s'\n", t->out_path);
+    else if (t->zs)
+      finish_extraction(t, verbose);
+    archive_ready(t);
+    destroy_transfer(t);
+    return 1;
+  }
+
+  // an empty body never triggers the write callback
+  if (t->fout == NULL && result == CURLE_OK && t->option->keep_archive && t->segment_count == 0)
+    t->fout = fopen(t->part_path, "wb");
+  if (t->fout)
+    fclose(t->fout);
+
+  switch (result) {
+  case CURLE_OK:
+    if (t->zs)
+      finish_extraction(t, verbose);
+    if (t->option->keep_archive && finalize_part(t) == 0) {
+      if (verbose)
+        printf("Sucessfully downloaded file '%s'\n", t->out_path);
+      archive_ready(t);
+    }
+    break;
+  case CURLE_HTTP_RETURNED_ERROR:
+    printf("WARNING: Failed to download file '%s' from %s\n", t->out_path, t->request_url);
+    unlink(t->part_path);
+    unlink(t->journal_path);
+    break;
+  default:
+    if (t->journaled) {
+      fprintf(stderr, "WARNING: Download of '%s' interrupted (%s). Partial data is kept for the next run.\n",
+              t->out_path, curl_easy_strerror(result));
+    } else {
+      fprintf(stderr, "WARNING: Download of '%s' failed (%s).\n", t->out_path, curl_easy_strerror(result));
+      unlink(t->part_path);
+      unlink(t->journal_path);
+    }
+    break;
+  }
+
+  destroy_transfer(t);
+  return 1;
+}
+
+// gives up a transfer still attached to the multi handle like one whose connection dropped: partial data with a
+// journal is kept for the next run, anything else is removed
+static void abort_transfer(CURLM *multi, transfer *t)
+{
+  if (t->probing) {
+    curl_multi_remove_handle(multi, t->handle);
+    destroy_transfer(t);
+    return;
+  }
+
+  for (int i = 0; i < t->segment_count; i++) {
+    if (!t->segments[i].done) {
+      curl_multi_remove_handle(multi, t->segments[i].handle);
+      t->segments[i].done = 1;
+    }
+  }
+  t->segments_left = 0;
+  finish_transfer(multi, t, CURLE_ABORTED_BY_CALLBACK, t->option->verbose);
+}
+
+void download_datasets(Node *queue, const options *option, download_callback on_download, void *user)
+{
+  int in_flight = 0;
+  int running;
+  int pending;
+  CURLMsg *msg;
+  const long jobs = option->jobs > 0 ? option->jobs : 1;
+  const long connections = jobs * (option->segments > 1 ? option->segments : 1);
+
+  manifest *cache = load_manifest(option->outdir);
+  if (cache == NULL) {
+    fprintf(stderr, "ERROR: Failed to load download manifest.\n");
+    return;
+  }
+
+  // the transfers in flight, so that they can be cleaned up if the multi handle fails
+  transfer **active = calloc(jobs, sizeof(transfer *));
+  CURLM *multi = curl_multi_init();
+  if (active == NULL || multi == NULL) {
+    fprintf(stderr, "ERROR: Failed to initialize CURL multi handle.\n");
+    free(active);
+    if (multi)
+      curl_multi_cleanup(multi);
+    destroy_manifest(cache);
+    return;
+  }
+
+  // all requests go to the same host: cap connections there and keep them alive between files
+  curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, connections);
+  curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, connections);
+  curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+  while (queue || in_flight) {
+    while (queue && in_flight < jobs) {
+      transfer *t = start_transfer(multi, next_item(&queue), cache, option, on_download, user);
+      for (long i = 0; t && i < jobs; i++) {
+        if (active[i] == NULL) {
+          active[i] = t;
+          in_flight++;
+          break;
+        }
+      }
+    }
+
+    if (curl_multi_perform(multi, &running) != CURLM_OK) {
+      fprintf(stderr, "ERROR: CURL multi interface failed. Aborting remaining downloads.\n");
+      for (long i = 0; i < jobs; i++)
+        if (active[i])
+          abort_transfer(multi, active[i]);
+      while (queue)
+        free(next_item(&queue));
+      break;
+    }
+
+    while ((msg = curl_multi_info_read(multi, &pending))) {
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+
+      // msg is invalidated by removing the handle, copy what is needed first
+      transfer *t = NULL;
+      CURL *handle = msg->easy_handle;
+      CURLcode result = msg->data.result;
+      curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **) &t);
+      if (t->segment_count) {
+        if (!finish_segment(multi, t, handle, result))
+          continue;
+        result = t->segment_result;
+      }
+      if (finish_transfer(multi, t, result, option->verbose)) {
+        for (long i = 0; i < jobs; i++)
+          if (active[i] == t)
+            active[i] = NULL;
+        in_flight--;
+      }
+    }
+
+    if (in_flight)
+      curl_multi_poll(multi, NULL, 0, 1000, NULL);
+  }
+
+  curl_multi_cleanup(multi);
+  free(active);
+  destroy_manifest(cache);
+}
@@ -20,6 +20,9 @@ Node *enqueue(Node *queue, int year, char *region, char *type, int non_rectified
 
 Node *dequeue(Node **queue);
 
-void download_datasets(Node *queue, const char *to, const int verbose);
+// invoked with the local path of every archive that is complete on disk, including unchanged ones
+typedef void (*download_callback)(const char *path, void *user);
+
+void download_datasets(Node *queue, const options *option, download_callback on_download, void *user);
 
 #endif // _DOWNLOAD_H
\ No newline at end of file
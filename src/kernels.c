@@ -0,0 +1,366 @@
+#include <string.h>
+
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+static void interleave_bands_scalar(const uint8_t *const *planes, int nbands, size_t pixels, uint8_t *out)
+{
+  if (nbands == 1) {
+    memcpy(out, planes[0], pixels);
+    return;
+  }
+
+  for (size_t i = 0; i < pixels; i++)
+    for (int band = 0; band < nbands; band++)
+      out[i * nbands + band] = planes[band][i];
+}
+
+// bytes of the repeated reference pixel compared per step; a multiple of 1, 2, 3 and 4 bands and of the vector sizes
+#define UNIFORM_STEP 96
+
+// samples of 'row' from 'start' on that differ from the reference pixel by more than 'threshold'
+static int row_deviates_scalar(const uint8_t *row, size_t start, size_t length, const uint8_t *reference, int nbands,
+                               int threshold)
+{
+  for (size_t i = start; i < length; i++) {
+    int difference = row[i] - reference[i % nbands];
+    if (difference > threshold || -difference > threshold)
+      return 1;
+  }
+
+  return 0;
+}
+
+// box filter from pixel pair 'first' on; rounds to nearest like (a + b + c + d + 2) / 4
+static void downsample_rows_scalar(const uint8_t *top, const uint8_t *bottom, size_t width, int nbands, size_t first,
+                                   uint8_t *out)
+{
+  for (size_t pair = first; pair < (width + 1) / 2; pair++) {
+    size_t left = 2 * pair * nbands;
+    size_t right = 2 * pair + 1 < width ? left + nbands : left;
+    for (int band = 0; band < nbands; band++)
+      out[pair * nbands + band] =
+        (top[left + band] + top[right + band] + bottom[left + band] + bottom[right + band] + 2) >> 2;
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// pshufb masks moving byte i of a band to its place in three consecutive 16 byte RGB blocks; 0x80 zeroes
+#define RGB_MASK(offset, channel)                                                   \
+  _mm_setr_epi8(RGB_LANE(offset, 0, channel), RGB_LANE(offset, 1, channel),        \
+                RGB_LANE(offset, 2, channel), RGB_LANE(offset, 3, channel),        \
+                RGB_LANE(offset, 4, channel), RGB_LANE(offset, 5, channel),        \
+                RGB_LANE(offset, 6, channel), RGB_LANE(offset, 7, channel),        \
+                RGB_LANE(offset, 8, channel), RGB_LANE(offset, 9, channel),        \
+                RGB_LANE(offset, 10, channel), RGB_LANE(offset, 11, channel),      \
+                RGB_LANE(offset, 12, channel), RGB_LANE(offset, 13, channel),      \
+                RGB_LANE(offset, 14, channel), RGB_LANE(offset, 15, channel))
+#define RGB_LANE(offset, i, channel) \
+  ((char) ((((offset) + (i)) % 3 == (channel)) ? ((offset) + (i)) / 3 : 0x80))
+
+__attribute__((target("ssse3")))
+static size_t interleave_rgb_ssse3(const uint8_t *const *planes, size_t pixels, uint8_t *out)
+{
+  const __m128i masks[3][3] = {
+    { RGB_MASK(0, 0), RGB_MASK(0, 1), RGB_MASK(0, 2) },
+    { RGB_MASK(16, 0), RGB_MASK(16, 1), RGB_MASK(16, 2) },
+    { RGB_MASK(32, 0), RGB_MASK(32, 1), RGB_MASK(32, 2) },
+  };
+  size_t i = 0;
+
+  for (; i + 16 <= pixels; i += 16) {
+    __m128i r = _mm_loadu_si128((const __m128i *) (planes[0] + i));
+    __m128i g = _mm_loadu_si128((const __m128i *) (planes[1] + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (planes[2] + i));
+    for (int block = 0; block < 3; block++) {
+      __m128i rgb = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, masks[block][0]),
+                                              _mm_shuffle_epi8(g, masks[block][1])),
+                                 _mm_shuffle_epi8(b, masks[block][2]));
+      _mm_storeu_si128((__m128i *) (out + 3 * i + 16 * block), rgb);
+    }
+  }
+
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t interleave_rgb_avx2(const uint8_t *const *planes, size_t pixels, uint8_t *out)
+{
+  const __m256i masks[3][3] = {
+    { _mm256_broadcastsi128_si256(RGB_MASK(0, 0)), _mm256_broadcastsi128_si256(RGB_MASK(0, 1)), _mm256_broadcastsi128_si256(RGB_MASK(0, 2)) },
+    { _mm256_broadcastsi128_si256(RGB_MASK(16, 0)), _mm256_broadcastsi128_si256(RGB_MASK(16, 1)), _mm256_broadcastsi128_si256(RGB_MASK(16, 2)) },
+    { _mm256_broadcastsi128_si256(RGB_MASK(32, 0)), _mm256_broadcastsi128_si256(RGB_MASK(32, 1)), _mm256_broadcastsi128_si256(RGB_MASK(32, 2)) },
+  };
+  size_t i = 0;
+
+  for (; i + 32 <= pixels; i += 32) {
+    __m256i r = _mm256_loadu_si256((const __m256i *) (planes[0] + i));
+    __m256i g = _mm256_loadu_si256((const __m256i *) (planes[1] + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (planes[2] + i));
+    __m256i rgb[3];
+    // vpshufb stays within 128 bit lanes: the low lane holds pixels 0-15, the high lane pixels 16-31
+    for (int block = 0; block < 3; block++)
+      rgb[block] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(r, masks[block][0]),
+                                                   _mm256_shuffle_epi8(g, masks[block][1])),
+                                   _mm256_shuffle_epi8(b, masks[block][2]));
+    _mm256_storeu_si256((__m256i *) (out + 3 * i), _mm256_permute2x128_si256(rgb[0], rgb[1], 0x20));
+    _mm256_storeu_si256((__m256i *) (out + 3 * i + 32), _mm256_permute2x128_si256(rgb[2], rgb[0], 0x30));
+    _mm256_storeu_si256((__m256i *) (out + 3 * i + 64), _mm256_permute2x128_si256(rgb[1], rgb[2], 0x31));
+  }
+
+  return i;
+}
+
+__attribute__((target("sse2")))
+static size_t interleave_rgba_sse2(const uint8_t *const *planes, size_t pixels, uint8_t *out)
+{
+  size_t i = 0;
+
+  for (; i + 16 <= pixels; i += 16) {
+    __m128i r = _mm_loadu_si128((const __m128i *) (planes[0] + i));
+    __m128i g = _mm_loadu_si128((const __m128i *) (planes[1] + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (planes[2] + i));
+    __m128i a = _mm_loadu_si128((const __m128i *) (planes[3] + i));
+    __m128i rg_low = _mm_unpacklo_epi8(r, g);
+    __m128i rg_high = _mm_unpackhi_epi8(r, g);
+    __m128i ba_low = _mm_unpacklo_epi8(b, a);
+    __m128i ba_high = _mm_unpackhi_epi8(b, a);
+    _mm_storeu_si128((__m128i *) (out + 4 * i), _mm_unpacklo_epi16(rg_low, ba_low));
+    _mm_storeu_si128((__m128i *) (out + 4 * i + 16), _mm_unpackhi_epi16(rg_low, ba_low));
+    _mm_storeu_si128((__m128i *) (out + 4 * i + 32), _mm_unpacklo_epi16(rg_high, ba_high));
+    _mm_storeu_si128((__m128i *) (out + 4 * i + 48), _mm_unpackhi_epi16(rg_high, ba_high));
+  }
+
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t interleave_rgba_avx2(const uint8_t *const *planes, size_t pixels, uint8_t *out)
+{
+  size_t i = 0;
+
+  for (; i + 32 <= pixels; i += 32) {
+    __m256i r = _mm256_loadu_si256((const __m256i *) (planes[0] + i));
+    __m256i g = _mm256_loadu_si256((const __m256i *) (planes[1] + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (planes[2] + i));
+    __m256i a = _mm256_loadu_si256((const __m256i *) (planes[3] + i));
+    __m256i rg_low = _mm256_unpacklo_epi8(r, g);
+    __m256i rg_high = _mm256_unpackhi_epi8(r, g);
+    __m256i ba_low = _mm256_unpacklo_epi8(b, a);
+    __m256i ba_high = _mm256_unpackhi_epi8(b, a);
+    // per lane: pixels 0-3, 4-7, 8-11, 12-15 of the low (0-15) and high (16-31) half
+    __m256i rgba0 = _mm256_unpacklo_epi16(rg_low, ba_low);
+    __m256i rgba1 = _mm256_unpackhi_epi16(rg_low, ba_low);
+    __m256i rgba2 = _mm256_unpacklo_epi16(rg_high, ba_high);
+    __m256i rgba3 = _mm256_unpackhi_epi16(rg_high, ba_high);
+    _mm256_storeu_si256((__m256i *) (out + 4 * i), _mm256_permute2x128_si256(rgba0, rgba1, 0x20));
+    _mm256_storeu_si256((__m256i *) (out + 4 * i + 32), _mm256_permute2x128_si256(rgba2, rgba3, 0x20));
+    _mm256_storeu_si256((__m256i *) (out + 4 * i + 64), _mm256_permute2x128_si256(rgba0, rgba1, 0x31));
+    _mm256_storeu_si256((__m256i *) (out + 4 * i + 96), _mm256_permute2x128_si256(rgba2, rgba3, 0x31));
+  }
+
+  return i;
+}
+
+// |row - pattern| is formed from two saturating subtractions; anything left after subtracting the threshold deviates
+__attribute__((target("sse2")))
+static size_t row_deviates_sse2(const uint8_t *row, size_t length, const uint8_t *pattern, int threshold, int *deviates)
+{
+  const __m128i limit = _mm_set1_epi8((char) threshold);
+  size_t i = 0;
+
+  for (; i + UNIFORM_STEP <= length; i += UNIFORM_STEP) {
+    __m128i excess = _mm_setzero_si128();
+    for (int v = 0; v < UNIFORM_STEP / 16; v++) {
+      __m128i x = _mm_loadu_si128((const __m128i *) (row + i + 16 * v));
+      __m128i p = _mm_loadu_si128((const __m128i *) (pattern + 16 * v));
+      __m128i difference = _mm_or_si128(_mm_subs_epu8(x, p), _mm_subs_epu8(p, x));
+      excess = _mm_or_si128(excess, _mm_subs_epu8(difference, limit));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(excess, _mm_setzero_si128())) != 0xFFFF) {
+      *deviates = 1;
+      return i;
+    }
+  }
+
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t row_deviates_avx2(const uint8_t *row, size_t length, const uint8_t *pattern, int threshold, int *deviates)
+{
+  const __m256i limit = _mm256_set1_epi8((char) threshold);
+  size_t i = 0;
+
+  for (; i + UNIFORM_STEP <= length; i += UNIFORM_STEP) {
+    __m256i excess = _mm256_setzero_si256();
+    for (int v = 0; v < UNIFORM_STEP / 32; v++) {
+      __m256i x = _mm256_loadu_si256((const __m256i *) (row + i + 32 * v));
+      __m256i p = _mm256_loadu_si256((const __m256i *) (pattern + 32 * v));
+      __m256i difference = _mm256_or_si256(_mm256_subs_epu8(x, p), _mm256_subs_epu8(p, x));
+      excess = _mm256_or_si256(excess, _mm256_subs_epu8(difference, limit));
+    }
+    if (!_mm256_testz_si256(excess, excess)) {
+      *deviates = 1;
+      return i;
+    }
+  }
+
+  return i;
+}
+
+// the downsample kernels return the number of pixel pairs they handled; all sums are formed in 16 bit lanes
+__attribute__((target("ssse3")))
+static size_t downsample_gray_ssse3(const uint8_t *top, const uint8_t *bottom, size_t width, uint8_t *out)
+{
+  const __m128i ones = _mm_set1_epi8(1);
+  const __m128i two = _mm_set1_epi16(2);
+  size_t i = 0;
+
+  // 16 pixels in, 8 out; pmaddubsw adds neighbouring bytes
+  for (; i + 16 <= width; i += 16) {
+    __m128i sum = _mm_add_epi16(_mm_maddubs_epi16(_mm_loadu_si128((const __m128i *) (top + i)), ones),
+                                _mm_maddubs_epi16(_mm_loadu_si128((const __m128i *) (bottom + i)), ones));
+    sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+    _mm_storel_epi64((__m128i *) (out + i / 2), _mm_packus_epi16(sum, sum));
+  }
+
+  return i / 2;
+}
+
+// zero extends the left or right pixel of each of the first two RGB pixel pairs of a 16 byte load to 16 bit lanes
+#define RGB_PAIR_MASK(side)                                                                  \
+  _mm_setr_epi8(RGB_PAIR_LANE(0, side), PAIR_ZERO, RGB_PAIR_LANE(1, side), PAIR_ZERO,       \
+                RGB_PAIR_LANE(2, side), PAIR_ZERO, RGB_PAIR_LANE(3, side), PAIR_ZERO,       \
+                RGB_PAIR_LANE(4, side), PAIR_ZERO, RGB_PAIR_LANE(5, side), PAIR_ZERO,       \
+                PAIR_ZERO, PAIR_ZERO, PAIR_ZERO, PAIR_ZERO)
+#define PAIR_ZERO ((char) 0x80)
+#define RGB_PAIR_LANE(lane, side) ((char) (6 * ((lane) / 3) + 3 * (side) + (lane) % 3))
+
+__attribute__((target("ssse3")))
+static size_t downsample_rgb_ssse3(const uint8_t *top, const uint8_t *bottom, size_t width, uint8_t *out)
+{
+  const __m128i left = RGB_PAIR_MASK(0);
+  const __m128i right = RGB_PAIR_MASK(1);
+  const __m128i two = _mm_set1_epi16(2);
+  size_t pair = 0;
+
+  // 4 pixels (12 of the 16 loaded bytes) in, 2 out; the 8 byte store runs 2 bytes ahead into the next pair
+  for (; 6 * pair + 16 <= 3 * width && 3 * pair + 8 <= 3 * (width / 2); pair += 2) {
+    __m128i t = _mm_loadu_si128((const __m128i *) (top + 6 * pair));
+    __m128i b = _mm_loadu_si128((const __m128i *) (bottom + 6 * pair));
+    __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_shuffle_epi8(t, left), _mm_shuffle_epi8(t, right)),
+                                _mm_add_epi16(_mm_shuffle_epi8(b, left), _mm_shuffle_epi8(b, right)));
+    sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+    _mm_storel_epi64((__m128i *) (out + 3 * pair), _mm_packus_epi16(sum, sum));
+  }
+
+  return pair;
+}
+
+__attribute__((target("sse2")))
+static size_t downsample_rgba_sse2(const uint8_t *top, const uint8_t *bottom, size_t width, uint8_t *out)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i two = _mm_set1_epi16(2);
+  size_t pair = 0;
+
+  // 4 pixels in, 2 out: vertical sums per pixel, then the upper pixel of each 64 bit half added to the lower one
+  for (; 2 * pair + 4 <= width; pair += 2) {
+    __m128i t = _mm_loadu_si128((const __m128i *) (top + 8 * pair));
+    __m128i b = _mm_loadu_si128((const __m128i *) (bottom + 8 * pair));
+    __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(t, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(t, zero), _mm_unpackhi_epi8(b, zero));
+    low = _mm_add_epi16(low, _mm_srli_si128(low, 8));
+    high = _mm_add_epi16(high, _mm_srli_si128(high, 8));
+    __m128i sum = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(low, high), two), 2);
+    _mm_storel_epi64((__m128i *) (out + 4 * pair), _mm_packus_epi16(sum, sum));
+  }
+
+  return pair;
+}
+
+#endif // HAVE_X86_KERNELS
+
+void downsample_rows(const uint8_t *top, const uint8_t *bottom, size_t width, int nbands, uint8_t *out)
+{
+  size_t done = 0;
+
+#ifdef HAVE_X86_KERNELS
+  if (nbands == 1 && __builtin_cpu_supports("ssse3"))
+    done = downsample_gray_ssse3(top, bottom, width, out);
+  else if (nbands == 3 && __builtin_cpu_supports("ssse3"))
+    done = downsample_rgb_ssse3(top, bottom, width, out);
+  else if (nbands == 4 && __builtin_cpu_supports("sse2"))
+    done = downsample_rgba_sse2(top, bottom, width, out);
+#endif // HAVE_X86_KERNELS
+
+  downsample_rows_scalar(top, bottom, width, nbands, done, out);
+}
+
+int is_uniform_window(const uint8_t *data, size_t stride, size_t width, size_t rows, int nbands, int threshold)
+{
+  size_t length = width * nbands;
+  uint8_t pattern[UNIFORM_STEP];
+
+  // rows start on a pixel, and UNIFORM_STEP is a whole number of pixels, so the pattern stays in phase
+  for (int i = 0; i < UNIFORM_STEP; i++)
+    pattern[i] = data[i % nbands];
+
+#ifdef HAVE_X86_KERNELS
+  size_t (*row_deviates)(const uint8_t *, size_t, const uint8_t *, int, int *) =
+    __builtin_cpu_supports("avx2") ? row_deviates_avx2 : __builtin_cpu_supports("sse2") ? row_deviates_sse2 : NULL;
+#endif // HAVE_X86_KERNELS
+
+  for (size_t y = 0; y < rows; y++) {
+    const uint8_t *row = data + y * stride;
+    size_t done = 0;
+#ifdef HAVE_X86_KERNELS
+    int deviates = 0;
+    if (row_deviates) {
+      done = row_deviates(row, length, pattern, threshold, &deviates);
+      if (deviates)
+        return 0;
+    }
+#endif // HAVE_X86_KERNELS
+    if (row_deviates_scalar(row, done, length, pattern, nbands, threshold))
+      return 0;
+  }
+
+  return 1;
+}
+
+void interleave_bands(const uint8_t *const *planes, int nbands, size_t pixels, uint8_t *out)
+{
+  size_t done = 0;
+
+#ifdef HAVE_X86_KERNELS
+  if (nbands == 3) {
+    if (__builtin_cpu_supports("avx2"))
+      done = interleave_rgb_avx2(planes, pixels, out);
+    else if (__builtin_cpu_supports("ssse3"))
+      done = interleave_rgb_ssse3(planes, pixels, out);
+  } else if (nbands == 4) {
+    if (__builtin_cpu_supports("avx2"))
+      done = interleave_rgba_avx2(planes, pixels, out);
+    else if (__builtin_cpu_supports("sse2"))
+      done = interleave_rgba_sse2(planes, pixels, out);
+  }
+#endif // HAVE_X86_KERNELS
+
+  if (done == 0) {
+    interleave_bands_scalar(planes, nbands, pixels, out);
+    return;
+  }
+
+  // remaining pixels that do not fill a whole vector
+  const uint8_t *rest[4];
+  for (int band = 0; band < nbands; band++)
+    rest[band] = planes[band] + done;
+  interleave_bands_scalar(rest, nbands, pixels - done, out + done * nbands);
+}
@@ -0,0 +1,20 @@
+#ifndef _KERNELS_H
+#define _KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// writes 'pixels' samples of each of the 'nbands' planes to 'out', interleaved band by band per pixel
+// (gray, RGB or RGBA for 1, 3 or 4 bands). Uses AVX2 or SSSE3/SSE2 when the CPU has them.
+void interleave_bands(const uint8_t *const *planes, int nbands, size_t pixels, uint8_t *out);
+
+// 1 if every sample of the 'width' x 'rows' window of pixel-interleaved 'data' (row pitch 'stride' bytes) lies within
+// 'threshold' of the window's first pixel, band by band; 0 otherwise. Uses AVX2 or SSE2 when the CPU has them.
+int is_uniform_window(const uint8_t *data, size_t stride, size_t width, size_t rows, int nbands, int threshold);
+
+// averages each 2x2 block of pixels of the pixel-interleaved rows 'top' and 'bottom' ('width' pixels of 'nbands'
+// samples) into one pixel of 'out', which receives (width + 1) / 2 pixels. An odd last column is averaged with itself;
+// pass the same row twice for an odd last row. Uses SSSE3/SSE2 for 1, 3 and 4 bands when the CPU has them.
+void downsample_rows(const uint8_t *top, const uint8_t *bottom, size_t width, int nbands, uint8_t *out);
+
+#endif // _KERNELS_H
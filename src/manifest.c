@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <gdal/cpl_vsi.h>
+
+#include "manifest.h"
+
+/*
+ * Output manifests live in the output directory of ab-tile and ab-convert. One tab-separated line per source:
+ * source path, size, modification time, CRC-32 (0 if not hashed), processing parameters and the names of all
+ * files made from it. Sources whose line still matches are skipped; the outputs of changed ones are removed
+ * before they are processed again.
+ */
+#define OUTPUT_MANIFEST_HEADER "# aerial-berlin output manifest v1"
+
+// size and mtime through VSI, so that members of zip archives (/vsizip/...) are covered as well
+int stamp_source(const char *source, int hash, source_stamp *stamp)
+{
+  VSIStatBufL stat_buf;
+  if (VSIStatL(source, &stat_buf) != 0) {
+    fprintf(stderr, "ERROR: Could not stat '%s'\n", source);
+    return 1;
+  }
+
+  stamp->size = (long long) stat_buf.st_size;
+  stamp->mtime = (long long) stat_buf.st_mtime;
+  stamp->checksum = 0;
+  if (!hash)
+    return 0;
+
+  VSILFILE *file = VSIFOpenL(source, "rb");
+  unsigned char *buffer = malloc(1 << 20);
+  if (file == NULL || buffer == NULL) {
+    fprintf(stderr, "ERROR: Could not read '%s'\n", source);
+    if (file)
+      VSIFCloseL(file);
+    free(buffer);
+    return 1;
+  }
+
+  uLong checksum = crc32(0L, Z_NULL, 0);
+  size_t read;
+  while ((read = VSIFReadL(buffer, 1, 1 << 20, file)) > 0)
+    checksum = crc32(checksum, buffer, read);
+  // an all-zero checksum would read as "not hashed"
+  stamp->checksum = checksum ? checksum : 1;
+
+  VSIFCloseL(file);
+  free(buffer);
+
+  return 0;
+}
+
+static output_record *find_record(const output_manifest *manifest, const char *source)
+{
+  for (size_t i = 0; i < manifest->count; i++)
+    if (strcmp(manifest->records[i].source, source) == 0)
+      return &manifest->records[i];
+  return NULL;
+}
+
+static void clear_outputs(output_record *record)
+{
+  for (size_t i = 0; i < record->output_count; i++)
+    free(record->outputs[i]);
+  record->output_count = 0;
+}
+
+static int append_output(output_record *record, const char *output)
+{
+  if (record->output_count == record->output_capacity) {
+    size_t capacity = record->output_capacity ? 2 * record->output_capacity : 16;
+    char **outputs = realloc(record->outputs, capacity * sizeof(char *));
+    if (outputs == NULL)
+      return 1;
+    record->outputs = outputs;
+    record->output_capacity = capacity;
+  }
+
+  record->outputs[record->output_count] = strdup(output);
+  if (record->outputs[record->output_count] == NULL)
+    return 1;
+  record->output_count++;
+
+  return 0;
+}
+
+// record for 'source', created empty if the manifest does not know it yet
+static output_record *get_record(output_manifest *manifest, const char *source, const char *parameters)
+{
+  output_record *record = find_record(manifest, source);
+  if (record)
+    return record;
+
+  output_record *records = realloc(manifest->records, (manifest->count + 1) * sizeof(output_record));
+  if (records == NULL)
+    return NULL;
+  manifest->records = records;
+
+  record = &manifest->records[manifest->count];
+  memset(record, 0, sizeof(output_record));
+  record->source = strdup(source);
+  record->parameters = strdup(parameters);
+  if (record->source == NULL || record->parameters == NULL) {
+    free(record->source);
+    free(record->parameters);
+    return NULL;
+  }
+  manifest->count++;
+
+  return record;
+}
+
+output_manifest *load_output_manifest(const char *directory, const char *name)
+{
+  output_manifest *manifest = calloc(1, sizeof(output_manifest));
+  if (manifest == NULL)
+    return NULL;
+  pthread_mutex_init(&manifest->lock, NULL);
+
+  manifest->directory = strdup(directory);
+  manifest->path = calloc(1024, sizeof(char));
+  if (manifest->directory == NULL || manifest->path == NULL ||
+      snprintf(manifest->path, 1024, "%s/%s", directory, name) >= 1024) {
+    destroy_output_manifest(manifest);
+    return NULL;
+  }
+
+  FILE *in = fopen(manifest->path, "r");
+  if (in == NULL)
+    return manifest;
+
+  // lines grow with the number of tiles per source, so they are read whole
+  char *line = NULL;
+  size_t line_size = 0;
+  while (getline(&line, &line_size, in) > 0) {
+    char *cursor = line;
+    char *fields[5];
+    int nfields = 0;
+
+    if (*line == '#')
+      continue;
+    line[strcspn(line, "\n")] = '\0';
+    while (nfields < 5 && (fields[nfields] = strsep(&cursor, "\t")) != NULL)
+      nfields++;
+    if (nfields != 5)
+      continue;
+
+    // the parameters field may not be empty, so strsep found a sixth field or the line ends here
+    char *parameters = strsep(&cursor, "\t");
+    if (parameters == NULL)
+      continue;
+    output_record *record = get_record(manifest, fields[0], parameters);
+    if (record == NULL)
+      break;
+    record->stamp.size = strtoll(fields[1], NULL, 10);
+    record->stamp.mtime = strtoll(fields[2], NULL, 10);
+    record->stamp.checksum = strtoul(fields[3], NULL, 16);
+    record->complete = strcmp(fields[4], "done") == 0;
+
+    char *output;
+    while ((output = strsep(&cursor, "\t")) != NULL)
+      if (*output && append_output(record, output))
+        break;
+  }
+  free(line);
+  fclose(in);
+
+  return manifest;
+}
+
+// whether 'source' was completely processed with 'parameters' while it looked like 'stamp', and all of its
+// outputs are still there; a checksum is only compared if both sides have one
+int output_manifest_unchanged(output_manifest *manifest, const char *source, const source_stamp *stamp,
+                              const char *parameters)
+{
+  const output_record *record = find_record(manifest, source);
+  if (record == NULL || !record->complete || record->stamp.size != stamp->size ||
+      record->stamp.mtime != stamp->mtime || strcmp(record->parameters, parameters) != 0 ||
+      (record->stamp.checksum && stamp->checksum && record->stamp.checksum != stamp->checksum))
+    return 0;
+
+  char path[2048];
+  struct stat output_stat;
+  for (size_t i = 0; i < record->output_count; i++) {
+    snprintf(path, sizeof(path), "%s/%s", manifest->directory, record->outputs[i]);
+    if (stat(path, &output_stat) != 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+// removes the files previously made from 'source' and starts a new, incomplete record for it
+int output_manifest_begin(output_manifest *manifest, const char *source, const source_stamp *stamp,
+                          const char *parameters)
+{
+  output_record *record = get_record(manifest, source, parameters);
+  if (record == NULL) {
+    fprintf(stderr, "ERROR: Failed to add '%s' to output manifest\n", source);
+    return 1;
+  }
+
+  char path[2048];
+  for (size_t i = 0; i < record->output_count; i++) {
+    snprintf(path, sizeof(path), "%s/%s", manifest->directory, record->outputs[i]);
+    unlink(path);
+  }
+  clear_outputs(record);
+
+  if (strcmp(record->parameters, parameters) != 0) {
+    char *copy = strdup(parameters);
+    if (copy == NULL) {
+      fprintf(stderr, "ERROR: Failed to add '%s' to output manifest\n", source);
+      return 1;
+    }
+    free(record->parameters);
+    record->parameters = copy;
+  }
+  record->stamp = *stamp;
+  record->complete = 0;
+
+  return 0;
+}
+
+// safe to call from several threads; 'output' is stored by its name within the output directory
+int output_manifest_add(output_manifest *manifest, const char *source, const char *output)
+{
+  const char *name = strrchr(output, '/');
+  name = name ? name + 1 : output;
+
+  pthread_mutex_lock(&manifest->lock);
+  output_record *record = find_record(manifest, source);
+  int status = record == NULL || append_output(record, name);
+  pthread_mutex_unlock(&manifest->lock);
+
+  if (status)
+    fprintf(stderr, "ERROR: Failed to add '%s' to output manifest\n", output);
+
+  return status;
+}
+
+void output_manifest_complete(output_manifest *manifest, const char *source)
+{
+  pthread_mutex_lock(&manifest->lock);
+  output_record *record = find_record(manifest, source);
+  if (record)
+    record->complete = 1;
+  pthread_mutex_unlock(&manifest->lock);
+}
+
+// written to a temporary file first so an interrupted run never leaves a truncated manifest
+int save_output_manifest(output_manifest *manifest)
+{
+  char tmp_path[1024 + 4];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", manifest->path);
+
+  FILE *out = fopen(tmp_path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "ERROR: Could not write output manifest '%s'\n", manifest->path);
+    return 1;
+  }
+
+  fprintf(out, "%s\n", OUTPUT_MANIFEST_HEADER);
+  for (size_t i = 0; i < manifest->count; i++) {
+    const output_record *record = &manifest->records[i];
+    fprintf(out, "%s\t%lld\t%lld\t%08lx\t%s\t%s", record->source, record->stamp.size, record->stamp.mtime,
+            record->stamp.checksum, record->complete ? "done" : "partial", record->parameters);
+    for (size_t j = 0; j < record->output_count; j++)
+      fprintf(out, "\t%s", record->outputs[j]);
+    fputc('\n', out);
+  }
+
+  if (fclose(out) != 0 || rename(tmp_path, manifest->path) != 0) {
+    fprintf(stderr, "ERROR: Could not write output manifest '%s'\n", manifest->path);
+    unlink(tmp_path);
+    return 1;
+  }
+
+  return 0;
+}
+
+void destroy_output_manifest(output_manifest *manifest)
+{
+  if (manifest == NULL)
+    return;
+  for (size_t i = 0; i < manifest->count; i++) {
+    clear_outputs(&manifest->records[i]);
+    free(manifest->records[i].outputs);
+    free(manifest->records[i].source);
+    free(manifest->records[i].parameters);
+  }
+  free(manifest->records);
+  free(manifest->directory);
+  free(manifest->path);
+  pthread_mutex_destroy(&manifest->lock);
+  free(manifest);
+}
@@ -0,0 +1,55 @@
+#ifndef _MANIFEST_H
+#define _MANIFEST_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// what a source looked like when its outputs were made; checksum is 0 unless content hashing was requested
+typedef struct
+{
+  long long size;
+  long long mtime;
+  unsigned long checksum;
+} source_stamp;
+
+// one source, the parameters it was processed with and the files (relative to the output directory) it produced
+typedef struct
+{
+  char *source;
+  source_stamp stamp;
+  char *parameters;
+  char **outputs;
+  size_t output_count;
+  size_t output_capacity;
+  int complete;
+} output_record;
+
+// per output directory record of which sources produced which files, used to redo only what changed
+typedef struct
+{
+  char *directory;
+  char *path;
+  output_record *records;
+  size_t count;
+  pthread_mutex_t lock;
+} output_manifest;
+
+int stamp_source(const char *source, int hash, source_stamp *stamp);
+
+output_manifest *load_output_manifest(const char *directory, const char *name);
+
+int output_manifest_unchanged(output_manifest *manifest, const char *source, const source_stamp *stamp,
+                              const char *parameters);
+
+int output_manifest_begin(output_manifest *manifest, const char *source, const source_stamp *stamp,
+                          const char *parameters);
+
+int output_manifest_add(output_manifest *manifest, const char *source, const char *output);
+
+void output_manifest_complete(output_manifest *manifest, const char *source);
+
+int save_output_manifest(output_manifest *manifest);
+
+void destroy_output_manifest(output_manifest *manifest);
+
+#endif // _MANIFEST_H
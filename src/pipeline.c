@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pipeline.h"
+
+// initial size of an unbounded queue, which doubles whenever it is full
+#define UNBOUNDED_CAPACITY 64
+
+work_queue *create_work_queue(size_t capacity)
+{
+  work_queue *queue = calloc(1, sizeof(work_queue));
+  if (queue == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate work queue.\n");
+    return NULL;
+  }
+
+  queue->unbounded = capacity == 0;
+  queue->capacity = capacity ? capacity : UNBOUNDED_CAPACITY;
+  queue->items = calloc(queue->capacity, sizeof(List *));
+  if (queue->items == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate work queue.\n");
+    free(queue);
+    return NULL;
+  }
+
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+
+  return queue;
+}
+
+// doubles the capacity of a full queue, moving its items to the front of the new array
+static int grow_work_queue(work_queue *queue)
+{
+  List **items = calloc(2 * queue->capacity, sizeof(List *));
+  if (items == NULL) {
+    fprintf(stderr, "ERROR: Failed to grow work queue.\n");
+    return 1;
+  }
+
+  for (size_t i = 0; i < queue->count; i++)
+    items[i] = queue->items[(queue->head + i) % queue->capacity];
+  free(queue->items);
+  queue->items = items;
+  queue->capacity *= 2;
+  queue->head = 0;
+
+  return 0;
+}
+
+// blocks while a bounded queue is full, an unbounded one grows instead; returns 1 (and keeps ownership with the
+// caller) if it was closed or could not grow
+int work_queue_push(work_queue *queue, List *item)
+{
+  pthread_mutex_lock(&queue->lock);
+  while (!queue->unbounded && queue->count == queue->capacity && !queue->closed)
+    pthread_cond_wait(&queue->not_full, &queue->lock);
+
+  if (queue->closed || (queue->count == queue->capacity && grow_work_queue(queue))) {
+    pthread_mutex_unlock(&queue->lock);
+    return 1;
+  }
+
+  item->next = NULL;
+  queue->items[(queue->head + queue->count) % queue->capacity] = item;
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+
+  return 0;
+}
+
+// blocks while the queue is empty; returns NULL once it is closed and drained
+List *work_queue_pop(work_queue *queue)
+{
+  List *item = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0 && !queue->closed)
+    pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+  if (queue->count) {
+    item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return item;
+}
+
+// no more items will be pushed; consumers drain what is left
+void work_queue_close(work_queue *queue)
+{
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->not_empty);
+  pthread_cond_broadcast(&queue->not_full);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+void destroy_work_queue(work_queue *queue)
+{
+  if (queue == NULL)
+    return;
+  while (queue->count) {
+    List *item = queue->items[queue->head];
+    item->next = NULL;
+    delete_list(item);
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+  }
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_cond_destroy(&queue->not_full);
+  free(queue->items);
+  free(queue);
+}
+
+memory_budget *create_memory_budget(size_t limit)
+{
+  memory_budget *budget = calloc(1, sizeof(memory_budget));
+  if (budget == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate memory budget.\n");
+    return NULL;
+  }
+
+  budget->limit = limit;
+  pthread_mutex_init(&budget->lock, NULL);
+  pthread_cond_init(&budget->released, NULL);
+
+  return budget;
+}
+
+// a request larger than the whole budget is granted once nothing else is held, so it cannot starve
+void memory_budget_acquire(memory_budget *budget, size_t bytes)
+{
+  pthread_mutex_lock(&budget->lock);
+  while (budget->in_use > 0 && budget->in_use + bytes > budget->limit)
+    pthread_cond_wait(&budget->released, &budget->lock);
+  budget->in_use += bytes;
+  pthread_mutex_unlock(&budget->lock);
+}
+
+void memory_budget_release(memory_budget *budget, size_t bytes)
+{
+  pthread_mutex_lock(&budget->lock);
+  budget->in_use -= bytes < budget->in_use ? bytes : budget->in_use;
+  pthread_cond_broadcast(&budget->released);
+  pthread_mutex_unlock(&budget->lock);
+}
+
+void destroy_memory_budget(memory_budget *budget)
+{
+  if (budget == NULL)
+    return;
+  pthread_mutex_destroy(&budget->lock);
+  pthread_cond_destroy(&budget->released);
+  free(budget);
+}
@@ -0,0 +1,50 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "tile.h"
+
+// FIFO of List nodes handed from one pipeline stage to the next; bounded unless created with capacity 0
+typedef struct
+{
+  List **items;
+  size_t capacity;
+  int unbounded;
+  size_t head;
+  size_t count;
+  int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} work_queue;
+
+// bytes of raster data the stages may hold at the same time
+typedef struct
+{
+  size_t limit;
+  size_t in_use;
+  pthread_mutex_t lock;
+  pthread_cond_t released;
+} memory_budget;
+
+work_queue *create_work_queue(size_t capacity);
+
+int work_queue_push(work_queue *queue, List *item);
+
+List *work_queue_pop(work_queue *queue);
+
+void work_queue_close(work_queue *queue);
+
+void destroy_work_queue(work_queue *queue);
+
+memory_budget *create_memory_budget(size_t limit);
+
+void memory_budget_acquire(memory_budget *budget, size_t bytes);
+
+void memory_budget_release(memory_budget *budget, size_t bytes);
+
+void destroy_memory_budget(memory_budget *budget);
+
+#endif // _PIPELINE_H
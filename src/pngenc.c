@@ -0,0 +1,587 @@
+#include <png.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif // HAVE_LIBDEFLATE
+
+#include "pngenc.h"
+
+// largest IDAT chunk written by the libdeflate and parallel zlib encoders
+#define IDAT_CHUNK_SIZE (1 << 20)
+
+// filtered bytes per independently compressed piece of the parallel zlib encoder, and the window primed from the
+// preceding piece
+#define DEFLATE_PIECE_SIZE (256 * 1024)
+#define DEFLATE_WINDOW_SIZE (32 * 1024)
+
+struct png_encoder
+{
+  char *path;
+  FILE *file;
+  // in-memory output of png_encoder_open_memory
+  char *memory;
+  size_t memory_size;
+  int in_memory;
+  size_t width;
+  size_t height;
+  int channels;
+  int profile;
+  int backend;
+  int threads;
+  // libpng backend
+  png_structp png;
+  png_infop info;
+  // libdeflate backend and parallel zlib: filtered scanlines of the whole image, compressed by png_encoder_finish
+  uint8_t *filtered;
+  uint8_t *previous;
+  size_t rows_written;
+};
+
+static void png_encoder_release(png_encoder *encoder)
+{
+  if (encoder->png)
+    png_destroy_write_struct(&encoder->png, &encoder->info);
+  if (encoder->file)
+    fclose(encoder->file);
+  free(encoder->filtered);
+  free(encoder->previous);
+  free(encoder->memory);
+  free(encoder->path);
+  free(encoder);
+}
+
+// row filters each profile may choose from, for libpng and for filter_row alike; libpng's default for 8 bit
+// images is all of them
+static const int profile_filters[] = {
+  [PNG_PROFILE_DEFAULT] = PNG_ALL_FILTERS,
+  [PNG_PROFILE_FAST] = PNG_FILTER_SUB,
+  [PNG_PROFILE_BALANCED] = PNG_FILTER_SUB | PNG_FILTER_UP | PNG_FILTER_PAETH,
+  [PNG_PROFILE_SMALL] = PNG_ALL_FILTERS,
+};
+
+// zlib level, strategy and row filters per profile; PNG_PROFILE_DEFAULT keeps libpng's choices
+static void apply_profile(png_encoder *encoder)
+{
+  switch (encoder->profile) {
+  case PNG_PROFILE_FAST:
+    png_set_compression_level(encoder->png, 1);
+    png_set_compression_strategy(encoder->png, Z_RLE);
+    png_set_filter(encoder->png, PNG_FILTER_TYPE_BASE, profile_filters[PNG_PROFILE_FAST]);
+    break;
+  case PNG_PROFILE_BALANCED:
+    png_set_compression_level(encoder->png, 6);
+    png_set_compression_strategy(encoder->png, Z_FILTERED);
+    png_set_filter(encoder->png, PNG_FILTER_TYPE_BASE, profile_filters[PNG_PROFILE_BALANCED]);
+    break;
+  case PNG_PROFILE_SMALL:
+    png_set_compression_level(encoder->png, 9);
+    png_set_compression_strategy(encoder->png, Z_FILTERED);
+    png_set_filter(encoder->png, PNG_FILTER_TYPE_BASE, profile_filters[PNG_PROFILE_SMALL]);
+    break;
+  }
+}
+
+static int open_libpng(png_encoder *encoder)
+{
+  encoder->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!encoder->png) {
+    fprintf(stderr, "ERROR: Could not create writer\n");
+    return 1;
+  }
+
+  encoder->info = png_create_info_struct(encoder->png);
+  if (!encoder->info) {
+    fprintf(stderr, "ERROR: Could not create info container\n");
+    return 1;
+  }
+
+  // libpng returns here if it fails while writing
+  if (setjmp(png_jmpbuf(encoder->png))) {
+    fprintf(stderr, "ERROR: Failed to write PNG '%s'\n", encoder->path);
+    return 1;
+  }
+
+  const int color_type = encoder->channels == 4 ? PNG_COLOR_TYPE_RGB_ALPHA :
+                         encoder->channels == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_GRAY;
+  png_init_io(encoder->png, encoder->file);
+  png_set_IHDR(encoder->png, encoder->info, encoder->width, encoder->height, 8, color_type, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  apply_profile(encoder);
+  png_write_info(encoder->png, encoder->info);
+
+  return 0;
+}
+
+static png_encoder *open_encoder(const char *path, int in_memory, size_t width, size_t height, int channels,
+                                 const options *option)
+{
+  png_encoder *encoder = calloc(1, sizeof(png_encoder));
+  if (encoder == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate PNG encoder\n");
+    return NULL;
+  }
+
+  encoder->width = width;
+  encoder->height = height;
+  encoder->channels = channels;
+  encoder->profile = option->png_profile;
+  encoder->backend = option->png_backend;
+  encoder->threads = option->threads;
+  encoder->in_memory = in_memory;
+  encoder->path = strdup(path);
+  if (encoder->path == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate PNG encoder\n");
+    png_encoder_release(encoder);
+    return NULL;
+  }
+
+  if (width == 0 || height == 0 || width > PNG_UINT_31_MAX / channels || height > PNG_UINT_31_MAX) {
+    fprintf(stderr, "ERROR: Image dimensions of '%s' not supported\n", path);
+    png_encoder_release(encoder);
+    return NULL;
+  }
+
+  encoder->file = in_memory ? open_memstream(&encoder->memory, &encoder->memory_size) : fopen(path, "wb");
+  if (encoder->file == NULL) {
+    fprintf(stderr, "ERROR: Could not open output file %s\n", path);
+    png_encoder_release(encoder);
+    return NULL;
+  }
+
+  if (encoder->backend == PNG_BACKEND_LIBDEFLATE || encoder->threads > 1) {
+    size_t stride = width * channels;
+    encoder->filtered = malloc(height * (stride + 1));
+    encoder->previous = calloc(stride, 1);
+    if (encoder->filtered == NULL || encoder->previous == NULL) {
+      fprintf(stderr, "ERROR: Could not allocate memory for PNG '%s'\n", path);
+      png_encoder_abort(encoder);
+      return NULL;
+    }
+  } else if (open_libpng(encoder)) {
+    png_encoder_abort(encoder);
+    return NULL;
+  }
+
+  return encoder;
+}
+
+png_encoder *png_encoder_open(const char *path, size_t width, size_t height, int channels, const options *option)
+{
+  return open_encoder(path, 0, width, height, channels, option);
+}
+
+// like png_encoder_open, but the PNG is kept in memory and handed out by png_encoder_finish_memory; 'name' only
+// appears in messages
+png_encoder *png_encoder_open_memory(const char *name, size_t width, size_t height, int channels,
+                                     const options *option)
+{
+  return open_encoder(name, 1, width, height, channels, option);
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+
+  return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// filters one scanline into out[0] (filter type) and out[1..]; of the PNG_FILTER_* bits in 'allowed', picks the
+// filter with the smallest sum of absolute values like libpng's heuristic. Average is never tried
+static void filter_row(const uint8_t *row, const uint8_t *previous, size_t stride, int bpp, int allowed, uint8_t *out)
+{
+  static const int candidates[] = { PNG_FILTER_VALUE_NONE, PNG_FILTER_VALUE_SUB, PNG_FILTER_VALUE_UP, PNG_FILTER_VALUE_PAETH };
+  static const int masks[] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_PAETH };
+  int best = PNG_FILTER_VALUE_NONE;
+  int choices = 0;
+
+  for (size_t c = 0; c < sizeof(candidates) / sizeof(candidates[0]); c++)
+    if (allowed & masks[c]) {
+      best = candidates[c];
+      choices++;
+    }
+
+  if (choices > 1) {
+    unsigned long best_sum = (unsigned long) -1;
+    for (size_t c = 0; c < sizeof(candidates) / sizeof(candidates[0]); c++) {
+      if (!(allowed & masks[c]))
+        continue;
+      unsigned long sum = 0;
+      for (size_t i = 0; i < stride; i++) {
+        uint8_t left = i >= (size_t) bpp ? row[i - bpp] : 0;
+        uint8_t upper_left = i >= (size_t) bpp ? previous[i - bpp] : 0;
+        uint8_t predicted = candidates[c] == PNG_FILTER_VALUE_SUB ? left :
+                            candidates[c] == PNG_FILTER_VALUE_UP ? previous[i] :
+                            candidates[c] == PNG_FILTER_VALUE_PAETH ? paeth(left, previous[i], upper_left) : 0;
+        int8_t residual = (int8_t) (row[i] - predicted);
+        sum += residual < 0 ? -residual : residual;
+      }
+      if (sum < best_sum) {
+        best_sum = sum;
+        best = candidates[c];
+      }
+    }
+  }
+
+  out[0] = (uint8_t) best;
+  for (size_t i = 0; i < stride; i++) {
+    uint8_t left = i >= (size_t) bpp ? row[i - bpp] : 0;
+    uint8_t upper_left = i >= (size_t) bpp ? previous[i - bpp] : 0;
+    uint8_t predicted = best == PNG_FILTER_VALUE_SUB ? left :
+                        best == PNG_FILTER_VALUE_UP ? previous[i] :
+                        best == PNG_FILTER_VALUE_PAETH ? paeth(left, previous[i], upper_left) : 0;
+    out[1 + i] = row[i] - predicted;
+  }
+}
+
+// 'rows' holds 'count' interleaved scanlines
+int png_encoder_write_rows(png_encoder *encoder, const uint8_t *rows, int count)
+{
+  size_t stride = encoder->width * encoder->channels;
+
+  if (encoder->rows_written + count > encoder->height) {
+    fprintf(stderr, "ERROR: Too many rows for PNG '%s'\n", encoder->path);
+    return 1;
+  }
+
+  if (encoder->filtered) {
+    for (int i = 0; i < count; i++) {
+      const uint8_t *row = rows + i * stride;
+      filter_row(row, encoder->previous, stride, encoder->channels, profile_filters[encoder->profile],
+                 encoder->filtered + (encoder->rows_written + i) * (stride + 1));
+      memcpy(encoder->previous, row, stride);
+    }
+    encoder->rows_written += count;
+    return 0;
+  }
+
+  if (setjmp(png_jmpbuf(encoder->png))) {
+    fprintf(stderr, "ERROR: Failed to write PNG '%s'\n", encoder->path);
+    return 1;
+  }
+  for (int i = 0; i < count; i++)
+    png_write_row(encoder->png, (png_const_bytep) (rows + i * stride));
+  encoder->rows_written += count;
+
+  return 0;
+}
+
+static int write_chunk(FILE *file, const char *type, const uint8_t *data, size_t length)
+{
+  uint8_t header[8] = {
+    length >> 24, length >> 16, length >> 8, length, type[0], type[1], type[2], type[3]
+  };
+  uLong crc = crc32(crc32(0L, Z_NULL, 0), header + 4, 4);
+  if (length)
+    crc = crc32(crc, data, length);
+  uint8_t trailer[4] = { crc >> 24, crc >> 16, crc >> 8, crc };
+
+  return fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+         (length && fwrite(data, 1, length, file) != length) ||
+         fwrite(trailer, 1, sizeof(trailer), file) != sizeof(trailer);
+}
+
+// signature, IHDR, the zlib stream split into IDAT chunks, IEND
+static int write_png_stream(png_encoder *encoder, const uint8_t *zlib_stream, size_t length)
+{
+  static const uint8_t signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+  const uint8_t color_type = encoder->channels == 4 ? PNG_COLOR_TYPE_RGB_ALPHA :
+                             encoder->channels == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_GRAY;
+  const uint8_t ihdr[13] = {
+    encoder->width >> 24, encoder->width >> 16, encoder->width >> 8, encoder->width,
+    encoder->height >> 24, encoder->height >> 16, encoder->height >> 8, encoder->height,
+    8, color_type, 0, 0, 0
+  };
+
+  if (fwrite(signature, 1, sizeof(signature), encoder->file) != sizeof(signature) ||
+      write_chunk(encoder->file, "IHDR", ihdr, sizeof(ihdr)))
+    return 1;
+
+  for (size_t offset = 0; offset < length; offset += IDAT_CHUNK_SIZE) {
+    size_t chunk = length - offset < IDAT_CHUNK_SIZE ? length - offset : IDAT_CHUNK_SIZE;
+    if (write_chunk(encoder->file, "IDAT", zlib_stream + offset, chunk))
+      return 1;
+  }
+
+  return write_chunk(encoder->file, "IEND", NULL, 0);
+}
+
+#ifdef HAVE_LIBDEFLATE
+static int finish_libdeflate(png_encoder *encoder)
+{
+  const int levels[] = { [PNG_PROFILE_DEFAULT] = 6, [PNG_PROFILE_FAST] = 1, [PNG_PROFILE_BALANCED] = 6, [PNG_PROFILE_SMALL] = 12 };
+  size_t raw_size = encoder->height * (encoder->width * encoder->channels + 1);
+
+  struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(levels[encoder->profile]);
+  if (compressor == NULL) {
+    fprintf(stderr, "ERROR: Could not create libdeflate compressor\n");
+    return 1;
+  }
+
+  size_t bound = libdeflate_zlib_compress_bound(compressor, raw_size);
+  uint8_t *compressed = malloc(bound);
+  size_t length = compressed ? libdeflate_zlib_compress(compressor, encoder->filtered, raw_size, compressed, bound) : 0;
+  libdeflate_free_compressor(compressor);
+
+  int status = length == 0 || write_png_stream(encoder, compressed, length);
+  if (status)
+    fprintf(stderr, "ERROR: Failed to write PNG '%s'\n", encoder->path);
+  free(compressed);
+
+  return status;
+}
+#endif // HAVE_LIBDEFLATE
+
+// one piece of the filtered image, deflated on its own but primed with the window before it; the last piece
+// terminates the stream, all others end on a byte boundary (Z_SYNC_FLUSH) so the pieces can simply be concatenated
+typedef struct
+{
+  const uint8_t *data;
+  size_t length;
+  size_t window;
+  int last;
+  uint8_t *out;
+  size_t out_length;
+  uLong adler;
+} deflate_piece;
+
+typedef struct
+{
+  deflate_piece *pieces;
+  size_t count;
+  int level;
+  int strategy;
+  pthread_mutex_t lock;
+  size_t next_piece;
+  int status;
+} deflate_job;
+
+static int deflate_piece_compress(deflate_piece *piece, int level, int strategy)
+{
+  z_stream stream = { 0 };
+  if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, strategy) != Z_OK)
+    return 1;
+
+  // deflateBound covers a finished stream; a sync flush adds at most an empty stored block
+  size_t bound = deflateBound(&stream, piece->length) + 16;
+  piece->out = malloc(bound);
+  int status = piece->out == NULL ||
+               (piece->window && deflateSetDictionary(&stream, piece->data - piece->window, piece->window) != Z_OK);
+
+  if (status == 0) {
+    stream.next_in = (Bytef *) piece->data;
+    stream.avail_in = piece->length;
+    stream.next_out = piece->out;
+    stream.avail_out = bound;
+    int result = deflate(&stream, piece->last ? Z_FINISH : Z_SYNC_FLUSH);
+    status = piece->last ? result != Z_STREAM_END : result != Z_OK || stream.avail_in != 0;
+    piece->out_length = bound - stream.avail_out;
+  }
+  deflateEnd(&stream);
+
+  piece->adler = adler32(adler32(0L, Z_NULL, 0), piece->data, piece->length);
+
+  return status;
+}
+
+// takes pieces until none are left or one of the threads failed
+static void *deflate_worker(void *arg)
+{
+  deflate_job *job = (deflate_job *) arg;
+
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    size_t index = job->status == 0 && job->next_piece < job->count ? job->next_piece++ : job->count;
+    pthread_mutex_unlock(&job->lock);
+    if (index == job->count)
+      break;
+
+    if (deflate_piece_compress(&job->pieces[index], job->level, job->strategy)) {
+      pthread_mutex_lock(&job->lock);
+      job->status = 1;
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+
+  return NULL;
+}
+
+// runs deflate_worker on up to 'threads' threads
+static int run_deflate_job(deflate_job *job, int threads)
+{
+  if (threads > (int) job->count)
+    threads = job->count;
+
+  pthread_t *workers = calloc(threads, sizeof(pthread_t));
+  if (workers == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate worker threads.\n");
+    return 1;
+  }
+
+  int started = 0;
+  for (; started < threads; started++)
+    if (pthread_create(&workers[started], NULL, deflate_worker, job) != 0)
+      break;
+  // whatever could not be started is picked up by the remaining threads, or this one
+  if (started == 0)
+    deflate_worker(job);
+  for (int i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+  free(workers);
+
+  return job->status;
+}
+
+// zlib header for the level actually used, see RFC 1950
+static void zlib_header(int level, int strategy, uint8_t header[2])
+{
+  int flevel = level == Z_DEFAULT_COMPRESSION ? 2 :
+               level < 2 || strategy >= Z_HUFFMAN_ONLY ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+  header[0] = 0x78;
+  header[1] = flevel << 6;
+  header[1] += 31 - ((header[0] << 8) + header[1]) % 31;
+}
+
+// splits the filtered image into pieces that are deflated concurrently, pigz-style, and stitches them into a
+// single zlib stream: a header, the raw deflate pieces back to back and the Adler-32 combined from all pieces
+static int finish_parallel(png_encoder *encoder)
+{
+  const int levels[] = { [PNG_PROFILE_DEFAULT] = Z_DEFAULT_COMPRESSION, [PNG_PROFILE_FAST] = 1, [PNG_PROFILE_BALANCED] = 6, [PNG_PROFILE_SMALL] = 9 };
+  const int strategies[] = { [PNG_PROFILE_DEFAULT] = Z_FILTERED, [PNG_PROFILE_FAST] = Z_RLE, [PNG_PROFILE_BALANCED] = Z_FILTERED, [PNG_PROFILE_SMALL] = Z_FILTERED };
+  size_t raw_size = encoder->height * (encoder->width * encoder->channels + 1);
+
+  deflate_job job = {
+    .count = (raw_size + DEFLATE_PIECE_SIZE - 1) / DEFLATE_PIECE_SIZE,
+    .level = levels[encoder->profile],
+    .strategy = strategies[encoder->profile],
+  };
+  job.pieces = calloc(job.count, sizeof(deflate_piece));
+  if (job.pieces == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate memory for PNG '%s'\n", encoder->path);
+    return 1;
+  }
+
+  for (size_t i = 0; i < job.count; i++) {
+    size_t offset = i * DEFLATE_PIECE_SIZE;
+    job.pieces[i].data = encoder->filtered + offset;
+    job.pieces[i].length = raw_size - offset < DEFLATE_PIECE_SIZE ? raw_size - offset : DEFLATE_PIECE_SIZE;
+    job.pieces[i].window = offset < DEFLATE_WINDOW_SIZE ? offset : DEFLATE_WINDOW_SIZE;
+    job.pieces[i].last = i == job.count - 1;
+  }
+
+  pthread_mutex_init(&job.lock, NULL);
+  int status = run_deflate_job(&job, encoder->threads);
+  pthread_mutex_destroy(&job.lock);
+
+  uint8_t *stream = NULL;
+  if (status == 0) {
+    size_t length = 2 + 4;
+    for (size_t i = 0; i < job.count; i++)
+      length += job.pieces[i].out_length;
+
+    stream = malloc(length);
+    status = stream == NULL;
+    if (status == 0) {
+      uLong adler = job.pieces[0].adler;
+      size_t offset = 2;
+      zlib_header(job.level, job.strategy, stream);
+      for (size_t i = 0; i < job.count; i++) {
+        memcpy(stream + offset, job.pieces[i].out, job.pieces[i].out_length);
+        offset += job.pieces[i].out_length;
+        if (i)
+          adler = adler32_combine(adler, job.pieces[i].adler, job.pieces[i].length);
+      }
+      stream[offset++] = adler >> 24;
+      stream[offset++] = adler >> 16;
+      stream[offset++] = adler >> 8;
+      stream[offset++] = adler;
+
+      status = write_png_stream(encoder, stream, length);
+    }
+  }
+  if (status)
+    fprintf(stderr, "ERROR: Failed to write PNG '%s'\n", encoder->path);
+
+  for (size_t i = 0; i < job.count; i++)
+    free(job.pieces[i].out);
+  free(job.pieces);
+  free(stream);
+
+  return status;
+}
+
+static int finish_encoder(png_encoder *encoder)
+{
+  int status = 0;
+
+  if (encoder->rows_written != encoder->height) {
+    fprintf(stderr, "ERROR: PNG '%s' is missing rows\n", encoder->path);
+    status = 1;
+  } else if (encoder->backend == PNG_BACKEND_LIBDEFLATE) {
+#ifdef HAVE_LIBDEFLATE
+    status = finish_libdeflate(encoder);
+#else
+    status = 1;
+#endif // HAVE_LIBDEFLATE
+  } else if (encoder->threads > 1) {
+    status = finish_parallel(encoder);
+  } else if (setjmp(png_jmpbuf(encoder->png))) {
+    fprintf(stderr, "ERROR: Failed to write PNG '%s'\n", encoder->path);
+    status = 1;
+  } else {
+    png_write_end(encoder->png, encoder->info);
+  }
+
+  if (encoder->file && fclose(encoder->file) != 0)
+    status = 1;
+  encoder->file = NULL;
+
+  if (status && !encoder->in_memory) {
+    remove(encoder->path);
+  }
+
+  return status;
+}
+
+// completes the file; on error the partial output is removed. Frees the encoder either way
+int png_encoder_finish(png_encoder *encoder)
+{
+  int status = finish_encoder(encoder);
+  png_encoder_release(encoder);
+
+  return status;
+}
+
+// completes a PNG opened with png_encoder_open_memory and hands its bytes to the caller, who frees them with free()
+int png_encoder_finish_memory(png_encoder *encoder, uint8_t **data, size_t *size)
+{
+  int status = finish_encoder(encoder);
+  if (status == 0) {
+    *data = (uint8_t *) encoder->memory;
+    *size = encoder->memory_size;
+    encoder->memory = NULL;
+  }
+  png_encoder_release(encoder);
+
+  return status;
+}
+
+// stops writing and removes the partial output
+void png_encoder_abort(png_encoder *encoder)
+{
+  if (encoder->file) {
+    fclose(encoder->file);
+    encoder->file = NULL;
+    if (!encoder->in_memory)
+      remove(encoder->path);
+  }
+  png_encoder_release(encoder);
+}
@@ -0,0 +1,25 @@
+#ifndef _PNGENC_H
+#define _PNGENC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aerial-berlin.h"
+
+// writes an 8 bit gray, RGB or RGBA PNG row block by row block, with the profile and backend from 'option'
+typedef struct png_encoder png_encoder;
+
+png_encoder *png_encoder_open(const char *path, size_t width, size_t height, int channels, const options *option);
+
+png_encoder *png_encoder_open_memory(const char *name, size_t width, size_t height, int channels,
+                                     const options *option);
+
+int png_encoder_write_rows(png_encoder *encoder, const uint8_t *rows, int count);
+
+int png_encoder_finish(png_encoder *encoder);
+
+int png_encoder_finish_memory(png_encoder *encoder, uint8_t **data, size_t *size);
+
+void png_encoder_abort(png_encoder *encoder);
+
+#endif // _PNGENC_H
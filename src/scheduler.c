@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+
+typedef struct
+{
+  scheduler *pool;
+  int worker;
+} worker_arg;
+
+scheduler *create_scheduler(int workers)
+{
+  scheduler *pool = calloc(1, sizeof(scheduler));
+  if (pool == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate scheduler.\n");
+    return NULL;
+  }
+
+  pool->deques = calloc(workers, sizeof(task_deque));
+  if (pool->deques == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate scheduler.\n");
+    free(pool);
+    return NULL;
+  }
+  pool->workers = workers;
+
+  for (int i = 0; i < workers; i++)
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+  pthread_mutex_init(&pool->lock, NULL);
+
+  return pool;
+}
+
+// worker with the least work assigned so far, charged with 'cost'; used to hand out the biggest jobs first
+int scheduler_pick(scheduler *pool, size_t cost)
+{
+  int worker = 0;
+  for (int i = 1; i < pool->workers; i++)
+    if (pool->deques[i].cost < pool->deques[worker].cost)
+      worker = i;
+  pool->deques[worker].cost += cost;
+
+  return worker;
+}
+
+// queues a task for 'worker'; only valid before scheduler_run
+int scheduler_push(scheduler *pool, int worker, void *task)
+{
+  task_deque *deque = &pool->deques[worker];
+
+  if (deque->tail == deque->capacity) {
+    size_t capacity = deque->capacity ? deque->capacity * 2 : 16;
+    void **tasks = realloc(deque->tasks, capacity * sizeof(void *));
+    if (tasks == NULL) {
+      fprintf(stderr, "ERROR: Failed to queue task.\n");
+      return 1;
+    }
+    deque->tasks = tasks;
+    deque->capacity = capacity;
+  }
+  deque->tasks[deque->tail++] = task;
+
+  return 0;
+}
+
+static void *take_own(task_deque *deque)
+{
+  void *task = NULL;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->head < deque->tail)
+    task = deque->tasks[deque->head++];
+  pthread_mutex_unlock(&deque->lock);
+
+  return task;
+}
+
+static void *steal(task_deque *deque)
+{
+  void *task = NULL;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->head < deque->tail)
+    task = deque->tasks[--deque->tail];
+  pthread_mutex_unlock(&deque->lock);
+
+  return task;
+}
+
+static int has_failed(scheduler *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  int failed = pool->failed;
+  pthread_mutex_unlock(&pool->lock);
+
+  return failed;
+}
+
+static void *run_worker(void *arg)
+{
+  scheduler *pool = ((worker_arg *) arg)->pool;
+  int worker = ((worker_arg *) arg)->worker;
+
+  while (!has_failed(pool)) {
+    void *task = take_own(&pool->deques[worker]);
+    // own deque is empty: steal the last task of the first other worker that still has some
+    for (int i = 1; task == NULL && i < pool->workers; i++)
+      task = steal(&pool->deques[(worker + i) % pool->workers]);
+    // tasks are only ever removed during the run, so nothing left anywhere means we are done
+    if (task == NULL)
+      break;
+
+    if (pool->run(task, worker, pool->context)) {
+      pthread_mutex_lock(&pool->lock);
+      pool->failed = 1;
+      pthread_mutex_unlock(&pool->lock);
+    }
+  }
+
+  return NULL;
+}
+
+// runs all queued tasks on 'workers' threads and returns nonzero if any of them failed; no new tasks are
+// started after the first failure
+int scheduler_run(scheduler *pool, task_function run, void *context)
+{
+  pool->run = run;
+  pool->context = context;
+  pool->failed = 0;
+
+  pthread_t *threads = calloc(pool->workers, sizeof(pthread_t));
+  worker_arg *args = calloc(pool->workers, sizeof(worker_arg));
+  if (threads == NULL || args == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate worker threads.\n");
+    free(threads);
+    free(args);
+    return 1;
+  }
+
+  // worker 0 runs on the calling thread
+  int started = 1;
+  for (; started < pool->workers; started++) {
+    args[started] = (worker_arg) {
+      .pool = pool, .worker = started
+    };
+    if (pthread_create(&threads[started], NULL, run_worker, &args[started]) != 0)
+      break;
+  }
+  args[0] = (worker_arg) {
+    .pool = pool, .worker = 0
+  };
+  run_worker(&args[0]);
+
+  for (int i = 1; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  free(args);
+
+  return pool->failed;
+}
+
+void destroy_scheduler(scheduler *pool)
+{
+  if (pool == NULL)
+    return;
+  for (int i = 0; i < pool->workers; i++) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    free(pool->deques[i].tasks);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->deques);
+  free(pool);
+}
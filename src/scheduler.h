@@ -0,0 +1,42 @@
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// runs a task on behalf of worker 'worker'; nonzero marks the whole run as failed
+typedef int (*task_function)(void *task, int worker, void *context);
+
+// tasks owned by one worker, taken from the front by their owner and from the back by thieves
+typedef struct
+{
+  void **tasks;
+  size_t capacity;
+  size_t head;
+  size_t tail;
+  size_t cost;
+  pthread_mutex_t lock;
+} task_deque;
+
+// fixed set of tasks, distributed before the run and rebalanced by work stealing during it
+typedef struct
+{
+  task_deque *deques;
+  int workers;
+  task_function run;
+  void *context;
+  int failed;
+  pthread_mutex_t lock;
+} scheduler;
+
+scheduler *create_scheduler(int workers);
+
+int scheduler_pick(scheduler *pool, size_t cost);
+
+int scheduler_push(scheduler *pool, int worker, void *task);
+
+int scheduler_run(scheduler *pool, task_function run, void *context);
+
+void destroy_scheduler(scheduler *pool);
+
+#endif // _SCHEDULER_H
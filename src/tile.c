@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <stdio.h>
@@ -6,13 +7,23 @@
 #include <gdal/gdal.h>
 #include <gdal/cpl_conv.h>
 #include <gdal/cpl_error.h>
+#include <gdal/cpl_string.h>
+#include <gdal/cpl_vsi.h>
 #include <gdal/ogr_srs_api.h>
 #include <stdint.h>
 #include <strings.h>
-#include <png.h>
-#include <setjmp.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
 
+#include "archive.h"
+#include "cache.h"
+#include "kernels.h"
+#include "manifest.h"
+#include "pngenc.h"
+#include "scheduler.h"
 #include "tile.h"
+#include "vrt.h"
 
 // todo guard against non-exisiting directory? Shouldn't this be done by the switch statement?
 List *gather_files(const char *directory)
@@ -93,6 +104,131 @@ List *gather_files(const char *directory)
   return root;
 }
 
+static int has_extension(const char *path, const char *extension)
+{
+  const char *dot = strrchr(path, '.');
+  return dot != NULL && strcasecmp(dot, extension) == 0;
+}
+
+// builds a list node for a raster inside a zip archive, named after the member itself
+static List *archive_member(const char *archive, const char *member)
+{
+  int written;
+  const char *name = strrchr(member, '/');
+  name = name ? name + 1 : member;
+
+  List *node = calloc(1, sizeof(List));
+  if (node == NULL)
+    return NULL;
+  node->file = calloc(1024, sizeof(char));
+  node->base = calloc(1024, sizeof(char));
+  if (node->file == NULL || node->base == NULL) {
+    delete_list(node);
+    return NULL;
+  }
+
+  written = snprintf(node->file, 1024, "/vsizip/%s/%s", archive, member);
+  if (written >= 1024) {
+    fprintf(stderr, "ERROR: File path longer than 1024 bytes\n");
+    delete_list(node);
+    return NULL;
+  }
+  snprintf(node->base, 1024, "%s", name);
+  *strrchr(node->base, '.') = '\0';
+
+  return node;
+}
+
+// replaces every zip archive in the list by the ECW/JP2 members it contains, read in place via /vsizip/
+List *expand_archives(List *files)
+{
+  List *root = NULL;
+
+  while (files) {
+    List *node = files;
+    files = files->next;
+
+    if (!has_extension(node->file, ".zip")) {
+      node->next = root;
+      root = node;
+      continue;
+    }
+
+    char archive[1024 + 8];
+    snprintf(archive, sizeof(archive), "/vsizip/%s", node->file);
+    char **members = VSIReadDirRecursive(archive);
+    if (members == NULL)
+      fprintf(stderr, "WARNING: Could not list contents of '%s'\n", node->file);
+
+    for (char **member = members; member && *member; member++) {
+      if (!has_extension(*member, ".ecw") && !has_extension(*member, ".jp2"))
+        continue;
+      List *entry = archive_member(node->file, *member);
+      if (entry == NULL) {
+        fprintf(stderr, "ERROR: Failed to add member '%s' of '%s' to file list\n", *member, node->file);
+        continue;
+      }
+      entry->next = root;
+      root = entry;
+    }
+
+    CSLDestroy(members);
+    node->next = NULL;
+    delete_list(node);
+  }
+
+  return root;
+}
+
+// replaces every tile archive (.abt) in the list by the GeoTIFF tiles it holds, read in place via /vsisubfile/
+List *expand_tile_archives(List *files)
+{
+  List *root = NULL;
+
+  while (files) {
+    List *node = files;
+    files = files->next;
+
+    if (!has_extension(node->file, ".abt")) {
+      node->next = root;
+      root = node;
+      continue;
+    }
+
+    tile_archive *archive = open_tile_archive(node->file);
+    if (archive == NULL)
+      fprintf(stderr, "WARNING: Could not list contents of '%s'\n", node->file);
+
+    for (size_t i = 0; archive && i < archive->count; i++) {
+      const archive_entry *entry = &archive->entries[i];
+      if (!has_extension(entry->name, ".tif"))
+        continue;
+      List *tile = calloc(1, sizeof(List));
+      char *file = calloc(1024, sizeof(char));
+      char *base = strdup(entry->name);
+      if (tile == NULL || file == NULL || base == NULL ||
+          tile_archive_subfile(archive, entry->offset, entry->size, file, 1024)) {
+        fprintf(stderr, "ERROR: Failed to add '%s' of '%s' to file list\n", entry->name, node->file);
+        free(tile);
+        free(file);
+        free(base);
+        continue;
+      }
+      *strrchr(base, '.') = '\0';
+      tile->file = file;
+      tile->base = base;
+      tile->next = root;
+      root = tile;
+    }
+
+    destroy_tile_archive(archive);
+    node->next = NULL;
+    delete_list(node);
+  }
+
+  return root;
+}
+
 void delete_list(List *root)
 {
   List *tmp = root;
@@ -114,297 +250,1503 @@ int check_dir(const char *directory)
   return 0;
 }
 
-// TODO factor GDAL reading/writing out to function?
-void tile_files(List *files, const options *option)
+// properties of a source raster, checked once before any of its tiles are written
+typedef struct
 {
-  int written_chars;
-  GDALAllRegister();
+  const char *file;
+  const char *base;
+  int nbands;
+  int columns;
+  int rows;
+  // full resolution size, larger than columns x rows when tiling at a reduced scale
+  int source_columns;
+  int source_rows;
+  int x_tiles;
+  int y_tiles;
+  // with an area of interest, columns and rows only describe the window of the tiles intersecting it; x_offset and
+  // y_offset place the window in the raster, whose geo_transform stays as is, and x_first and y_first its first tile
+  int x_offset;
+  int y_offset;
+  int x_first;
+  int y_first;
+  // part of the window covered by the raster, in window pixels; all of it unless the window follows the global tile
+  // grid past the raster's edges
+  int x_begin;
+  int x_end;
+  int y_begin;
+  int y_end;
+  int unchanged;
+  GDALDataType dtype;
+  double geo_transform[6];
+} raster_info;
 
-  while (files) {
-    int x_chunk = 0;
-    int y_chunk = 0;
-    if (strstr(files->file, ".jp2") == NULL && strstr(files->file, ".ecw") == NULL) {
-      files = files->next;
-      continue;
-    }
-    if (option->verbose)
-      printf("Processing %s\n", files->file);
+// tiles written so far, reported by tile_files once all rasters are done
+typedef struct
+{
+  size_t tiles;
+  size_t skipped;
+  size_t input_bytes;
+  size_t output_bytes;
+  pthread_mutex_t lock;
+} tile_stats;
 
-    GDALDatasetH raster_file = GDALOpen(files->file, GA_ReadOnly);
-    if (raster_file == NULL) {
-      fprintf(stderr, "ERROR: Failed to open file '%s'\n", files->file);
-      files = files->next;
-      continue;
+// one horizontal strip of a source raster, shared read-only by all threads writing its tiles
+typedef struct
+{
+  const options *option;
+  const raster_info *raster;
+  const char *projection_ref;
+  char **creation_options;
+  tile_stats *stats;
+  vrt_index *index;
+  output_manifest *manifest;
+  tile_archive *archive;
+  uint8_t *data;
+  int y;
+  int y_chunk;
+  int y_rows;
+  int level;
+  tile_callback on_tile;
+  void *user;
+  pthread_mutex_t lock;
+  int next_chunk;
+  int status;
+} strip;
+
+// tiles of 'tile' pixels along an axis of 'size' pixels, each starting 'tile - overlap' pixels after the previous one;
+// the last one may reach past the edge
+static int tile_count(int size, int tile, int overlap)
+{
+  int step = tile - overlap;
+  return size <= tile ? 1 : (size - overlap + step - 1) / step;
+}
+
+// whether the tiles end exactly at the edge of the axis
+static int fits_tiles(int size, int tile, int overlap)
+{
+  return size >= tile && (size - overlap) % (tile - overlap) == 0;
+}
+
+// northing in EPSG:25833 the global tile grid counts its rows from, north of any UTM zone's northern hemisphere
+#define GRID_NORTH 10000000.0
+
+// the 'first' of the tiles of the global grid along an axis and their number that cover pixels 'low' to 'high' of the
+// 'size' pixels from 'origin' on, rounded out to multiples of 'align' tiles; no tiles if the pixels lie outside or only
+// touch them. Pixels count from the grid's origin and are never negative.
+static int clip_axis(double low, double high, int origin, int size, int tile, int overlap, int align, int *first)
+{
+  if (high <= origin || low >= origin + size)
+    return 0;
+
+  int begin = low <= origin ? origin : (int) low;
+  int end = high >= origin + size ? origin + size : (int) high + ((int) high < high);
+  if (end <= begin)
+    end = begin + 1;
+
+  // tile k covers pixels k * step up to k * step + tile
+  int step = tile - overlap;
+  int first_tile = begin < tile ? 0 : (begin - tile) / step + 1;
+  int end_tile = (end - 1) / step + 1;
+
+  first_tile -= first_tile % align;
+  end_tile = (end_tile + align - 1) / align * align;
+  *first = first_tile;
+
+  return end_tile - first_tile;
+}
+
+// narrows 'info' to the tiles intersecting option->bbox. Their grid starts at easting 0 and northing GRID_NORTH rather
+// than at the raster's corner, so neighbouring rasters write tiles of the same footprint, named by their place in that
+// grid; the part of a tile past the raster's edges is padded with option->fill. Overviews need their tiles whole, thus
+// the window starts and ends on multiples of 2^pyramid tiles.
+static void clip_raster(raster_info *info, const options *option)
+{
+  const double *bbox = option->bbox;
+  const double *geo_transform = info->geo_transform;
+  int align = 1 << option->pyramid;
+  // the raster's upper left pixel in the global grid
+  int x_origin = (int) (geo_transform[0] / geo_transform[1] + 0.5);
+  int y_origin = (int) ((geo_transform[3] - GRID_NORTH) / geo_transform[5] + 0.5);
+
+  info->x_tiles = clip_axis(bbox[0] / geo_transform[1], bbox[2] / geo_transform[1], x_origin, info->columns,
+                            option->csize, option->overlap, align, &info->x_first);
+  info->y_tiles = clip_axis((bbox[3] - GRID_NORTH) / geo_transform[5], (bbox[1] - GRID_NORTH) / geo_transform[5],
+                            y_origin, info->rows, option->rsize, option->overlap, align, &info->y_first);
+  if (info->x_tiles <= 0 || info->y_tiles <= 0) {
+    info->x_tiles = info->y_tiles = 0;
+    return;
+  }
+
+  // the window may start before the raster and end after it
+  info->x_offset = info->x_first * (option->csize - option->overlap) - x_origin;
+  info->y_offset = info->y_first * (option->rsize - option->overlap) - y_origin;
+  int columns = (info->x_tiles - 1) * (option->csize - option->overlap) + option->csize;
+  int rows = (info->y_tiles - 1) * (option->rsize - option->overlap) + option->rsize;
+  info->x_begin = info->x_offset < 0 ? -info->x_offset : 0;
+  info->y_begin = info->y_offset < 0 ? -info->y_offset : 0;
+  info->x_end = info->columns - info->x_offset < columns ? info->columns - info->x_offset : columns;
+  info->y_end = info->rows - info->y_offset < rows ? info->rows - info->y_offset : rows;
+  info->columns = columns;
+  info->rows = rows;
+}
+
+// opens 'file' and checks that it can be tiled with the requested tile size; NULL on error
+static GDALDatasetH open_raster(const char *file, const char *base, const options *option, raster_info *info)
+{
+  if (option->verbose)
+    printf("Processing %s\n", file);
+
+  GDALDatasetH raster_file = GDALOpen(file, GA_ReadOnly);
+  if (raster_file == NULL) {
+    fprintf(stderr, "ERROR: Failed to open file '%s'\n", file);
+    return NULL;
+  }
+
+  info->file = file;
+  info->base = base;
+  info->nbands = GDALGetRasterCount(raster_file);
+  info->source_columns = GDALGetRasterXSize(raster_file);
+  info->source_rows = GDALGetRasterYSize(raster_file);
+  info->columns = (info->source_columns + option->scale - 1) / option->scale;
+  info->rows = (info->source_rows + option->scale - 1) / option->scale;
+  info->dtype = GDT_Byte;
+  info->x_offset = info->y_offset = info->x_first = info->y_first = 0;
+  info->x_begin = info->y_begin = 0;
+  info->x_end = info->columns;
+  info->y_end = info->rows;
+
+  info->x_tiles = tile_count(info->columns, option->csize, option->overlap);
+  info->y_tiles = tile_count(info->rows, option->rsize, option->overlap);
+
+  // clipped to an area of interest, the tiles follow the global grid and are padded at any raster's edges
+  if (option->edge == EDGE_ERROR && !option->has_bbox && !fits_tiles(info->columns, option->csize, option->overlap)) {
+    fprintf(stderr, "ERROR: Columns are not evenly divisible by %d.\n", option->csize);
+    GDALClose(raster_file);
+    return NULL;
+  }
+  if (option->edge == EDGE_ERROR && !option->has_bbox && !fits_tiles(info->rows, option->rsize, option->overlap)) {
+    fprintf(stderr, "ERROR: Rows are not evenly divisible by %d.\n", option->rsize);
+    GDALClose(raster_file);
+    return NULL;
+  }
+
+  if (GDALGetGeoTransform(raster_file, info->geo_transform) != CE_None) {
+    fprintf(stderr, "ERROR: Could not read geo transform\n");
+    GDALClose(raster_file);
+    return NULL;
+  }
+  // reduced pixels cover exactly the extent of the full resolution ones
+  info->geo_transform[1] *= (double) info->source_columns / info->columns;
+  info->geo_transform[5] *= (double) info->source_rows / info->rows;
+
+  for (int band = 1; band <= info->nbands; band++) {
+    info->dtype = GDALGetRasterDataType(GDALGetRasterBand(raster_file, band));
+    if (info->dtype != GDT_Byte) {
+      fprintf(stderr, "ERROR: Unexpected data type: %s\n", GDALGetDataTypeName(info->dtype));
+      GDALClose(raster_file);
+      return NULL;
     }
+  }
 
-    int nbands = GDALGetRasterCount(raster_file);
-    int columns = GDALGetRasterXSize(raster_file);
-    int rows = GDALGetRasterYSize(raster_file);
-    double geo_transform[6];
+  if (option->has_bbox)
+    clip_raster(info, option);
 
-    if (columns % option->csize != 0) {
-      fprintf(stderr, "ERROR: Columns are not evenly divisible by %d.\n", option->csize);
-      // TODO proper cleanup
-      exit(69);
+  return raster_file;
+}
+
+// since original data does not include projection reference, need to create our own. Hard-coded EPSG:25833
+static char *projection_wkt(void)
+{
+  OGRSpatialReferenceH spat_ref = OSRNewSpatialReference(NULL);
+  OSRImportFromEPSGA(spat_ref, 25833);
+  char *projection_ref = NULL;
+  OSRExportToWkt(spat_ref, &projection_ref);
+  OSRDestroySpatialReference(spat_ref);
+
+  return projection_ref;
+}
+
+// GTiff creation options from -z/-P/-l/-B/-N; explicit --co KEY=VALUE pairs are applied last and win
+static char **tile_creation_options(const options *option)
+{
+  char **creation_options = NULL;
+  char value[32];
+
+  if (option->compress) {
+    creation_options = CSLSetNameValue(creation_options, "COMPRESS", option->compress);
+    if (strcmp(option->compress, "NONE") != 0) {
+      snprintf(value, sizeof(value), "%d", option->predictor ? option->predictor : 2);
+      creation_options = CSLSetNameValue(creation_options, "PREDICTOR", value);
     }
-    if (rows % option->rsize != 0) {
-      fprintf(stderr, "ERROR: Rows are not evenly divisible by %d.\n", option->rsize);
-      // TODO proper cleanup
-      exit(69);
+    if (option->level) {
+      snprintf(value, sizeof(value), "%d", option->level);
+      creation_options = CSLSetNameValue(creation_options,
+                                         strcmp(option->compress, "ZSTD") == 0 ? "ZSTD_LEVEL" : "ZLEVEL", value);
     }
+  }
 
-    if (GDALGetGeoTransform(raster_file, geo_transform) != CE_None) {
-      fprintf(stderr, "ERROR: Could not read geo transform\n");
-      // TODO proper cleanup
-      exit(69);
-    }
+  if (option->blocksize) {
+    snprintf(value, sizeof(value), "%d", option->blocksize);
+    creation_options = CSLSetNameValue(creation_options, "TILED", "YES");
+    creation_options = CSLSetNameValue(creation_options, "BLOCKXSIZE", value);
+    creation_options = CSLSetNameValue(creation_options, "BLOCKYSIZE", value);
+  }
 
-    uint8_t **data = malloc(sizeof(uint8_t *) * nbands);
-    for (int i = 0; i < nbands; i++)
-      data[i] = CPLMalloc(columns * rows * sizeof(uint8_t));
-
-    GDALRasterBandH hband;
-    GDALDataType dtype;
-    for (int band = 1; band <= nbands; band++) {
-      hband = GDALGetRasterBand(raster_file, band);
-      dtype = GDALGetRasterDataType(hband);
-      if (dtype != GDT_Byte) {
-        fprintf(stderr, "ERROR: Unexpected data type: %s\n", GDALGetDataTypeName(dtype));
-        // TODO proper cleanup
-        exit(69);
-      }
-      CPLErr IOErr = GDALRasterIO(hband, GF_Read, 0, 0, columns, rows, data[band - 1], columns, rows,
-                                  dtype, 0, 0);
-      if (IOErr != CE_None) {
-        fprintf(stderr, "ERROR: Encountered I/O error\n");
-        // TODO proper cleanup
-        exit(69);
-      }
+  if (option->compress_threads > 1) {
+    snprintf(value, sizeof(value), "%d", option->compress_threads);
+    creation_options = CSLSetNameValue(creation_options, "NUM_THREADS", value);
+  }
+
+  for (size_t i = 0; i < option->creation_option_count; i++) {
+    char *pair = option->creation_options[i];
+    char *equals = strchr(pair, '=');
+    *equals = '\0';
+    creation_options = CSLSetNameValue(creation_options, pair, equals + 1);
+    *equals = '=';
+  }
+
+  return creation_options;
+}
+
+// first row of the strip with index 'y_chunk', which holds up to rsize rows
+static int strip_start(int y_chunk, const options *option)
+{
+  return y_chunk * (option->rsize - option->overlap);
+}
+
+// only one strip of rsize rows is held at a time, i.e. columns * rsize * nbands bytes, pixel-interleaved
+static uint8_t *allocate_strip(const raster_info *raster, const options *option)
+{
+  uint8_t *data = VSIMalloc3(raster->columns, option->rsize, raster->nbands);
+  if (data == NULL)
+    fprintf(stderr, "ERROR: Failed to allocate memory for raster bands\n");
+
+  return data;
+}
+
+// full resolution pixel at which the reduced 'pixel' starts, along an axis of 'source_size' pixels
+static int source_pixel(int pixel, int source_size, int scale)
+{
+  int size = (source_size + scale - 1) / scale;
+  return (int) ((long long) pixel * source_size / size);
+}
+
+// all bands in one request, so the decoder handles each block once; lands interleaved like GTiff stores it. At a
+// reduced scale the full resolution window is read into a smaller buffer, which GDAL serves from the codec's
+// resolution levels or overviews. Only the columns of the raster's window are read; where the window reaches past
+// the raster, the strip is filled with option->fill.
+static int read_strip(GDALDatasetH raster_file, strip *s)
+{
+  const raster_info *raster = s->raster;
+  int nbands = raster->nbands;
+  int scale = s->option->scale;
+
+  s->y_rows = raster->rows - s->y < s->option->rsize ? raster->rows - s->y : s->option->rsize;
+  int first_row = raster->y_begin > s->y ? raster->y_begin - s->y : 0;
+  int rows = (raster->y_end - s->y < s->y_rows ? raster->y_end - s->y : s->y_rows) - first_row;
+  int columns = raster->x_end - raster->x_begin;
+  if (rows < s->y_rows || columns < raster->columns)
+    memset(s->data, s->option->fill < 0 ? 0 : s->option->fill, (size_t) s->y_rows * raster->columns * nbands);
+  if (rows <= 0)
+    return 0;
+
+  int y = raster->y_offset + s->y + first_row;
+  int x = raster->x_offset + raster->x_begin;
+  int source_y = source_pixel(y, raster->source_rows, scale);
+  int source_rows = source_pixel(y + rows, raster->source_rows, scale) - source_y;
+  int source_x = source_pixel(x, raster->source_columns, scale);
+  int source_columns = source_pixel(x + columns, raster->source_columns, scale) - source_x;
+
+  CPLErr IOErr = GDALDatasetRasterIO(raster_file, GF_Read, source_x, source_y, source_columns, source_rows,
+                                     &s->data[((size_t) first_row * raster->columns + raster->x_begin) * nbands],
+                                     columns, rows, raster->dtype, nbands, NULL, nbands,
+                                     raster->columns * nbands, 1);
+  if (IOErr != CE_None) {
+    fprintf(stderr, "ERROR: Encountered I/O error\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+// copies the part of the strip covered by a padded edge tile into a full size tile buffer filled with option->fill
+static uint8_t *pad_tile(const strip *s, int x, int width)
+{
+  const options *option = s->option;
+  int nbands = s->raster->nbands;
+  uint8_t *padded = VSIMalloc3(option->csize, option->rsize, nbands);
+  if (padded == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate memory for edge tile\n");
+    return NULL;
+  }
+
+  memset(padded, option->fill < 0 ? 0 : option->fill, (size_t) option->csize * option->rsize * nbands);
+  for (int row = 0; row < s->y_rows; row++)
+    memcpy(&padded[(size_t) row * option->csize * nbands],
+           &s->data[((size_t) row * s->raster->columns + x) * nbands], (size_t) width * nbands);
+
+  return padded;
+}
+
+// part of the tile at window pixel 'x', 'y' covered by the raster: 'width' x 'height' pixels, 'x_lead' and 'y_lead'
+// pixels into the tile; none for a tile of the global grid only there to complete an overview
+static void tile_cover(const raster_info *raster, const options *option, int x, int y, int *x_lead, int *y_lead,
+                       int *width, int *height)
+{
+  *x_lead = raster->x_begin > x ? raster->x_begin - x : 0;
+  *y_lead = raster->y_begin > y ? raster->y_begin - y : 0;
+  *width = (raster->x_end - x < option->csize ? raster->x_end - x : option->csize) - *x_lead;
+  *height = (raster->y_end - y < option->rsize ? raster->y_end - y : option->rsize) - *y_lead;
+}
+
+// '<outdir>/<prefix><base>[-L<level>]-X<x>_Y<y>.tif'; overview levels get the extra '-L<level>' component
+static int tile_path(char *outpath, const options *option, const char *base, int level, int x_chunk, int y_chunk)
+{
+  char level_name[8] = "";
+  if (level)
+    snprintf(level_name, sizeof(level_name), "-L%.2d", level);
+
+  int written_chars = snprintf(outpath, 1024, "%s%s%s-%s%s-X%.4d_Y%.4d.tif",
+                               option->outdir,
+                               option->outdir[strlen(option->outdir) - 1] == '/' ? "" : "/",
+                               option->prefix,
+                               base,
+                               level_name,
+                               x_chunk, y_chunk);
+  if (written_chars >= 1024) {
+    fprintf(stderr, "ERROR: Output file path to long.\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+// splits a tile name like '<prefix>-<name>[-L<level>]-X<column>_Y<row>[.ext]' into the part naming its source and
+// its position, the key of the tile in an archive; 1 if the name does not end in a grid position
+static int tile_key(const char *name, char *source, size_t size, int *level, int *x, int *y)
+{
+  const char *grid = NULL;
+  for (const char *at = strstr(name, "-X"); at; at = strstr(at + 1, "-X"))
+    grid = at;
+  if (grid == NULL || sscanf(grid, "-X%d_Y%d", x, y) != 2)
+    return 1;
+
+  const char *end = grid;
+  const char *digits = grid;
+  while (digits > name && isdigit((unsigned char) digits[-1]))
+    digits--;
+  *level = 0;
+  if (digits < grid && digits - name >= 2 && digits[-2] == '-' && digits[-1] == 'L') {
+    *level = atoi(digits);
+    end = digits - 2;
+  }
+  snprintf(source, size, "%.*s", (int) (end - name), name);
+
+  return 0;
+}
+
+// hands a tile GDAL wrote to '/vsimem/<name>' over to the archive; 'outpath' becomes the path reading it in place
+static int archive_tile(strip *s, const char *memory_path, const char *name, int x_chunk, int y_chunk, char *outpath,
+                        size_t *tile_size)
+{
+  char source[1024];
+  int level, x, y;
+  vsi_l_offset length = 0;
+  uint64_t offset;
+
+  // keyed like ab-convert keys the PNGs made from it
+  if (tile_key(name, source, sizeof(source), &level, &x, &y))
+    snprintf(source, sizeof(source), "%s", s->raster->base);
+
+  uint8_t *bytes = VSIGetMemFileBuffer(memory_path, &length, TRUE);
+  if (bytes == NULL) {
+    fprintf(stderr, "ERROR: Could not get '%s' from memory\n", name);
+    return 1;
+  }
+  int status = tile_archive_append(s->archive, name, source, s->level, x_chunk, y_chunk, bytes, length, &offset) ||
+               tile_archive_subfile(s->archive, offset, length, outpath, 1024);
+  VSIFree(bytes);
+  *tile_size = length;
+
+  return status;
+}
+
+static int write_tile(strip *s, int x_chunk)
+{
+  const options *option = s->option;
+  const raster_info *raster = s->raster;
+  int x = x_chunk * (option->csize - option->overlap);
+  // part of the tile inside the raster; edge tiles are smaller unless they are padded. Clipped windows hold whole
+  // tiles of the global grid, which the strip already pads wherever they reach past the raster.
+  int x_lead, y_lead, width, height;
+  tile_cover(raster, option, x, s->y, &x_lead, &y_lead, &width, &height);
+  if (width <= 0 || height <= 0)
+    return 0;
+  int global = option->has_bbox;
+  int padded = (option->edge == EDGE_PAD || global) && (width < option->csize || height < option->rsize);
+  int tile_columns = option->edge == EDGE_TRUNCATE && !global ? width : option->csize;
+  int tile_rows = option->edge == EDGE_TRUNCATE && !global ? height : option->rsize;
+  // position in the tile grid of the whole raster, or the global one
+  int grid_x = raster->x_first + x_chunk;
+  int grid_y = raster->y_first + s->y_chunk;
+  char outpath[1024];
+
+  if (option->skip_empty &&
+      is_uniform_window(&s->data[((size_t) y_lead * raster->columns + x + x_lead) * raster->nbands],
+                        (size_t) raster->columns * raster->nbands, width, height, raster->nbands,
+                        option->empty_threshold)) {
+    if (s->stats) {
+      pthread_mutex_lock(&s->stats->lock);
+      s->stats->skipped++;
+      pthread_mutex_unlock(&s->stats->lock);
     }
+    return 0;
+  }
 
-    char *outpath = malloc(1024 * sizeof(char));  // TODO check return value
-    char **creation_options = NULL;
-
-    // since original data does not include projection reference, need to create our own. Hard-coded EPSG:25833
-    OGRSpatialReferenceH spat_ref = OSRNewSpatialReference(NULL);
-    OSRImportFromEPSGA(spat_ref, 25833);
-    char *projection_ref = NULL;
-    OSRExportToWkt(spat_ref, &projection_ref);
-    OSRDestroySpatialReference(spat_ref);
-    for (int x = 0; x < columns; x += option->csize) {
-      memset(outpath, 0, 1024);
-      y_chunk = 0;
-      for (int y = 0; y < rows; y += option->rsize) {
-        written_chars = snprintf(outpath, 1024, "%s%s%s-%s-X%.4d_Y%.4d.tif",
-                                 option->outdir,
-                                 option->outdir[strlen(option->outdir) - 1] == '/' ? "" : "/",
-                                 option->prefix,
-                                 files->base,
-                                 x_chunk, y_chunk);
-        if (written_chars >= 1024) {
-          fprintf(stderr, "ERROR: Output file path to long.\n");
-          // TODO proper cleanup
-          exit(69);
-        }
-
-        GDALDatasetH out_dataset = GDALCreate(GDALGetDriverByName("GTiff"), outpath, option->csize,
-                                              option->rsize, nbands, dtype, creation_options);
-
-        GDALSetGeoTransform(out_dataset,
-                            geo_transform); // TODO simply copying this value is wrong as it holds coordinates from top pixels
-        GDALSetProjection(out_dataset, projection_ref);
-
-        GDALRasterBandH *out_bands = malloc(sizeof(GDALRasterBandH *) * nbands); // TODO check return value
-        for (int i = 1; i <= nbands; i++) {
-          out_bands[i - 1] = GDALGetRasterBand(out_dataset, i);
-          CPLErr write_error =
-            GDALRasterIO(out_bands[i - 1], GF_Write, 0, 0, option->csize, option->rsize,
-                         &data[i - 1][x + y * columns],
-                         option->csize, option->rsize, dtype, 0, columns);
-          if (write_error != CE_None) {
-            fprintf(stderr, "ERROR: Could not write raster band\n");
-            // TODO proper cleanup
-            exit(69);
-          }
-        }
-
-        GDALClose(out_dataset);
-        free(out_bands);
-        geo_transform[3] += option->rsize * geo_transform[5]; // north-up image is assumed
-        y_chunk++;
-      }
-      geo_transform[0] += option->csize * geo_transform[1]; // north-up image is assumed
-      geo_transform[3] -= ((double) columns / option->rsize) * (option->rsize * geo_transform[5]);
-      x_chunk++;
+  if (tile_path(outpath, option, raster->base, s->level, grid_x, grid_y))
+    return 1;
+
+  // tiles going into an archive are only ever written to memory
+  const char *name = strrchr(outpath, '/') + 1;
+  char memory_path[1024 + 8];
+  snprintf(memory_path, sizeof(memory_path), "/vsimem/%s", name);
+  const char *target = s->archive ? memory_path : outpath;
+
+  uint8_t *pixels = &s->data[(size_t) x * raster->nbands];
+  size_t line_spacing = (size_t) raster->columns * raster->nbands;
+  uint8_t *padded_pixels = NULL;
+  if (padded && !global) {
+    padded_pixels = pad_tile(s, x, width);
+    if (padded_pixels == NULL)
+      return 1;
+    pixels = padded_pixels;
+    line_spacing = (size_t) option->csize * raster->nbands;
+  }
+
+  GDALDatasetH out_dataset = GDALCreate(GDALGetDriverByName("GTiff"), target, tile_columns,
+                                        tile_rows, raster->nbands, raster->dtype, s->creation_options);
+  if (out_dataset == NULL) {
+    fprintf(stderr, "ERROR: Could not create '%s'\n", outpath);
+    VSIFree(padded_pixels);
+    return 1;
+  }
+
+  // origin of the tile's upper left pixel; north-up image is assumed
+  double tile_transform[6];
+  memcpy(tile_transform, raster->geo_transform, sizeof(tile_transform));
+  tile_transform[0] += (raster->x_offset + x) * raster->geo_transform[1];
+  tile_transform[3] += (raster->y_offset + s->y) * raster->geo_transform[5];
+  GDALSetGeoTransform(out_dataset, tile_transform);
+  GDALSetProjection(out_dataset, s->projection_ref);
+
+  // an explicit fill value marks the padding, so that it can be told apart from image content
+  for (int band = 1; padded && option->fill >= 0 && band <= raster->nbands; band++)
+    GDALSetRasterNoDataValue(GDALGetRasterBand(out_dataset, band), option->fill);
+
+  CPLErr write_error =
+    GDALDatasetRasterIO(out_dataset, GF_Write, 0, 0, tile_columns, tile_rows, pixels, tile_columns, tile_rows,
+                        raster->dtype, raster->nbands, NULL, raster->nbands, line_spacing, 1);
+  VSIFree(padded_pixels);
+  if (write_error != CE_None) {
+    fprintf(stderr, "ERROR: Could not write raster band\n");
+    GDALClose(out_dataset);
+    return 1;
+  }
+
+  GDALClose(out_dataset);
+
+  size_t tile_size = 0;
+  if (s->archive && archive_tile(s, memory_path, name, grid_x, grid_y, outpath, &tile_size))
+    return 1;
+
+  if (s->manifest && output_manifest_add(s->manifest, raster->file, outpath))
+    return 1;
+
+  // overviews have a different resolution and are left out of the mosaic
+  if (s->index && s->level == 0 &&
+      vrt_index_add(s->index, outpath, tile_transform, x_lead, y_lead, width, height, tile_columns, tile_rows,
+                    raster->nbands))
+    return 1;
+
+  if (s->stats) {
+    struct stat tile_stat;
+    if (s->archive == NULL)
+      tile_size = stat(outpath, &tile_stat) == 0 ? (size_t) tile_stat.st_size : 0;
+    pthread_mutex_lock(&s->stats->lock);
+    s->stats->tiles++;
+    s->stats->input_bytes += (size_t) width * height * raster->nbands;
+    s->stats->output_bytes += tile_size;
+    pthread_mutex_unlock(&s->stats->lock);
+  }
+
+  if (s->on_tile)
+    s->on_tile(outpath, s->user);
+
+  return 0;
+}
+
+// takes tiles of the strip until none are left or one of the threads failed
+static void *tile_worker(void *arg)
+{
+  strip *s = (strip *) arg;
+  int chunks = s->raster->x_tiles;
+
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    int x_chunk = s->status == 0 && s->next_chunk < chunks ? s->next_chunk++ : -1;
+    pthread_mutex_unlock(&s->lock);
+    if (x_chunk < 0)
+      break;
+
+    if (write_tile(s, x_chunk)) {
+      pthread_mutex_lock(&s->lock);
+      s->status = 1;
+      pthread_mutex_unlock(&s->lock);
     }
-    CPLFree(projection_ref);
-    for (int i = 0; i < nbands; i++)
-      CPLFree(*(data + i));
-    free(data);
+  }
+
+  return NULL;
+}
+
+// writes all tiles of the strip held in s->data, using up to option->threads threads
+static int write_strip(strip *s)
+{
+  int chunks = s->raster->x_tiles;
+  int threads = s->option->threads < chunks ? s->option->threads : chunks;
+
+  s->next_chunk = 0;
+  s->status = 0;
+
+  if (threads <= 1) {
+    tile_worker(s);
+    return s->status;
+  }
+
+  pthread_t *workers = calloc(threads, sizeof(pthread_t));
+  if (workers == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate worker threads.\n");
+    return 1;
+  }
+
+  int started = 0;
+  for (; started < threads; started++)
+    if (pthread_create(&workers[started], NULL, tile_worker, s) != 0)
+      break;
+  // whatever could not be started is picked up by the remaining threads, or this one
+  if (started == 0)
+    tile_worker(s);
+  for (int i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+  free(workers);
+
+  return s->status;
+}
+
+int tile_file(const char *file, const char *base, const options *option, tile_callback on_tile, void *user)
+{
+  raster_info raster;
+  int status = 0;
+
+  GDALDatasetH raster_file = open_raster(file, base, option, &raster);
+  if (raster_file == NULL)
+    return 1;
+
+  strip tiles = {
+    .option = option,
+    .raster = &raster,
+    .on_tile = on_tile,
+    .user = user,
+  };
+
+  tiles.data = allocate_strip(&raster, option);
+  if (tiles.data == NULL) {
     GDALClose(raster_file);
-    free(outpath);
+    return 1;
+  }
+  pthread_mutex_init(&tiles.lock, NULL);
 
-    files = files->next;
+  char *projection_ref = projection_wkt();
+  tiles.projection_ref = projection_ref;
+  tiles.creation_options = tile_creation_options(option);
+
+  for (int y_chunk = 0; y_chunk < raster.y_tiles && status == 0; y_chunk++) {
+    tiles.y = strip_start(y_chunk, option);
+    tiles.y_chunk = y_chunk;
+    status = read_strip(raster_file, &tiles) || write_strip(&tiles);
   }
+  CSLDestroy(tiles.creation_options);
+  CPLFree(projection_ref);
+  pthread_mutex_destroy(&tiles.lock);
+  VSIFree(tiles.data);
+  GDALClose(raster_file);
+
+  return status;
 }
 
-// three band tiffs of type GDAL_BYTE are interpreted as RGB
-void convert_files(List *files, const options *option)
+// first overview of a raster, filled in by whichever workers tile its strips. The worker finishing the last strip
+// writes the overview levels from it, so only level 0 is ever decoded from the source raster.
+typedef struct
 {
-  GDALAllRegister();
-  int written;
-  const int bytes_per_pixel = option->bands_count;
+  uint8_t *level;
+  raster_info info;
+  pthread_mutex_t lock;
+  int strips_left;
+} pyramid;
 
-  while (files) {
-    if (strstr(files->file, ".tif") == NULL) {
-      files = files->next;
-      continue;
-    }
+// a raster's pixels in the scratch cache: mapped if an earlier run decoded them, otherwise stored strip by strip
+typedef struct
+{
+  cached_raster cached;
+  cache_writer *writer;
+} scratch_entry;
 
-    if (option->verbose)
-      printf("Processing %s\n", files->file);
+// one strip of one raster, the unit of work handed out by tile_files' scheduler
+typedef struct
+{
+  const raster_info *raster;
+  pyramid *levels;
+  scratch_entry *scratch;
+  int y;
+  int y_chunk;
+} row_block;
 
-    GDALDatasetH in_raster = GDALOpen(files->file, GA_ReadOnly);
-    if (in_raster == NULL) {
-      fprintf(stderr, "ERROR: Could not open file '%s'\n", files->file);
-      files = files->next;
-      continue;
-    }
+// raster a worker currently holds open, reused while it keeps getting row blocks of the same file
+typedef struct
+{
+  const raster_info *raster;
+  GDALDatasetH dataset;
+  uint8_t *data;
+} worker_raster;
 
-    unsigned long x = GDALGetRasterXSize(in_raster);
-    unsigned long y = GDALGetRasterYSize(in_raster);
+typedef struct
+{
+  const options *option;
+  const char *projection_ref;
+  char **creation_options;
+  tile_stats *stats;
+  vrt_index *index;
+  output_manifest *manifest;
+  tile_archive *archive;
+  worker_raster *workers;
+} tile_context;
 
-    uint8_t *data_p = malloc(sizeof(uint8_t) * option->bands_count * x * y);
-    if (data_p == NULL) {
-      fprintf(stderr, "ERROR: Could not allocate memory for datasets\n");
-      GDALClose(in_raster);
-      return;
-    }
+// geometry of the overview one level below 'raster'; pixels grow twice as large, the origin stays put
+static raster_info overview_info(const raster_info *raster)
+{
+  raster_info info = *raster;
 
-    uint8_t *data[option->bands_count];
-    for (int i = 0; i < option->bands_count; i++) {
-      data[i] = data_p + i * x * y;
-    }
+  info.columns = (raster->columns + 1) / 2;
+  info.rows = (raster->rows + 1) / 2;
+  info.geo_transform[1] *= 2;
+  info.geo_transform[5] *= 2;
+  // the window's corner becomes the origin, which stays exact when the window starts on an odd pixel of the raster
+  info.geo_transform[0] += raster->x_offset * raster->geo_transform[1];
+  info.geo_transform[3] += raster->y_offset * raster->geo_transform[5];
+  info.x_offset = info.y_offset = 0;
+  // windows start on multiples of 2^pyramid tiles
+  info.x_first /= 2;
+  info.y_first /= 2;
+  info.x_begin /= 2;
+  info.y_begin /= 2;
+  info.x_end = (raster->x_end + 1) / 2;
+  info.y_end = (raster->y_end + 1) / 2;
 
-    for (int i = 0; i < option->bands_count; i++) {
-      GDALRasterBandH hband = GDALGetRasterBand(in_raster, option->bands[i]);
+  return info;
+}
 
-      if (GDALGetRasterDataType(hband) != GDT_Byte) {
-        fprintf(stderr, "ERROR: Dataset is not of type GDT_Byte\n");
-        GDALClose(in_raster);
-        return;
-      }
+// averages 'rows' rows of 'columns' pixels into (rows + 1) / 2 rows of 'out'
+static void downsample_image(const uint8_t *data, int columns, int rows, int nbands, uint8_t *out)
+{
+  size_t stride = (size_t) columns * nbands;
+  size_t out_stride = (size_t) ((columns + 1) / 2) * nbands;
+
+  for (int row = 0; row < rows; row += 2)
+    downsample_rows(data + row * stride, data + (row + 1 < rows ? row + 1 : row) * stride, columns, nbands,
+                    out + (row / 2) * out_stride);
+}
+
+// writes the tiles of one whole image held in memory, strip by strip
+static int write_level(const raster_info *info, const uint8_t *data, int level, const options *option,
+                       const tile_context *ctx)
+{
+  int status = 0;
+  strip tiles = {
+    .option = option,
+    .raster = info,
+    .projection_ref = ctx->projection_ref,
+    .creation_options = ctx->creation_options,
+    .stats = ctx->stats,
+    .manifest = ctx->manifest,
+    .archive = ctx->archive,
+    .level = level,
+  };
+  pthread_mutex_init(&tiles.lock, NULL);
+
+  for (int y_chunk = 0; y_chunk < info->y_tiles && status == 0; y_chunk++) {
+    tiles.y_chunk = y_chunk;
+    tiles.y = strip_start(y_chunk, option);
+    tiles.y_rows = info->rows - tiles.y < option->rsize ? info->rows - tiles.y : option->rsize;
+    tiles.data = (uint8_t *) data + (size_t) tiles.y * info->columns * info->nbands;
+    status = write_strip(&tiles);
+  }
+  pthread_mutex_destroy(&tiles.lock);
 
-      CPLErr write_error =
-        GDALRasterIO(hband, GF_Read, 0, 0, x, y, data[i], x, y, GDT_Byte, 0, 0);
+  return status;
+}
+
+// adds the strip just tiled to the first overview; the call that completes it writes levels 1 to option->pyramid
+static int add_to_pyramid(pyramid *levels, const strip *s, const tile_context *ctx)
+{
+  const raster_info *raster = s->raster;
+
+  pthread_mutex_lock(&levels->lock);
+  if (levels->level == NULL) {
+    levels->info = overview_info(raster);
+    levels->level = VSIMalloc3(levels->info.columns, levels->info.rows, raster->nbands);
+  }
+  pthread_mutex_unlock(&levels->lock);
+  if (levels->level == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate memory for overviews of '%s'\n", raster->file);
+    return 1;
+  }
 
-      if (write_error != CE_None) {
-        fprintf(stderr, "ERROR: Failed to read raster data\n");
-        GDALClose(in_raster);
-        return;
+  // strips start on even rows, so each one fills its own rows of the overview
+  downsample_image(s->data, raster->columns, s->y_rows, raster->nbands,
+                   levels->level + (size_t) (s->y / 2) * levels->info.columns * raster->nbands);
+
+  pthread_mutex_lock(&levels->lock);
+  int complete = --levels->strips_left == 0;
+  pthread_mutex_unlock(&levels->lock);
+  if (!complete)
+    return 0;
+
+  // overview edges rarely fit the tile grid; when level 0 had to fit exactly, they are truncated instead
+  options level_option = *ctx->option;
+  if (level_option.edge == EDGE_ERROR)
+    level_option.edge = EDGE_TRUNCATE;
+
+  int status = 0;
+  raster_info info = levels->info;
+  uint8_t *data = levels->level;
+  levels->level = NULL;
+  for (int level = 1; level <= level_option.pyramid && status == 0; level++) {
+    info.x_tiles = tile_count(info.columns, level_option.csize, level_option.overlap);
+    info.y_tiles = tile_count(info.rows, level_option.rsize, level_option.overlap);
+    status = write_level(&info, data, level, &level_option, ctx);
+
+    if (status == 0 && level < level_option.pyramid) {
+      raster_info next = overview_info(&info);
+      uint8_t *next_data = VSIMalloc3(next.columns, next.rows, next.nbands);
+      if (next_data == NULL) {
+        fprintf(stderr, "ERROR: Failed to allocate memory for overviews of '%s'\n", raster->file);
+        status = 1;
+      } else {
+        downsample_image(data, info.columns, info.rows, info.nbands, next_data);
       }
+      VSIFree(data);
+      data = next_data;
+      info = next;
     }
+  }
+  VSIFree(data);
 
-    GDALClose(in_raster);
+  return status;
+}
 
-    char *outpath = calloc(1024, sizeof(char));
-    if (outpath == NULL) {
-      fprintf(stderr, "ERROR: Could not allocate memory for output file path\n");
-      free(data_p);
-      return;
+static void release_worker_raster(worker_raster *current)
+{
+  if (current->raster == NULL)
+    return;
+  VSIFree(current->data);
+  GDALClose(current->dataset);
+  *current = (worker_raster) {
+    0
+  };
+}
+
+static int tile_row_block(void *task, int worker, void *context)
+{
+  row_block *block = (row_block *) task;
+  tile_context *ctx = (tile_context *) context;
+  worker_raster *current = &ctx->workers[worker];
+  const uint8_t *cached = block->scratch ? block->scratch->cached.pixels : NULL;
+
+  // cached rasters are not decoded at all, their strips are slices of the mapping
+  if (cached == NULL && current->raster != block->raster) {
+    release_worker_raster(current);
+    current->dataset = GDALOpen(block->raster->file, GA_ReadOnly);
+    if (current->dataset == NULL) {
+      fprintf(stderr, "ERROR: Failed to open file '%s'\n", block->raster->file);
+      return 1;
+    }
+    current->data = allocate_strip(block->raster, ctx->option);
+    if (current->data == NULL) {
+      GDALClose(current->dataset);
+      return 1;
     }
+    current->raster = block->raster;
+  }
+
+  strip tiles = {
+    .option = ctx->option,
+    .raster = block->raster,
+    .projection_ref = ctx->projection_ref,
+    .creation_options = ctx->creation_options,
+    .stats = ctx->stats,
+    .index = ctx->index,
+    .manifest = ctx->manifest,
+    .archive = ctx->archive,
+    .data = current->data,
+    .y = block->y,
+    .y_chunk = block->y_chunk,
+  };
+  pthread_mutex_init(&tiles.lock, NULL);
+  int status = 0;
+  if (cached) {
+    const raster_info *raster = block->raster;
+    tiles.y_rows = raster->rows - tiles.y < ctx->option->rsize ? raster->rows - tiles.y : ctx->option->rsize;
+    tiles.data = (uint8_t *) cached + (size_t) tiles.y * raster->columns * raster->nbands;
+  } else {
+    status = read_strip(current->dataset, &tiles);
+    if (status == 0 && block->scratch && block->scratch->writer)
+      cache_writer_put(block->scratch->writer, tiles.y, tiles.data, tiles.y_rows);
+  }
+  status = status || write_strip(&tiles);
+  pthread_mutex_destroy(&tiles.lock);
 
-    written = snprintf(outpath, 1024, "%s%s%s.png",
-                       option->outdir,
-                       option->outdir[strlen(option->outdir) - 1] == '/' ? "" : "/",
-                       files->base);
+  if (status == 0 && block->levels)
+    status = add_to_pyramid(block->levels, &tiles, ctx);
 
-    if (written >= 1024) {
-      fprintf(stderr, "ERROR: Truncated output path\n");
-      free(data_p);
-      free(outpath);
-      return;
+  return status;
+}
+
+// geotransform of the part of the raster tiled, which tells the cache entries of different areas of interest apart
+static void window_transform(const raster_info *raster, double transform[6])
+{
+  memcpy(transform, raster->geo_transform, 6 * sizeof(double));
+  transform[0] += raster->x_offset * raster->geo_transform[1];
+  transform[3] += raster->y_offset * raster->geo_transform[5];
+}
+
+// maps the rasters decoded by earlier runs and starts cache entries for as many of the others as fit the limit,
+// evicting the least recently used entries to make room; returns the number of rasters found in the cache
+static size_t open_scratch(const raster_cache *cache, const raster_info *rasters, size_t n, scratch_entry *scratch)
+{
+  size_t hits = 0;
+  size_t pending = 0;
+  source_stamp *stamps = calloc(n, sizeof(source_stamp));
+  int *fill = calloc(n, sizeof(int));
+
+  for (size_t i = 0; stamps && fill && i < n; i++) {
+    const raster_info *raster = &rasters[i];
+    double window[6];
+    window_transform(raster, window);
+    if (raster->unchanged || stamp_source(raster->file, 0, &stamps[i]))
+      continue;
+    if (raster_cache_map(cache, raster->file, &stamps[i], raster->columns, raster->rows, raster->nbands, window,
+                         &scratch[i].cached) == 0) {
+      hits++;
+      continue;
+    }
+    size_t size = raster_cache_entry_size(raster->columns, raster->rows, raster->nbands);
+    if (pending + size <= cache->limit) {
+      fill[i] = 1;
+      pending += size;
     }
+  }
+
+  raster_cache_trim(cache, cache->limit - pending);
+  for (size_t i = 0; stamps && fill && i < n; i++) {
+    const raster_info *raster = &rasters[i];
+    double window[6];
+    window_transform(raster, window);
+    if (fill[i])
+      scratch[i].writer = raster_cache_begin(cache, raster->file, &stamps[i], raster->columns, raster->rows,
+                                             raster->nbands, window, raster->y_tiles);
+  }
+  free(stamps);
+  free(fill);
+
+  return hits;
+}
+
+// tiles of an unchanged raster are not written again, yet belong in the mosaic; skipped empty tiles do not exist
+static int index_existing_tiles(vrt_index *index, const raster_info *raster, const options *option)
+{
+  char outpath[1024];
+  struct stat tile_stat;
 
-    // note: outpath could be free immediately. To keep freeing of memory in one place, it's delayed until the end of the loop
-    FILE *outfile = fopen(outpath, "wb");
-    if (outfile == NULL) {
-      fprintf(stderr, "ERROR: Could not open output file %s\n", "test.png");
-      exit(1);
+  for (int y_chunk = 0; y_chunk < raster->y_tiles; y_chunk++) {
+    int y = strip_start(y_chunk, option);
+    for (int x_chunk = 0; x_chunk < raster->x_tiles; x_chunk++) {
+      int x = x_chunk * (option->csize - option->overlap);
+      int x_lead, y_lead, width, height;
+      tile_cover(raster, option, x, y, &x_lead, &y_lead, &width, &height);
+      if (width <= 0 || height <= 0)
+        continue;
+      if (tile_path(outpath, option, raster->base, 0, raster->x_first + x_chunk, raster->y_first + y_chunk))
+        return 1;
+      if (stat(outpath, &tile_stat) != 0)
+        continue;
+
+      double tile_transform[6];
+      memcpy(tile_transform, raster->geo_transform, sizeof(tile_transform));
+      tile_transform[0] += (raster->x_offset + x) * raster->geo_transform[1];
+      tile_transform[3] += (raster->y_offset + y) * raster->geo_transform[5];
+      int truncated = option->edge == EDGE_TRUNCATE && !option->has_bbox;
+      if (vrt_index_add(index, outpath, tile_transform, x_lead, y_lead, width, height,
+                        truncated ? width : option->csize, truncated ? height : option->rsize, raster->nbands))
+        return 1;
     }
+  }
 
-    png_structp write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!write_ptr) {
-      fprintf(stderr, "ERROR: Could not create writer\n");
-      fclose(outfile);
-      free(data_p);
-      free(outpath);
-      return;
+  return 0;
+}
+
+// everything besides the source deciding what tile_files writes; a source tiled with other settings is redone
+static void tile_parameters(const options *option, char **creation_options, char *parameters, size_t size)
+{
+  int written = snprintf(parameters, size, "rows=%d columns=%d prefix=%s edge=%d fill=%d overlap=%d pyramid=%d "
+                         "skip-empty=%d:%d scale=%d grid=%s bbox=%.3f,%.3f,%.3f,%.3f co=", option->rsize,
+                         option->csize, option->prefix ? option->prefix : "", option->edge, option->fill,
+                         option->overlap, option->pyramid, option->skip_empty, option->empty_threshold, option->scale,
+                         option->has_bbox ? "global" : "raster", option->has_bbox ? option->bbox[0] : 0.0,
+                         option->has_bbox ? option->bbox[1] : 0.0, option->has_bbox ? option->bbox[2] : 0.0,
+                         option->has_bbox ? option->bbox[3] : 0.0);
+  for (int i = 0; creation_options && creation_options[i] && written > 0 && (size_t) written < size; i++)
+    written += snprintf(parameters + written, size - written, "%s%s", i ? "," : "", creation_options[i]);
+}
+
+static int larger_raster_first(const void *a, const void *b)
+{
+  const raster_info *left = (const raster_info *) a;
+  const raster_info *right = (const raster_info *) b;
+  size_t left_size = (size_t) left->columns * left->rows * left->nbands;
+  size_t right_size = (size_t) right->columns * right->rows * right->nbands;
+
+  return (left_size < right_size) - (left_size > right_size);
+}
+
+static int is_raster(const List *node)
+{
+  return has_extension(node->file, ".jp2") || has_extension(node->file, ".ecw");
+}
+
+// rasters are split into strips and spread over option->jobs workers, biggest rasters first. A worker keeps
+// the strips of one raster together and steals strips from the others once it runs out.
+void tile_files(List *files, const options *option)
+{
+  GDALAllRegister();
+  // the block cache is shared by all workers, so it grows with their number
+  GDALSetCacheMax64((GIntBig) option->cache_size * option->jobs);
+
+  size_t count = 0;
+  for (List *node = files; node; node = node->next)
+    count += is_raster(node);
+  if (count == 0)
+    return;
+
+  raster_info *rasters = calloc(count, sizeof(raster_info));
+  if (rasters == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate memory for raster list\n");
+    exit(69);
+  }
+
+  // sources tiled before with the same settings are skipped, the old tiles of changed ones are removed first
+  char **creation_options = tile_creation_options(option);
+  char parameters[2048];
+  tile_parameters(option, creation_options, parameters, sizeof(parameters));
+  // an archive is written anew each time, so there is nothing to skip
+  output_manifest *manifest = option->archive ? NULL : load_output_manifest(option->outdir, ".ab-tile-manifest");
+  if (manifest == NULL && option->archive == NULL) {
+    fprintf(stderr, "ERROR: Failed to load output manifest in '%s'\n", option->outdir);
+    exit(69);
+  }
+
+  size_t n = 0;
+  size_t blocks_count = 0;
+  size_t unchanged = 0;
+  size_t outside = 0;
+  size_t unreadable = 0;
+  for (List *node = files; node; node = node->next) {
+    if (!is_raster(node))
+      continue;
+    // one broken raster does not keep the others from being tiled
+    GDALDatasetH raster_file = open_raster(node->file, node->base, option, &rasters[n]);
+    if (raster_file == NULL) {
+      fprintf(stderr, "ERROR: Skipping '%s'\n", node->file);
+      unreadable++;
+      continue;
+    }
+    GDALClose(raster_file);
+    // its tiles from earlier runs are left alone
+    if (rasters[n].x_tiles == 0) {
+      outside++;
+      continue;
     }
 
-    png_infop info_ptr = png_create_info_struct(write_ptr);
-    if (!info_ptr) {
-      fprintf(stderr, "ERROR: Could not create info container\n");
-      png_destroy_write_struct(&write_ptr, (png_infopp) NULL);
-      fclose(outfile);
-      free(data_p);
-      free(outpath);
-      return;
+    source_stamp stamp;
+    if (manifest && stamp_source(node->file, option->hash_sources, &stamp)) {
+      fprintf(stderr, "ERROR: Skipping '%s'\n", node->file);
+      unreadable++;
+      continue;
+    }
+    rasters[n].unchanged = manifest && !option->force &&
+                           output_manifest_unchanged(manifest, node->file, &stamp, parameters);
+    if (rasters[n].unchanged) {
+      unchanged++;
+    } else {
+      if (manifest && output_manifest_begin(manifest, node->file, &stamp, parameters)) {
+        free(rasters);
+        exit(69);
+      }
+      blocks_count += rasters[n].y_tiles;
     }
+    n++;
+  }
+  qsort(rasters, n, sizeof(raster_info), larger_raster_first);
 
-    // some sort of return point for libpng to return to if error occurs?
-    if (setjmp(png_jmpbuf(write_ptr))) {
-      fprintf(stderr, "ERROR: Could not set environemtn savepoint\n");
-      png_destroy_write_struct(&write_ptr, &info_ptr);
-      fclose(outfile);
-      free(data_p);
-      free(outpath);
-      return;
+  row_block *blocks = calloc(blocks_count ? blocks_count : 1, sizeof(row_block));
+  worker_raster *workers = calloc(option->jobs, sizeof(worker_raster));
+  pyramid *pyramids = option->pyramid ? calloc(n, sizeof(pyramid)) : NULL;
+  scheduler *pool = create_scheduler(option->jobs);
+  int status = blocks == NULL || workers == NULL || (option->pyramid && pyramids == NULL) || pool == NULL;
+  if (blocks == NULL || workers == NULL || (option->pyramid && pyramids == NULL))
+    fprintf(stderr, "ERROR: Failed to allocate memory for row blocks\n");
+
+  for (size_t i = 0; pyramids && i < n; i++) {
+    pthread_mutex_init(&pyramids[i].lock, NULL);
+    pyramids[i].strips_left = rasters[i].y_tiles;
+  }
+
+  raster_cache *cache = option->scratch && status == 0 ? create_raster_cache(option->scratch, option->scratch_limit)
+                        : NULL;
+  scratch_entry *scratch = cache ? calloc(n, sizeof(scratch_entry)) : NULL;
+  size_t cache_hits = 0;
+  if (option->scratch && scratch == NULL)
+    status = 1;
+  else if (scratch)
+    cache_hits = open_scratch(cache, rasters, n, scratch);
+
+  size_t k = 0;
+  for (size_t i = 0; i < n && status == 0; i++) {
+    if (rasters[i].unchanged)
+      continue;
+    int worker = scheduler_pick(pool, (size_t) rasters[i].columns * rasters[i].rows * rasters[i].nbands);
+    for (int y_chunk = 0; y_chunk < rasters[i].y_tiles && status == 0; y_chunk++, k++) {
+      blocks[k] = (row_block) {
+        .raster = &rasters[i], .levels = pyramids ? &pyramids[i] : NULL, .scratch = scratch ? &scratch[i] : NULL,
+        .y = strip_start(y_chunk, option), .y_chunk = y_chunk
+      };
+      status = scheduler_push(pool, worker, &blocks[k]);
     }
+  }
+
+  char *projection_ref = projection_wkt();
+  tile_stats stats = { 0 };
+  pthread_mutex_init(&stats.lock, NULL);
+  tile_context ctx = {
+    .option = option,
+    .projection_ref = projection_ref,
+    .creation_options = creation_options,
+    .stats = &stats,
+    .manifest = manifest,
+    .workers = workers,
+  };
+  if (option->archive && status == 0) {
+    ctx.archive = create_tile_archive(option->archive);
+    status = ctx.archive == NULL;
+  }
+  if (option->vrt && status == 0) {
+    ctx.index = create_vrt_index();
+    status = ctx.index == NULL;
+    for (size_t i = 0; i < n && status == 0; i++)
+      if (rasters[i].unchanged)
+        status = index_existing_tiles(ctx.index, &rasters[i], option);
+  }
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (status == 0)
+    status = scheduler_run(pool, tile_row_block, &ctx);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (int i = 0; workers && i < option->jobs; i++)
+    release_worker_raster(&workers[i]);
+  // overviews of rasters that failed part way are left unfinished
+  for (size_t i = 0; pyramids && i < n; i++) {
+    VSIFree(pyramids[i].level);
+    pthread_mutex_destroy(&pyramids[i].lock);
+  }
+  // so are cache entries
+  for (size_t i = 0; scratch && i < n; i++) {
+    cache_writer_close(scratch[i].writer);
+    raster_cache_unmap(&scratch[i].cached);
+  }
+  free(scratch);
+  destroy_raster_cache(cache);
 
-    png_init_io(write_ptr, outfile);
-    png_set_IHDR(write_ptr, info_ptr, y, x, 8, bytes_per_pixel == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  // a failed run leaves its sources incomplete, so that the next one starts them over
+  for (size_t i = 0; manifest && i < n && status == 0; i++)
+    output_manifest_complete(manifest, rasters[i].file);
+  if (manifest && save_output_manifest(manifest))
+    status = 1;
+  destroy_output_manifest(manifest);
 
-    // checks blindly copied from libpng/example.c
-    /* Guard against integer overflow */
-    if (x > PNG_SIZE_MAX / (y * bytes_per_pixel)) {
-      png_error(write_ptr, "Image_data buffer would be too large");
+  // the index goes last; an archive of a failed run is removed
+  if (ctx.archive && status == 0)
+    status = close_tile_archive(ctx.archive);
+  else
+    destroy_tile_archive(ctx.archive);
+
+  if (ctx.index && status == 0)
+    status = write_vrt(ctx.index, option->vrt, projection_ref, ctx.creation_options,
+                       option->edge == EDGE_PAD || option->has_bbox ? option->fill : -1);
+  destroy_vrt_index(ctx.index);
+
+  // per-codec numbers, so that compression settings can be compared run by run
+  double seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+  const char *codec = CSLFetchNameValue(ctx.creation_options, "COMPRESS");
+  printf("Wrote %zu tiles with COMPRESS=%s: %.1f MB raw, %.1f MB on disk (%.1f%%) in %.2f s (%.1f MB/s)\n",
+         stats.tiles, codec ? codec : "NONE", (double) stats.input_bytes / 1e6, (double) stats.output_bytes / 1e6,
+         stats.input_bytes ? 100.0 * (double) stats.output_bytes / (double) stats.input_bytes : 0.0, seconds,
+         seconds > 0 ? (double) stats.input_bytes / 1e6 / seconds : 0.0);
+  if (option->scratch)
+    printf("Read %zu of %zu rasters from the scratch cache instead of decoding them\n", cache_hits, n - unchanged);
+  if (outside)
+    printf("Skipped %zu rasters outside of the area of interest\n", outside);
+  if (unreadable)
+    fprintf(stderr, "ERROR: Skipped %zu rasters that could not be opened\n", unreadable);
+  if (unchanged)
+    printf("Skipped %zu of %zu rasters unchanged since their tiles were written\n", unchanged, n);
+  if (option->skip_empty)
+    printf("Skipped %zu empty tiles (all samples within %d of the first pixel)\n", stats.skipped,
+           option->empty_threshold);
+
+  pthread_mutex_destroy(&stats.lock);
+  CSLDestroy(ctx.creation_options);
+  CPLFree(projection_ref);
+  destroy_scheduler(pool);
+  free(pyramids);
+  free(workers);
+  free(blocks);
+  free(rasters);
+
+  // rasters that could not be opened do not hold back the manifest of the others, only the exit status
+  if (status || unreadable)
+    exit(69);
+}
+
+// bytes tile_file holds in memory at once for the given raster, 0 if it cannot be opened
+size_t tile_file_footprint(const char *file, const options *option)
+{
+  GDALDatasetH raster_file = GDALOpen(file, GA_ReadOnly);
+  if (raster_file == NULL)
+    return 0;
+
+  size_t columns = ((size_t) GDALGetRasterXSize(raster_file) + option->scale - 1) / option->scale;
+  size_t bytes = columns * option->rsize * GDALGetRasterCount(raster_file);
+  GDALClose(raster_file);
+
+  return bytes;
+}
+
+// three band tiffs of type GDAL_BYTE are interpreted as RGB
+// rows read from GDAL, interleaved and handed to the PNG encoder at a time
+#define PNG_BLOCK_ROWS 64
+
+// writes '<outdir>/<base>.png', or appends '<base>.png' to 'archive' if one is given
+static int convert_tile(const char *file, const char *base, const options *option, tile_archive *archive)
+{
+  int written;
+  int status = 0;
+  const int bytes_per_pixel = option->bands_count;
+  char outpath[1024];
+
+  if (option->verbose)
+    printf("Processing %s\n", file);
+
+  GDALDatasetH in_raster = GDALOpen(file, GA_ReadOnly);
+  if (in_raster == NULL) {
+    fprintf(stderr, "ERROR: Could not open file '%s'\n", file);
+    return 1;
+  }
+
+  size_t width = GDALGetRasterXSize(in_raster);
+  size_t height = GDALGetRasterYSize(in_raster);
+  int block_rows = height < PNG_BLOCK_ROWS ? (int) height : PNG_BLOCK_ROWS;
+
+  for (int i = 0; i < option->bands_count; i++) {
+    GDALRasterBandH hband = GDALGetRasterBand(in_raster, option->bands[i]);
+
+    if (hband == NULL) {
+      fprintf(stderr, "ERROR: Dataset '%s' has no band %d\n", file, option->bands[i]);
+      GDALClose(in_raster);
+      return 1;
     }
 
-    if (x > PNG_UINT_32_MAX / (sizeof (png_bytep)))
-      png_error(write_ptr, "Image is too tall to process in memory");
+    if (GDALGetRasterDataType(hband) != GDT_Byte) {
+      fprintf(stderr, "ERROR: Dataset is not of type GDT_Byte\n");
+      GDALClose(in_raster);
+      return 1;
+    }
+  }
 
-    png_byte *image = png_malloc(write_ptr, y * x * bytes_per_pixel);
-    if (bytes_per_pixel == 3) {
-      for (size_t i = 0; i < y * x * bytes_per_pixel; i += bytes_per_pixel) {
-        image[RED(i)] = data[0][i / bytes_per_pixel];
-        image[GREEN(i)] = data[1][i / bytes_per_pixel];
-        image[BLUE(i)] = data[2][i / bytes_per_pixel];
-      }
-    } else {
-      for (size_t i = 0; i < y * x; i++) {
-        image[i] = data[0][i];
-      }
+  written = snprintf(outpath, 1024, "%s%s%s.png",
+                     option->outdir,
+                     option->outdir[strlen(option->outdir) - 1] == '/' ? "" : "/",
+                     base);
+
+  if (written >= 1024) {
+    fprintf(stderr, "ERROR: Truncated output path\n");
+    GDALClose(in_raster);
+    return 1;
+  }
+
+  const char *name = strrchr(outpath, '/') + 1;
+  png_encoder *encoder = archive ? png_encoder_open_memory(name, width, height, bytes_per_pixel, option)
+                         : png_encoder_open(outpath, width, height, bytes_per_pixel, option);
+  if (encoder == NULL) {
+    GDALClose(in_raster);
+    return 1;
+  }
+
+  // only PNG_BLOCK_ROWS rows are held at a time: as planes read from GDAL and interleaved for the encoder
+  uint8_t *planar = malloc(width * block_rows * bytes_per_pixel);
+  uint8_t *image = malloc(width * block_rows * bytes_per_pixel);
+  if (planar == NULL || image == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate memory for datasets\n");
+    status = 1;
+  }
+
+  for (size_t row = 0; row < height && status == 0; row += block_rows) {
+    int rows = height - row < (size_t) block_rows ? (int) (height - row) : block_rows;
+
+    // requested bands are read in one go as contiguous planes, which GDAL copies fastest
+    CPLErr read_error =
+      GDALDatasetRasterIO(in_raster, GF_Read, 0, row, width, rows, planar, width, rows, GDT_Byte,
+                          option->bands_count, option->bands, 0, 0, 0);
+    if (read_error != CE_None) {
+      fprintf(stderr, "ERROR: Failed to read raster data\n");
+      status = 1;
+      break;
     }
 
-    png_bytep row_ptrs[x];
+    const uint8_t *planes[4];
+    for (int i = 0; i < option->bands_count; i++)
+      planes[i] = planar + i * width * rows;
+    interleave_bands(planes, bytes_per_pixel, width * rows, image);
+
+    status = png_encoder_write_rows(encoder, image, rows);
+  }
+
+  uint8_t *png = NULL;
+  size_t png_size = 0;
+  if (status)
+    png_encoder_abort(encoder);
+  else if (archive)
+    status = png_encoder_finish_memory(encoder, &png, &png_size);
+  else
+    status = png_encoder_finish(encoder);
+
+  if (status == 0 && archive) {
+    char source[1024];
+    int level = 0, x = 0, y = 0;
+    if (tile_key(base, source, sizeof(source), &level, &x, &y))
+      snprintf(source, sizeof(source), "%s", base);
+    status = tile_archive_append(archive, name, source, level, x, y, png, png_size, NULL);
+  }
+
+  free(png);
+  free(planar);
+  free(image);
+  GDALClose(in_raster);
 
-    for (size_t i = 0; i < x; i++)
-      row_ptrs[i] = image + i * y * bytes_per_pixel;
+  return status;
+}
 
-    png_set_rows(write_ptr, info_ptr, row_ptrs);
+int convert_file(const char *file, const char *base, const options *option)
+{
+  return convert_tile(file, base, option, NULL);
+}
 
-    png_write_png(write_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+// zlib's deflate state at the default window size and memory level, as used by libpng
+#define DEFLATE_STATE_SIZE (256 * 1024)
 
-    png_free(write_ptr, image);
-    png_destroy_write_struct(&write_ptr, &info_ptr);
+// bytes convert_file holds in memory at once for the given tile, 0 if it cannot be opened: the row blocks read and
+// interleaved, libpng's rows and deflate state, and the filtered image plus its compressed copy where the encoder
+// buffers the whole image
+size_t convert_file_footprint(const char *file, const options *option)
+{
+  GDALDatasetH in_raster = GDALOpen(file, GA_ReadOnly);
+  if (in_raster == NULL)
+    return 0;
 
-    fclose(outfile);
-    free(outpath);
+  size_t width = GDALGetRasterXSize(in_raster);
+  size_t height = GDALGetRasterYSize(in_raster);
+  GDALClose(in_raster);
 
-    free(data_p);
+  size_t stride = width * option->bands_count;
+  size_t block_rows = height < PNG_BLOCK_ROWS ? height : PNG_BLOCK_ROWS;
+  size_t bytes = 2 * stride * block_rows + 2 * (stride + 1) + DEFLATE_STATE_SIZE;
+  if (option->png_backend == PNG_BACKEND_LIBDEFLATE || option->threads > 1)
+    bytes += 2 * height * (stride + 1);
 
-    files = files->next;
+  return bytes;
+}
+
+// GeoTIFF tiles, on their own or inside a tile archive
+static int is_tile(const List *node)
+{
+  return strstr(node->file, ".tif") != NULL || strncmp(node->file, "/vsisubfile/", 12) == 0;
+}
+
+// a tile to convert and its size on disk, used to start with the biggest ones
+typedef struct
+{
+  List *node;
+  size_t size;
+} convert_job;
+
+typedef struct
+{
+  const options *option;
+  output_manifest *manifest;
+  tile_archive *archive;
+  size_t failed;
+  pthread_mutex_t lock;
+} convert_context;
+
+// a PNG only counts as done once it is completely written; failed ones are converted again next time. A tile that
+// cannot be converted is counted and skipped, only a failing manifest stops the run
+static int convert_task(void *task, int worker, void *context)
+{
+  (void) worker;
+  List *node = ((convert_job *) task)->node;
+  convert_context *ctx = (convert_context *) context;
+  const options *option = ctx->option;
+
+  if (convert_tile(node->file, node->base, option, ctx->archive)) {
+    fprintf(stderr, "ERROR: Skipping '%s'\n", node->file);
+    pthread_mutex_lock(&ctx->lock);
+    ctx->failed++;
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
   }
+  if (ctx->manifest == NULL)
+    return 0;
+
+  char outpath[1024];
+  snprintf(outpath, sizeof(outpath), "%s.png", node->base);
+  if (output_manifest_add(ctx->manifest, node->file, outpath))
+    return 1;
+  output_manifest_complete(ctx->manifest, node->file);
+
+  return 0;
+}
+
+// bands and encoder settings the PNGs were written with
+static void convert_parameters(const options *option, char *parameters, size_t size)
+{
+  int written = snprintf(parameters, size, "profile=%d encoder=%d bands=", option->png_profile,
+                         option->png_backend);
+  for (int i = 0; i < option->bands_count && written > 0 && (size_t) written < size; i++)
+    written += snprintf(parameters + written, size - written, "%s%d", i ? "," : "", option->bands[i]);
+}
+
+static int larger_job_first(const void *a, const void *b)
+{
+  size_t left = ((const convert_job *) a)->size;
+  size_t right = ((const convert_job *) b)->size;
+
+  return (left < right) - (left > right);
+}
+
+// tiles are spread over option->jobs workers, biggest files first; idle workers steal from busy ones
+void convert_files(List *files, const options *option)
+{
+  GDALAllRegister();
+  GDALSetCacheMax64((GIntBig) option->cache_size * option->jobs);
+
+  size_t count = 0;
+  for (List *node = files; node; node = node->next)
+    count += is_tile(node);
+  if (count == 0)
+    return;
+
+  convert_job *jobs = calloc(count, sizeof(convert_job));
+  scheduler *pool = create_scheduler(option->jobs);
+  if (jobs == NULL || pool == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate memory for conversion jobs\n");
+    free(jobs);
+    destroy_scheduler(pool);
+    exit(69);
+  }
+
+  // tiles converted before with the same settings are skipped, the PNGs of changed ones are removed first. An
+  // archive is written anew each time instead
+  char parameters[256];
+  convert_parameters(option, parameters, sizeof(parameters));
+  convert_context ctx = {
+    .option = option,
+    .manifest = option->archive ? NULL : load_output_manifest(option->outdir, ".ab-convert-manifest"),
+    .archive = option->archive ? create_tile_archive(option->archive) : NULL,
+  };
+  if (ctx.manifest == NULL && ctx.archive == NULL) {
+    if (option->archive == NULL)
+      fprintf(stderr, "ERROR: Failed to load output manifest in '%s'\n", option->outdir);
+    destroy_scheduler(pool);
+    free(jobs);
+    exit(69);
+  }
+  pthread_mutex_init(&ctx.lock, NULL);
+
+  int status = 0;
+  size_t n = 0;
+  size_t unchanged = 0;
+  for (List *node = files; node && status == 0; node = node->next) {
+    if (!is_tile(node))
+      continue;
+    source_stamp stamp;
+    if (stamp_source(node->file, option->hash_sources, &stamp)) {
+      fprintf(stderr, "ERROR: Skipping '%s'\n", node->file);
+      ctx.failed++;
+      continue;
+    }
+    if (ctx.manifest && !option->force &&
+        output_manifest_unchanged(ctx.manifest, node->file, &stamp, parameters)) {
+      unchanged++;
+      continue;
+    }
+    if (ctx.manifest)
+      status = output_manifest_begin(ctx.manifest, node->file, &stamp, parameters);
+    jobs[n].node = node;
+    jobs[n].size = (size_t) stamp.size;
+    n++;
+  }
+  qsort(jobs, n, sizeof(convert_job), larger_job_first);
+
+  for (size_t i = 0; i < n && status == 0; i++)
+    status = scheduler_push(pool, scheduler_pick(pool, jobs[i].size), &jobs[i]);
+  if (status == 0)
+    status = scheduler_run(pool, convert_task, &ctx);
+  if (unchanged)
+    printf("Skipped %zu tiles unchanged since their PNGs were written\n", unchanged);
+  if (ctx.failed)
+    fprintf(stderr, "ERROR: Failed to convert %zu tiles\n", ctx.failed);
+
+  if (ctx.manifest && save_output_manifest(ctx.manifest))
+    status = 1;
+  destroy_output_manifest(ctx.manifest);
+  // the index goes last; an archive of a failed run is removed
+  if (ctx.archive && status == 0)
+    status = close_tile_archive(ctx.archive);
+  else
+    destroy_tile_archive(ctx.archive);
+  pthread_mutex_destroy(&ctx.lock);
+  destroy_scheduler(pool);
+  free(jobs);
+
+  // like tile_files, the tiles that could be converted are kept and the run is reported as failed
+  if (status || ctx.failed)
+    exit(69);
 }
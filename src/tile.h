@@ -18,12 +18,27 @@ typedef struct _node
 
 List *gather_files(const char *directory);
 
+List *expand_archives(List *files);
+
+List *expand_tile_archives(List *files);
+
 void delete_list(List *root);
 
 int check_dir(const char *directory);
 
+// invoked with the path of every tile written by tile_file
+typedef void (*tile_callback)(const char *path, void *user);
+
+int tile_file(const char *file, const char *base, const options *option, tile_callback on_tile, void *user);
+
 void tile_files(List *files, const options *option);
 
+size_t tile_file_footprint(const char *file, const options *option);
+
+int convert_file(const char *file, const char *base, const options *option);
+
+size_t convert_file_footprint(const char *file, const options *option);
+
 void convert_files(List *files, const options *option);
 
 #endif // TILE_C
\ No newline at end of file
@@ -0,0 +1,253 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gdal/cpl_string.h>
+
+#include "vrt.h"
+
+vrt_index *create_vrt_index(void)
+{
+  vrt_index *index = calloc(1, sizeof(vrt_index));
+  if (index == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate VRT index.\n");
+    return NULL;
+  }
+  pthread_mutex_init(&index->lock, NULL);
+
+  return index;
+}
+
+// 'width' x 'height' from 'x_lead', 'y_lead' on is the part of the 'columns' x 'rows' tile covered by the source
+// raster, i.e. without padding
+int vrt_index_add(vrt_index *index, const char *file, const double geo_transform[6], int x_lead, int y_lead,
+                  int width, int height, int columns, int rows, int nbands)
+{
+  vrt_tile tile = {
+    .file = strdup(file), .x_lead = x_lead, .y_lead = y_lead, .width = width, .height = height, .columns = columns,
+    .rows = rows, .nbands = nbands
+  };
+  if (tile.file == NULL) {
+    fprintf(stderr, "ERROR: Failed to add '%s' to VRT index\n", file);
+    return 1;
+  }
+  memcpy(tile.geo_transform, geo_transform, sizeof(tile.geo_transform));
+
+  pthread_mutex_lock(&index->lock);
+  if (index->count == index->capacity) {
+    size_t capacity = index->capacity ? 2 * index->capacity : 1024;
+    vrt_tile *tiles = realloc(index->tiles, capacity * sizeof(vrt_tile));
+    if (tiles == NULL) {
+      pthread_mutex_unlock(&index->lock);
+      fprintf(stderr, "ERROR: Failed to add '%s' to VRT index\n", file);
+      free(tile.file);
+      return 1;
+    }
+    index->tiles = tiles;
+    index->capacity = capacity;
+  }
+  index->tiles[index->count++] = tile;
+  pthread_mutex_unlock(&index->lock);
+
+  return 0;
+}
+
+static void write_escaped(FILE *out, const char *text)
+{
+  for (; *text; text++) {
+    switch (*text) {
+    case '&':
+      fputs("&amp;", out);
+      break;
+    case '<':
+      fputs("&lt;", out);
+      break;
+    case '>':
+      fputs("&gt;", out);
+      break;
+    case '"':
+      fputs("&quot;", out);
+      break;
+    default:
+      fputc(*text, out);
+    }
+  }
+}
+
+// block size GTiff gives a tile created with 'creation_options': square blocks if tiled, else strips of about 8 KB
+static void tile_block_size(char **creation_options, const vrt_tile *tile, int *block_x, int *block_y)
+{
+  const char *block_x_option = CSLFetchNameValue(creation_options, "BLOCKXSIZE");
+  const char *block_y_option = CSLFetchNameValue(creation_options, "BLOCKYSIZE");
+
+  if (CPLTestBool(CSLFetchNameValueDef(creation_options, "TILED", "NO"))) {
+    *block_x = block_x_option ? atoi(block_x_option) : 256;
+    *block_y = block_y_option ? atoi(block_y_option) : 256;
+    return;
+  }
+
+  *block_x = tile->columns;
+  *block_y = block_y_option ? atoi(block_y_option) : 8192 / (tile->columns * tile->nbands);
+  if (*block_y < 1)
+    *block_y = 1;
+  if (*block_y > tile->rows)
+    *block_y = tile->rows;
+}
+
+// whether the tile lies next to the VRT and can be referenced relative to it
+static int same_directory(const char *vrt_path, const char *tile_path)
+{
+  char vrt_dir[PATH_MAX], tile_dir[PATH_MAX], resolved_vrt[PATH_MAX], resolved_tile[PATH_MAX];
+  const char *vrt_slash = strrchr(vrt_path, '/');
+  const char *tile_slash = strrchr(tile_path, '/');
+
+  snprintf(vrt_dir, sizeof(vrt_dir), "%.*s", vrt_slash ? (int) (vrt_slash - vrt_path) : 1,
+           vrt_slash ? vrt_path : ".");
+  snprintf(tile_dir, sizeof(tile_dir), "%.*s", tile_slash ? (int) (tile_slash - tile_path) : 1,
+           tile_slash ? tile_path : ".");
+  if (vrt_dir[0] == '\0')
+    strcpy(vrt_dir, "/");
+  if (tile_dir[0] == '\0')
+    strcpy(tile_dir, "/");
+
+  return realpath(vrt_dir, resolved_vrt) && realpath(tile_dir, resolved_tile) &&
+         strcmp(resolved_vrt, resolved_tile) == 0;
+}
+
+// pixel offsets of tiles on the same grid only differ from whole numbers by float noise
+static long round_offset(double offset)
+{
+  return (long) (offset < 0 ? offset - 0.5 : offset + 0.5);
+}
+
+static int same_size(double a, double b)
+{
+  double difference = a > b ? a - b : b - a;
+  return difference <= 1e-9 * (a > 0 ? a : -a);
+}
+
+static int by_file(const void *a, const void *b)
+{
+  return strcmp(((const vrt_tile *) a)->file, ((const vrt_tile *) b)->file);
+}
+
+// writes a VRT mosaic of all collected tiles, placed by their geotransforms, as gdalbuildvrt would. All tiles need
+// the same pixel size and band count. 'nodata' < 0 writes no nodata value.
+int write_vrt(vrt_index *index, const char *path, const char *projection_ref, char **creation_options,
+              int nodata)
+{
+  if (index->count == 0) {
+    fprintf(stderr, "WARNING: No tiles written, skipping VRT '%s'\n", path);
+    return 0;
+  }
+
+  // tiles arrive in whatever order the workers finish them
+  qsort(index->tiles, index->count, sizeof(vrt_tile), by_file);
+
+  const vrt_tile *first = &index->tiles[0];
+  double pixel_x = first->geo_transform[1];
+  double pixel_y = first->geo_transform[5];
+  double min_x = first->geo_transform[0] + first->x_lead * pixel_x;
+  double max_y = first->geo_transform[3] + first->y_lead * pixel_y;
+
+  for (size_t i = 1; i < index->count; i++) {
+    const vrt_tile *tile = &index->tiles[i];
+    if (!same_size(tile->geo_transform[1], pixel_x) || !same_size(tile->geo_transform[5], pixel_y) ||
+        tile->nbands != first->nbands) {
+      fprintf(stderr, "ERROR: Tiles differ in resolution or band count, cannot write VRT '%s'\n", path);
+      return 1;
+    }
+    double x = tile->geo_transform[0] + tile->x_lead * pixel_x;
+    double y = tile->geo_transform[3] + tile->y_lead * pixel_y;
+    min_x = x < min_x ? x : min_x;
+    max_y = y > max_y ? y : max_y;
+  }
+
+  // destination offsets of the covered parts in mosaic pixels
+  long *x_offsets = malloc(index->count * sizeof(long));
+  long *y_offsets = malloc(index->count * sizeof(long));
+  if (x_offsets == NULL || y_offsets == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate memory for VRT '%s'\n", path);
+    free(x_offsets);
+    free(y_offsets);
+    return 1;
+  }
+  long columns = 0;
+  long rows = 0;
+  for (size_t i = 0; i < index->count; i++) {
+    const vrt_tile *tile = &index->tiles[i];
+    x_offsets[i] = round_offset((tile->geo_transform[0] - min_x) / pixel_x) + tile->x_lead;
+    y_offsets[i] = round_offset((tile->geo_transform[3] - max_y) / pixel_y) + tile->y_lead;
+    columns = x_offsets[i] + tile->width > columns ? x_offsets[i] + tile->width : columns;
+    rows = y_offsets[i] + tile->height > rows ? y_offsets[i] + tile->height : rows;
+  }
+
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "ERROR: Could not open output file %s\n", path);
+    free(x_offsets);
+    free(y_offsets);
+    return 1;
+  }
+
+  int relative = same_directory(path, first->file);
+  int block_x, block_y;
+
+  fprintf(out, "<VRTDataset rasterXSize=\"%ld\" rasterYSize=\"%ld\">\n", columns, rows);
+  fprintf(out, "  <SRS dataAxisToSRSAxisMapping=\"1,2\">");
+  write_escaped(out, projection_ref ? projection_ref : "");
+  fprintf(out, "</SRS>\n");
+  fprintf(out, "  <GeoTransform>%.16g, %.16g, 0, %.16g, 0, %.16g</GeoTransform>\n", min_x, pixel_x, max_y, pixel_y);
+
+  for (int band = 1; band <= first->nbands; band++) {
+    fprintf(out, "  <VRTRasterBand dataType=\"Byte\" band=\"%d\">\n", band);
+    if (nodata >= 0)
+      fprintf(out, "    <NoDataValue>%d</NoDataValue>\n", nodata);
+    for (size_t i = 0; i < index->count; i++) {
+      const vrt_tile *tile = &index->tiles[i];
+      // tiles elsewhere are referenced by absolute path, since a relative one would depend on the reader's cwd
+      const char *name = strrchr(tile->file, '/');
+      char absolute[PATH_MAX];
+      if (!relative)
+        name = realpath(tile->file, absolute) ? absolute : tile->file;
+      else
+        name = name ? name + 1 : tile->file;
+      tile_block_size(creation_options, tile, &block_x, &block_y);
+
+      fprintf(out, "    <SimpleSource>\n");
+      fprintf(out, "      <SourceFilename relativeToVRT=\"%d\">", relative);
+      write_escaped(out, name);
+      fprintf(out, "</SourceFilename>\n");
+      fprintf(out, "      <SourceBand>%d</SourceBand>\n", band);
+      fprintf(out, "      <SourceProperties RasterXSize=\"%d\" RasterYSize=\"%d\" DataType=\"Byte\" "
+              "BlockXSize=\"%d\" BlockYSize=\"%d\" />\n", tile->columns, tile->rows, block_x, block_y);
+      fprintf(out, "      <SrcRect xOff=\"%d\" yOff=\"%d\" xSize=\"%d\" ySize=\"%d\" />\n", tile->x_lead, tile->y_lead,
+              tile->width, tile->height);
+      fprintf(out, "      <DstRect xOff=\"%ld\" yOff=\"%ld\" xSize=\"%d\" ySize=\"%d\" />\n", x_offsets[i],
+              y_offsets[i], tile->width, tile->height);
+      fprintf(out, "    </SimpleSource>\n");
+    }
+    fprintf(out, "  </VRTRasterBand>\n");
+  }
+  fprintf(out, "</VRTDataset>\n");
+
+  free(x_offsets);
+  free(y_offsets);
+  if (fclose(out) != 0) {
+    fprintf(stderr, "ERROR: Failed to write VRT '%s'\n", path);
+    return 1;
+  }
+
+  return 0;
+}
+
+void destroy_vrt_index(vrt_index *index)
+{
+  if (index == NULL)
+    return;
+  for (size_t i = 0; i < index->count; i++)
+    free(index->tiles[i].file);
+  free(index->tiles);
+  pthread_mutex_destroy(&index->lock);
+  free(index);
+}
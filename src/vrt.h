@@ -0,0 +1,41 @@
+#ifndef _VRT_H
+#define _VRT_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// placement of one written tile, as needed for its entry in the mosaic
+typedef struct
+{
+  char *file;
+  double geo_transform[6];
+  // part of the tile covered by the source raster
+  int x_lead;
+  int y_lead;
+  int width;
+  int height;
+  int columns;
+  int rows;
+  int nbands;
+} vrt_tile;
+
+// tiles collected while they are written, from any thread
+typedef struct
+{
+  vrt_tile *tiles;
+  size_t count;
+  size_t capacity;
+  pthread_mutex_t lock;
+} vrt_index;
+
+vrt_index *create_vrt_index(void);
+
+int vrt_index_add(vrt_index *index, const char *file, const double geo_transform[6], int x_lead, int y_lead,
+                  int width, int height, int columns, int rows, int nbands);
+
+int write_vrt(vrt_index *index, const char *path, const char *projection_ref, char **creation_options,
+              int nodata);
+
+void destroy_vrt_index(vrt_index *index);
+
+#endif // _VRT_H
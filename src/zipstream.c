@@ -0,0 +1,434 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "zipstream.h"
+
+#define LOCAL_HEADER_SIGNATURE   0x04034b50
+#define DATA_DESCRIPTOR_SIGNATURE 0x08074b50
+#define CENTRAL_HEADER_SIGNATURE 0x02014b50
+#define END_OF_CENTRAL_SIGNATURE 0x06054b50
+#define ZIP64_END_SIGNATURE      0x06064b50
+
+#define LOCAL_HEADER_SIZE 26  // fixed part following the signature
+#define FLAG_DATA_DESCRIPTOR (1 << 3)
+#define METHOD_STORED  0
+#define METHOD_DEFLATE 8
+#define ZIP64_EXTRA_ID 0x0001
+#define UNKNOWN_SIZE UINT64_MAX
+
+typedef enum
+{
+  ZS_SIGNATURE,
+  ZS_HEADER,
+  ZS_NAME,
+  ZS_DATA,
+  ZS_DESCRIPTOR,
+  ZS_DESCRIPTOR_TAIL,
+  ZS_DONE,
+  ZS_ERROR
+} zipstream_state;
+
+/*
+ * Only local file headers and member data are needed to extract while downloading, the central
+ * directory at the end of the archive merely confirms that the stream is complete.
+ * Members with a data descriptor (general purpose flag bit 3) have no size in their local header;
+ * deflated ones are delimited by the end of their deflate stream, stored ones cannot be streamed.
+ */
+struct zipstream
+{
+  char *directory;
+  int verbose;
+  zipstream_state state;
+
+  // bytes of the current header structure collected so far
+  unsigned char *buffer;
+  size_t buffer_size;
+  size_t buffered;
+  size_t needed;
+
+  uint16_t flags;
+  uint16_t method;
+  uint32_t crc;
+  uint64_t compressed_size;
+  uint64_t uncompressed_size;
+  uint64_t remaining;
+  uint16_t name_length;
+  uint16_t extra_length;
+  int zip64;
+  int crc_pending;
+
+  z_stream inflater;
+  int inflating;
+  uLong running_crc;
+
+  FILE *member;
+  char *member_path;
+  char *part_path;
+  size_t extracted;
+};
+
+static uint16_t read_u16(const unsigned char *p)
+{
+  return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static uint32_t read_u32(const unsigned char *p)
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t read_u64(const unsigned char *p)
+{
+  return (uint64_t) read_u32(p) | ((uint64_t) read_u32(p + 4) << 32);
+}
+
+static int wanted_member(const char *name)
+{
+  const char *extension = strrchr(name, '.');
+  if (extension == NULL || name[strlen(name) - 1] == '/')
+    return 0;
+  return strcasecmp(extension, ".ecw") == 0 || strcasecmp(extension, ".jp2") == 0;
+}
+
+static int expect(zipstream *stream, zipstream_state state, size_t needed)
+{
+  if (needed > stream->buffer_size) {
+    unsigned char *newmem = realloc(stream->buffer, needed);
+    if (newmem == NULL) {
+      fprintf(stderr, "ERROR: Failed to allocate memory for zip header\n");
+      stream->state = ZS_ERROR;
+      return 1;
+    }
+    stream->buffer = newmem;
+    stream->buffer_size = needed;
+  }
+  stream->state = state;
+  stream->buffered = 0;
+  stream->needed = needed;
+  return 0;
+}
+
+static void close_member(zipstream *stream, int keep)
+{
+  if (stream->member) {
+    fclose(stream->member);
+    stream->member = NULL;
+    if (keep && rename(stream->part_path, stream->member_path) == 0) {
+      stream->extracted++;
+      if (stream->verbose)
+        printf("Extracted '%s'\n", stream->member_path);
+    } else {
+      unlink(stream->part_path);
+    }
+  }
+  free(stream->member_path);
+  free(stream->part_path);
+  stream->member_path = NULL;
+  stream->part_path = NULL;
+}
+
+// members are flattened into the output directory and written to '<name>.part' until their CRC checks out
+static int open_member(zipstream *stream, const char *name)
+{
+  const char *base = strrchr(name, '/');
+  base = base ? base + 1 : name;
+
+  stream->member_path = calloc(1024, sizeof(char));
+  stream->part_path = calloc(1024 + 5, sizeof(char));
+  if (stream->member_path == NULL || stream->part_path == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate memory for member path\n");
+    return 1;
+  }
+
+  int written = snprintf(stream->member_path, 1024, "%s%s%s",
+                         stream->directory,
+                         stream->directory[strlen(stream->directory) - 1] == '/' ? "" : "/",
+                         base);
+  if (written >= 1024) {
+    fprintf(stderr, "ERROR: Extracted file path longer than 1024 bytes\n");
+    return 1;
+  }
+  sprintf(stream->part_path, "%s.part", stream->member_path);
+
+  stream->member = fopen(stream->part_path, "wb");
+  if (stream->member == NULL) {
+    fprintf(stderr, "ERROR: Failed to open output file %s\n", stream->part_path);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int parse_name_and_extra(zipstream *stream)
+{
+  char name[1024];
+  const unsigned char *extra = stream->buffer + stream->name_length;
+
+  if (stream->name_length >= sizeof(name)) {
+    fprintf(stderr, "ERROR: Zip member name longer than 1024 bytes\n");
+    return 1;
+  }
+  memcpy(name, stream->buffer, stream->name_length);
+  name[stream->name_length] = '\0';
+
+  // zip64 extra field: 8 byte sizes for every 32 bit field that was saturated, in this order
+  for (size_t i = 0; i + 4 <= stream->extra_length;) {
+    uint16_t id = read_u16(extra + i);
+    uint16_t size = read_u16(extra + i + 2);
+    if (i + 4 + size > stream->extra_length)
+      break;
+    if (id == ZIP64_EXTRA_ID) {
+      const unsigned char *field = extra + i + 4;
+      size_t offset = 0;
+      stream->zip64 = 1;
+      if (stream->uncompressed_size == UINT32_MAX && offset + 8 <= size) {
+        stream->uncompressed_size = read_u64(field + offset);
+        offset += 8;
+      }
+      if (stream->compressed_size == UINT32_MAX && offset + 8 <= size)
+        stream->compressed_size = read_u64(field + offset);
+    }
+    i += 4 + size;
+  }
+
+  if (stream->flags & FLAG_DATA_DESCRIPTOR)
+    stream->compressed_size = UNKNOWN_SIZE;
+
+  if (stream->compressed_size == UNKNOWN_SIZE && stream->method != METHOD_DEFLATE) {
+    fprintf(stderr, "ERROR: Zip member '%s' cannot be extracted from a stream (method %u without size)\n",
+            name, stream->method);
+    return 1;
+  }
+
+  if (wanted_member(name)) {
+    if (stream->method != METHOD_STORED && stream->method != METHOD_DEFLATE) {
+      fprintf(stderr, "WARNING: Skipping zip member '%s' with unsupported compression method %u\n",
+              name, stream->method);
+    } else if (open_member(stream, name)) {
+      close_member(stream, 0);
+      return 1;
+    }
+  }
+
+  stream->remaining = stream->compressed_size;
+  stream->running_crc = crc32(0L, Z_NULL, 0);
+  stream->inflating = stream->method == METHOD_DEFLATE &&
+                      (stream->member != NULL || stream->compressed_size == UNKNOWN_SIZE);
+  if (stream->inflating && inflateReset(&stream->inflater) != Z_OK) {
+    fprintf(stderr, "ERROR: Failed to reset inflate stream\n");
+    return 1;
+  }
+
+  stream->state = ZS_DATA;
+  return 0;
+}
+
+static int emit(zipstream *stream, const unsigned char *data, size_t length)
+{
+  if (stream->member == NULL)
+    return 0;
+
+  stream->running_crc = crc32_z(stream->running_crc, data, length);
+  if (fwrite(data, 1, length, stream->member) != length) {
+    fprintf(stderr, "ERROR: Failed to write to %s\n", stream->part_path);
+    return 1;
+  }
+  return 0;
+}
+
+static int end_of_member(zipstream *stream)
+{
+  if (stream->flags & FLAG_DATA_DESCRIPTOR)
+    return expect(stream, ZS_DESCRIPTOR, 4);
+
+  if (stream->member && stream->running_crc != stream->crc) {
+    fprintf(stderr, "ERROR: CRC mismatch for '%s'\n", stream->member_path);
+    close_member(stream, 0);
+    return 1;
+  }
+  close_member(stream, 1);
+  return expect(stream, ZS_SIGNATURE, 4);
+}
+
+// consumes member data, returns the number of bytes used or -1 on error
+static long consume_data(zipstream *stream, const unsigned char *data, size_t length)
+{
+  unsigned char out[1 << 16];
+
+  if (!stream->inflating) {
+    size_t used = length < stream->remaining ? length : (size_t) stream->remaining;
+    if (stream->method == METHOD_STORED && emit(stream, data, used))
+      return -1;
+    stream->remaining -= used;
+    if (stream->remaining == 0 && end_of_member(stream))
+      return -1;
+    return (long) used;
+  }
+
+  z_stream *z = &stream->inflater;
+  z->next_in = (Bytef *) data;
+  z->avail_in = (uInt) (length > UINT32_MAX ? UINT32_MAX : length);
+  int status;
+  // a full output buffer means inflate may hold back more data even without new input
+  do {
+    z->next_out = out;
+    z->avail_out = sizeof(out);
+    status = inflate(z, Z_NO_FLUSH);
+    if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+      fprintf(stderr, "ERROR: Failed to inflate zip member (%s)\n", z->msg ? z->msg : "unknown error");
+      return -1;
+    }
+    if (emit(stream, out, sizeof(out) - z->avail_out))
+      return -1;
+  } while (status != Z_STREAM_END && (z->avail_in > 0 || z->avail_out == 0));
+
+  long used = (long) ((const unsigned char *) z->next_in - data);
+  if (status == Z_STREAM_END && end_of_member(stream))
+    return -1;
+  return used;
+}
+
+static int header_complete(zipstream *stream)
+{
+  const unsigned char *p = stream->buffer;
+
+  switch (stream->state) {
+  case ZS_SIGNATURE:
+    switch (read_u32(p)) {
+    case LOCAL_HEADER_SIGNATURE:
+      return expect(stream, ZS_HEADER, LOCAL_HEADER_SIZE);
+    case CENTRAL_HEADER_SIGNATURE:
+    case END_OF_CENTRAL_SIGNATURE:
+    case ZIP64_END_SIGNATURE:
+      stream->state = ZS_DONE;
+      return 0;
+    default:
+      fprintf(stderr, "ERROR: Unexpected zip record signature 0x%08x\n", read_u32(p));
+      return 1;
+    }
+  case ZS_HEADER:
+    stream->flags = read_u16(p + 2);
+    stream->method = read_u16(p + 4);
+    stream->crc = read_u32(p + 10);
+    stream->compressed_size = read_u32(p + 14);
+    stream->uncompressed_size = read_u32(p + 18);
+    stream->name_length = read_u16(p + 22);
+    stream->extra_length = read_u16(p + 24);
+    stream->zip64 = 0;
+    if (stream->name_length == 0) {
+      fprintf(stderr, "ERROR: Zip member without a name\n");
+      return 1;
+    }
+    return expect(stream, ZS_NAME, (size_t) stream->name_length + stream->extra_length);
+  case ZS_NAME:
+    return parse_name_and_extra(stream);
+  case ZS_DESCRIPTOR:
+    // the descriptor signature is optional, without it these four bytes already are the CRC
+    stream->crc_pending = read_u32(p) == DATA_DESCRIPTOR_SIGNATURE;
+    if (!stream->crc_pending)
+      stream->crc = read_u32(p);
+    return expect(stream, ZS_DESCRIPTOR_TAIL, (stream->crc_pending ? 4 : 0) + (stream->zip64 ? 16 : 8));
+  case ZS_DESCRIPTOR_TAIL:
+    if (stream->crc_pending)
+      stream->crc = read_u32(p);
+    if (stream->member && stream->running_crc != stream->crc) {
+      fprintf(stderr, "ERROR: CRC mismatch for '%s'\n", stream->member_path);
+      close_member(stream, 0);
+      return 1;
+    }
+    close_member(stream, 1);
+    return expect(stream, ZS_SIGNATURE, 4);
+  default:
+    return 1;
+  }
+}
+
+zipstream *zipstream_create(const char *directory, const int verbose)
+{
+  zipstream *stream = calloc(1, sizeof(zipstream));
+  if (stream == NULL) {
+    fprintf(stderr, "ERROR: Failed to allocate zip stream\n");
+    return NULL;
+  }
+
+  stream->directory = strdup(directory);
+  stream->verbose = verbose;
+  if (stream->directory == NULL || inflateInit2(&stream->inflater, -MAX_WBITS) != Z_OK) {
+    fprintf(stderr, "ERROR: Failed to initialize zip stream\n");
+    free(stream->directory);
+    free(stream);
+    return NULL;
+  }
+
+  if (expect(stream, ZS_SIGNATURE, 4)) {
+    zipstream_destroy(stream);
+    return NULL;
+  }
+
+  return stream;
+}
+
+int zipstream_feed(zipstream *stream, const unsigned char *data, size_t length)
+{
+  while (length > 0) {
+    switch (stream->state) {
+    case ZS_DONE:
+      return 0;
+    case ZS_ERROR:
+      return 1;
+    case ZS_DATA: {
+      long used = consume_data(stream, data, length);
+      if (used < 0) {
+        stream->state = ZS_ERROR;
+        return 1;
+      }
+      data += used;
+      length -= (size_t) used;
+      break;
+    }
+    default: {
+      size_t chunk = stream->needed - stream->buffered;
+      if (chunk > length)
+        chunk = length;
+      memcpy(stream->buffer + stream->buffered, data, chunk);
+      stream->buffered += chunk;
+      data += chunk;
+      length -= chunk;
+      if (stream->buffered == stream->needed && header_complete(stream)) {
+        stream->state = ZS_ERROR;
+        return 1;
+      }
+      break;
+    }
+    }
+  }
+
+  return stream->state == ZS_ERROR;
+}
+
+// the archive is only complete once its central directory was reached
+int zipstream_finish(zipstream *stream)
+{
+  return stream->state != ZS_DONE;
+}
+
+size_t zipstream_extracted(const zipstream *stream)
+{
+  return stream->extracted;
+}
+
+void zipstream_destroy(zipstream *stream)
+{
+  if (stream == NULL)
+    return;
+  close_member(stream, 0);
+  inflateEnd(&stream->inflater);
+  free(stream->buffer);
+  free(stream->directory);
+  free(stream);
+}
@@ -0,0 +1,19 @@
+#ifndef _ZIPSTREAM_H
+#define _ZIPSTREAM_H
+
+#include <stddef.h>
+
+// incremental reader for zip archives that arrive as a byte stream (i.e. from a CURL write callback)
+typedef struct zipstream zipstream;
+
+zipstream *zipstream_create(const char *directory, const int verbose);
+
+int zipstream_feed(zipstream *stream, const unsigned char *data, size_t length);
+
+int zipstream_finish(zipstream *stream);
+
+size_t zipstream_extracted(const zipstream *stream);
+
+void zipstream_destroy(zipstream *stream);
+
+#endif // _ZIPSTREAM_H
@@ -0,0 +1,67 @@
+// throughput of the interleave kernels, in MB of interleaved output per second
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "kernels.c"
+
+// a little over one 10000 pixel DOP20 row; odd on purpose, so the scalar tails run too
+#define PIXELS 10003
+#define ROUNDS 20000
+
+typedef size_t (*interleave_kernel)(const uint8_t *const *, size_t, uint8_t *);
+
+static double now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// a NULL kernel times the scalar code alone
+static void bench(const char *name, interleave_kernel kernel, int nbands)
+{
+  uint8_t *data = malloc(nbands * PIXELS);
+  uint8_t *out = malloc(nbands * PIXELS);
+  const uint8_t *planes[4];
+
+  for (size_t i = 0; i < (size_t) nbands * PIXELS; i++)
+    data[i] = i * 2654435761u >> 24;
+  for (int band = 0; band < nbands; band++)
+    planes[band] = data + band * PIXELS;
+
+  double start = now();
+  for (int round = 0; round < ROUNDS; round++) {
+    size_t done = kernel ? kernel(planes, PIXELS, out) : 0;
+    const uint8_t *rest[4];
+    for (int band = 0; band < nbands; band++)
+      rest[band] = planes[band] + done;
+    interleave_bands_scalar(rest, nbands, PIXELS - done, out + done * nbands);
+    // keeps the compiler from dropping rounds whose output is never read
+    __asm__ volatile("" : : "r"(out) : "memory");
+  }
+  double seconds = now() - start;
+
+  printf("%-24s %d bands %9.1f MB/s\n", name, nbands, (double) nbands * PIXELS * ROUNDS / seconds / 1e6);
+  free(data);
+  free(out);
+}
+
+int main(void)
+{
+  for (int nbands = 1; nbands <= 4; nbands++)
+    bench("interleave_bands_scalar", NULL, nbands);
+
+#ifdef HAVE_X86_KERNELS
+  if (__builtin_cpu_supports("ssse3"))
+    bench("interleave_rgb_ssse3", interleave_rgb_ssse3, 3);
+  if (__builtin_cpu_supports("avx2"))
+    bench("interleave_rgb_avx2", interleave_rgb_avx2, 3);
+  if (__builtin_cpu_supports("sse2"))
+    bench("interleave_rgba_sse2", interleave_rgba_sse2, 4);
+  if (__builtin_cpu_supports("avx2"))
+    bench("interleave_rgba_avx2", interleave_rgba_avx2, 4);
+#endif // HAVE_X86_KERNELS
+
+  return 0;
+}
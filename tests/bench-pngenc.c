@@ -0,0 +1,87 @@
+// encoder throughput and PNG size per profile and backend, on synthetic rasters shaped like DOP20 tiles
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pngenc.h"
+
+#define SIDE 1500
+
+static const char *profiles[] = { "default", "fast", "balanced", "small" };
+
+static double now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// smooth gradients with sensor-like noise, plus flat blocks standing in for roofs and water
+static uint8_t *synthetic_raster(int channels)
+{
+  uint8_t *data = malloc((size_t) SIDE * SIDE * channels);
+  uint32_t state = 7;
+
+  for (size_t y = 0; y < SIDE; y++)
+    for (size_t x = 0; x < SIDE; x++) {
+      state = state * 1664525 + 1013904223;
+      int flat = (x / 200 + y / 300) % 5 == 0;
+      for (int c = 0; c < channels; c++) {
+        int value = flat ? 90 + 30 * c : (int) ((x * (c + 1) + y * (3 - c)) / 24 % 200) + (int) (state >> (28 - c)) % 12;
+        data[(y * SIDE + x) * channels + c] = c == 3 ? 255 : value;
+      }
+    }
+
+  return data;
+}
+
+static void bench(const uint8_t *raster, int channels, int profile, int backend, int threads)
+{
+  options option = { .png_profile = profile, .png_backend = backend, .threads = threads };
+  double start = now();
+  png_encoder *encoder = png_encoder_open_memory("bench", SIDE, SIDE, channels, &option);
+  uint8_t *png = NULL;
+  size_t size = 0;
+
+  // row blocks of 256 lines, like the tiler hands them over
+  for (int y = 0; encoder && y < SIDE; y += 256) {
+    int count = SIDE - y < 256 ? SIDE - y : 256;
+    if (png_encoder_write_rows(encoder, raster + (size_t) y * SIDE * channels, count)) {
+      png_encoder_abort(encoder);
+      encoder = NULL;
+    }
+  }
+  if (encoder == NULL || png_encoder_finish_memory(encoder, &png, &size)) {
+    fprintf(stderr, "ERROR: Encoding failed\n");
+    exit(1);
+  }
+  double seconds = now() - start;
+
+  double raw = (double) SIDE * SIDE * channels;
+  printf("%d bands %-8s %-10s %2d threads %8.1f MB/s %10zu bytes %5.1f%%\n", channels, profiles[profile],
+         backend == PNG_BACKEND_LIBDEFLATE ? "libdeflate" : "zlib", threads, raw / seconds / 1e6, size,
+         100 * (double) size / raw);
+  free(png);
+}
+
+int main(void)
+{
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cores > 1 ? (int) cores : 2;
+
+  for (int channels = 3; channels <= 4; channels++) {
+    uint8_t *raster = synthetic_raster(channels);
+    for (int profile = PNG_PROFILE_DEFAULT; profile <= PNG_PROFILE_SMALL; profile++) {
+      bench(raster, channels, profile, PNG_BACKEND_LIBPNG, 1);
+      bench(raster, channels, profile, PNG_BACKEND_LIBPNG, threads);
+#ifdef HAVE_LIBDEFLATE
+      bench(raster, channels, profile, PNG_BACKEND_LIBDEFLATE, 1);
+#endif // HAVE_LIBDEFLATE
+    }
+    free(raster);
+  }
+
+  return 0;
+}
@@ -0,0 +1,179 @@
+// writes tile archives from several threads, reopens them and reads every tile back in place
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive.h"
+
+#define WRITERS 4
+#define TILES_PER_WRITER 300
+
+static int failures;
+
+static void check(int condition, const char *what)
+{
+  if (condition)
+    return;
+
+  fprintf(stderr, "FAIL: %s\n", what);
+  failures++;
+}
+
+// contents and length depend on the tile, so misplaced or truncated tiles show
+static size_t tile_data(int writer, int tile, uint8_t *out)
+{
+  size_t size = (size_t) (writer * 7 + tile * 13) % 997 + (tile == 0 ? 0 : 1);
+  for (size_t i = 0; i < size; i++)
+    out[i] = (uint8_t) (writer * 31 + tile * 17 + i);
+  return size;
+}
+
+typedef struct
+{
+  tile_archive *archive;
+  int writer;
+  int status;
+} append_job;
+
+static void *append_tiles(void *data)
+{
+  append_job *job = data;
+  uint8_t buffer[1024];
+  char name[64];
+  char source[64];
+
+  snprintf(source, sizeof(source), "dop20rgb_%d.ecw", job->writer);
+  for (int tile = 0; tile < TILES_PER_WRITER && !job->status; tile++) {
+    size_t size = tile_data(job->writer, tile, buffer);
+    uint64_t offset = 0;
+    snprintf(name, sizeof(name), "%d/%d/%d.png", tile % 3, tile % 20 - 10, tile / 20);
+    job->status = tile_archive_append(job->archive, name, source, tile % 3, tile % 20 - 10, tile / 20, buffer, size,
+                                      &offset);
+  }
+
+  return NULL;
+}
+
+static void check_round_trip(const char *path)
+{
+  tile_archive *archive = create_tile_archive(path);
+  pthread_t threads[WRITERS];
+  append_job jobs[WRITERS];
+
+  check(archive != NULL, "archive created");
+  if (archive == NULL)
+    return;
+
+  for (int w = 0; w < WRITERS; w++) {
+    jobs[w] = (append_job) {
+      .archive = archive, .writer = w
+    };
+    pthread_create(&threads[w], NULL, append_tiles, &jobs[w]);
+  }
+  for (int w = 0; w < WRITERS; w++) {
+    pthread_join(threads[w], NULL);
+    check(jobs[w].status == 0, "tiles appended");
+  }
+  check(close_tile_archive(archive) == 0, "archive closed");
+
+  archive = open_tile_archive(path);
+  check(archive != NULL, "closed archive opened");
+  if (archive == NULL)
+    return;
+  check(archive->count == WRITERS * TILES_PER_WRITER, "every tile indexed");
+
+  int fd = open(path, O_RDONLY);
+  uint8_t expected[1024];
+  uint8_t actual[1024];
+  char source[64];
+  char name[64];
+  for (int w = 0; w < WRITERS; w++)
+    for (int tile = 0; tile < TILES_PER_WRITER; tile++) {
+      snprintf(source, sizeof(source), "dop20rgb_%d.ecw", w);
+      snprintf(name, sizeof(name), "%d/%d/%d.png", tile % 3, tile % 20 - 10, tile / 20);
+      const archive_entry *entry = tile_archive_find(archive, source, tile % 3, tile % 20 - 10, tile / 20);
+      check(entry != NULL, "tile found");
+      if (entry == NULL)
+        continue;
+      size_t size = tile_data(w, tile, expected);
+      check(entry->size == size && !strcmp(entry->name, name) && !strcmp(entry->source, source), "entry matches");
+      check(entry->size <= sizeof(actual) && pread(fd, actual, entry->size, entry->offset) == (ssize_t) entry->size &&
+            !memcmp(actual, expected, entry->size), "tile bytes read back in place");
+    }
+  close(fd);
+
+  check(tile_archive_find(archive, "dop20rgb_0.ecw", 0, 11, 0) == NULL, "missing tile not found");
+  check(tile_archive_find(archive, "dop20rgb_9.ecw", 0, 0, 0) == NULL, "missing source not found");
+
+  char subfile[4096];
+  char expected_subfile[4096];
+  const archive_entry *entry = tile_archive_find(archive, "dop20rgb_1.ecw", 1, -9, 0);
+  snprintf(expected_subfile, sizeof(expected_subfile), "/vsisubfile/%llu_%llu,%s",
+           (unsigned long long) entry->offset, (unsigned long long) entry->size, path);
+  check(tile_archive_subfile(archive, entry->offset, entry->size, subfile, sizeof(subfile)) == 0 &&
+        !strcmp(subfile, expected_subfile), "subfile path");
+  check(tile_archive_subfile(archive, entry->offset, entry->size, subfile, 16) != 0, "short subfile buffer refused");
+
+  destroy_tile_archive(archive);
+}
+
+static void check_empty(const char *path)
+{
+  tile_archive *archive = create_tile_archive(path);
+  check(archive != NULL && close_tile_archive(archive) == 0, "empty archive closed");
+
+  archive = open_tile_archive(path);
+  check(archive != NULL && archive->count == 0, "empty archive opened");
+  if (archive)
+    check(tile_archive_find(archive, "dop20rgb_0.ecw", 0, 0, 0) == NULL, "nothing found in empty archive");
+  destroy_tile_archive(archive);
+}
+
+// an archive that never got its index, or lost its tail, is refused or removed
+static void check_incomplete(const char *path)
+{
+  tile_archive *archive = create_tile_archive(path);
+  uint8_t data[100] = { 0 };
+  struct stat status;
+
+  check(archive != NULL && tile_archive_append(archive, "0/0/0.png", "a.ecw", 0, 0, 0, data, sizeof(data), NULL) == 0,
+        "tile appended");
+  destroy_tile_archive(archive);
+  check(stat(path, &status) != 0, "unclosed archive removed");
+
+  archive = create_tile_archive(path);
+  tile_archive_append(archive, "0/0/0.png", "a.ecw", 0, 0, 0, data, sizeof(data), NULL);
+  close_tile_archive(archive);
+  check(stat(path, &status) == 0 && truncate(path, status.st_size - 1) == 0, "archive truncated");
+  check(open_tile_archive(path) == NULL, "truncated archive refused");
+}
+
+int main(void)
+{
+  char directory[] = "/tmp/test-archive.XXXXXX";
+  char path[sizeof(directory) + 32];
+
+  if (mkdtemp(directory) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  snprintf(path, sizeof(path), "%s/tiles.abt", directory);
+  check_round_trip(path);
+  check_empty(path);
+  check_incomplete(path);
+  unlink(path);
+  rmdir(directory);
+
+  if (failures) {
+    fprintf(stderr, "test-archive: %d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("test-archive: all tiles read back\n");
+  return 0;
+}
@@ -0,0 +1,213 @@
+// fills raster cache entries strip by strip from several threads, maps them back and evicts them
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+#define COLUMNS 333
+#define ROWS 250
+#define BANDS 3
+#define STRIP_ROWS 16
+#define STRIPS ((ROWS + STRIP_ROWS - 1) / STRIP_ROWS)
+
+static const double geo_transform[6] = { 390000.0, 0.2, 0.0, 5820000.0, 0.0, -0.2 };
+
+static int failures;
+
+static void check(int condition, const char *what)
+{
+  if (condition)
+    return;
+
+  fprintf(stderr, "FAIL: %s\n", what);
+  failures++;
+}
+
+static uint8_t *test_raster(unsigned seed)
+{
+  uint8_t *data = malloc((size_t) COLUMNS * ROWS * BANDS);
+  for (size_t i = 0; i < (size_t) COLUMNS * ROWS * BANDS; i++)
+    data[i] = (uint8_t) (i * 2654435761u >> 24) ^ seed;
+  return data;
+}
+
+typedef struct
+{
+  cache_writer *writer;
+  const uint8_t *data;
+  int first;
+  int step;
+} put_job;
+
+// every thread stores every 'step'th strip, from the bottom up, so strips arrive out of order
+static void *put_strips(void *data)
+{
+  put_job *job = data;
+
+  for (int strip = STRIPS - 1 - job->first; strip >= 0; strip -= job->step) {
+    int row = strip * STRIP_ROWS;
+    int rows = ROWS - row < STRIP_ROWS ? ROWS - row : STRIP_ROWS;
+    cache_writer_put(job->writer, row, job->data + (size_t) row * COLUMNS * BANDS, rows);
+  }
+
+  return NULL;
+}
+
+static void fill_entry(const raster_cache *cache, const char *source, const source_stamp *stamp,
+                       const uint8_t *data)
+{
+  cache_writer *writer = raster_cache_begin(cache, source, stamp, COLUMNS, ROWS, BANDS, geo_transform, STRIPS);
+  pthread_t threads[3];
+  put_job jobs[3];
+
+  check(writer != NULL, "cache entry begun");
+  if (writer == NULL)
+    return;
+
+  for (int t = 0; t < 3; t++) {
+    jobs[t] = (put_job) {
+      .writer = writer, .data = data, .first = t, .step = 3
+    };
+    pthread_create(&threads[t], NULL, put_strips, &jobs[t]);
+  }
+  for (int t = 0; t < 3; t++)
+    pthread_join(threads[t], NULL);
+  cache_writer_close(writer);
+}
+
+static int is_cached(const raster_cache *cache, const char *source, const source_stamp *stamp)
+{
+  cached_raster raster = { 0 };
+  int hit = raster_cache_map(cache, source, stamp, COLUMNS, ROWS, BANDS, geo_transform, &raster) == 0;
+  raster_cache_unmap(&raster);
+  return hit;
+}
+
+// files in 'directory'; with 'age' set, their mtimes are also moved back to a fixed point in the past
+static size_t scan_files(const char *directory, int age)
+{
+  const struct timespec past[2] = { { .tv_sec = 1577836800 }, { .tv_sec = 1577836800 } };
+  DIR *dir = opendir(directory);
+  struct dirent *entry;
+  size_t count = 0;
+
+  while (dir && (entry = readdir(dir))) {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      continue;
+    if (age)
+      check(utimensat(dirfd(dir), entry->d_name, past, 0) == 0, "entry aged");
+    count++;
+  }
+  if (dir)
+    closedir(dir);
+
+  return count;
+}
+
+static void check_round_trip(const raster_cache *cache)
+{
+  source_stamp stamp = { .size = 123456, .mtime = 1700000000 };
+  uint8_t *data = test_raster(0);
+  cached_raster raster = { 0 };
+
+  check(!is_cached(cache, "/data/Nord/dop20rgb_390_5820.ecw", &stamp), "empty cache misses");
+
+  fill_entry(cache, "/data/Nord/dop20rgb_390_5820.ecw", &stamp, data);
+  check(raster_cache_map(cache, "/data/Nord/dop20rgb_390_5820.ecw", &stamp, COLUMNS, ROWS, BANDS, geo_transform,
+                         &raster) == 0, "complete entry hits");
+  check(raster.pixels && !memcmp(raster.pixels, data, (size_t) COLUMNS * ROWS * BANDS), "cached pixels match");
+  raster_cache_unmap(&raster);
+  check(raster.map == NULL, "unmap clears the raster");
+
+  source_stamp touched = stamp;
+  touched.mtime++;
+  check(!is_cached(cache, "/data/Nord/dop20rgb_390_5820.ecw", &touched), "changed source misses");
+  check(!is_cached(cache, "/data/Sued/dop20rgb_390_5820.ecw", &stamp), "source of equal name misses");
+
+  double moved[6];
+  memcpy(moved, geo_transform, sizeof(moved));
+  moved[0] += 0.2;
+  check(raster_cache_map(cache, "/data/Nord/dop20rgb_390_5820.ecw", &stamp, COLUMNS, ROWS, BANDS, moved,
+                         &raster) != 0, "changed geotransform misses");
+  check(raster_cache_map(cache, "/data/Nord/dop20rgb_390_5820.ecw", &stamp, COLUMNS, ROWS, 4, geo_transform,
+                         &raster) != 0, "changed band count misses");
+
+  free(data);
+}
+
+// a writer closed before its last strip leaves neither an entry nor its temporary file behind
+static void check_incomplete(const raster_cache *cache)
+{
+  source_stamp stamp = { .size = 1, .mtime = 2 };
+  uint8_t *data = test_raster(1);
+  size_t files = scan_files(cache->directory, 0);
+
+  cache_writer *writer = raster_cache_begin(cache, "/data/incomplete.ecw", &stamp, COLUMNS, ROWS, BANDS,
+                                            geo_transform, STRIPS);
+  check(writer != NULL, "cache entry begun");
+  for (int strip = 0; writer && strip < STRIPS - 1; strip++)
+    cache_writer_put(writer, strip * STRIP_ROWS, data + (size_t) strip * STRIP_ROWS * COLUMNS * BANDS, STRIP_ROWS);
+  cache_writer_close(writer);
+
+  check(!is_cached(cache, "/data/incomplete.ecw", &stamp), "incomplete entry misses");
+  check(scan_files(cache->directory, 0) == files, "incomplete entry removed");
+  free(data);
+}
+
+// the entry used last survives a trim that only leaves room for one entry
+static void check_trim(const raster_cache *cache)
+{
+  source_stamp stamp = { .size = 3, .mtime = 4 };
+  uint8_t *data = test_raster(2);
+  const char *sources[] = { "/data/a.ecw", "/data/b.ecw", "/data/c.ecw" };
+
+  for (int i = 0; i < 3; i++)
+    fill_entry(cache, sources[i], &stamp, data);
+
+  // mtimes are the eviction order; set them apart so the test does not depend on the file system's resolution
+  scan_files(cache->directory, 1);
+  check(is_cached(cache, sources[1], &stamp), "entry used");
+
+  raster_cache_trim(cache, raster_cache_entry_size(COLUMNS, ROWS, BANDS));
+  check(!is_cached(cache, sources[0], &stamp) && is_cached(cache, sources[1], &stamp) &&
+        !is_cached(cache, sources[2], &stamp), "least recently used entries evicted");
+
+  raster_cache_trim(cache, 0);
+  check(scan_files(cache->directory, 0) == 0, "trimmed to nothing");
+  free(data);
+}
+
+int main(void)
+{
+  char directory[] = "/tmp/test-cache.XXXXXX";
+
+  if (mkdtemp(directory) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  raster_cache *cache = create_raster_cache(directory, 1 << 30);
+  check(cache != NULL, "cache created");
+  if (cache) {
+    check_round_trip(cache);
+    check_incomplete(cache);
+    check_trim(cache);
+    raster_cache_trim(cache, 0);
+    destroy_raster_cache(cache);
+  }
+  rmdir(directory);
+
+  if (failures) {
+    fprintf(stderr, "test-cache: %d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("test-cache: all entries read back and evicted in order\n");
+  return 0;
+}
@@ -0,0 +1,188 @@
+// compares every vector path of src/kernels.c with its scalar counterpart; the kernels are static, so the
+// translation unit is included whole
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kernels.c"
+
+// lengths around the 16 and 32 pixel blocks, so both the vector loops and the scalar tails run
+static const size_t lengths[] = { 0, 1, 2, 3, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65, 95, 97, 1001, 4099 };
+#define LENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+
+// bytes past the end of each output that no kernel may touch
+#define GUARD 64
+
+static int failures;
+
+static void fill_random(uint8_t *data, size_t size, uint32_t *state)
+{
+  for (size_t i = 0; i < size; i++) {
+    *state = *state * 1664525 + 1013904223;
+    data[i] = *state >> 24;
+  }
+}
+
+static void check(int condition, const char *name, int nbands, size_t length, const char *what)
+{
+  if (condition)
+    return;
+
+  fprintf(stderr, "FAIL: %s, %d bands, %zu pixels: %s\n", name, nbands, length, what);
+  failures++;
+}
+
+typedef size_t (*interleave_kernel)(const uint8_t *const *, size_t, uint8_t *);
+
+// runs 'kernel' like interleave_bands does (the scalar code finishes its tail) and compares with the scalar code
+static void check_interleave(const char *name, interleave_kernel kernel, int nbands)
+{
+  uint32_t state = 1;
+
+  for (size_t l = 0; l < LENGTHS; l++) {
+    size_t pixels = lengths[l];
+    uint8_t *data = malloc(nbands * pixels + 1);
+    uint8_t *expected = malloc(nbands * pixels + GUARD);
+    uint8_t *actual = malloc(nbands * pixels + GUARD);
+    const uint8_t *planes[4];
+
+    fill_random(data, nbands * pixels + 1, &state);
+    for (int band = 0; band < nbands; band++)
+      planes[band] = data + band * pixels;
+    memset(expected, 0xA5, nbands * pixels + GUARD);
+    memset(actual, 0xA5, nbands * pixels + GUARD);
+
+    interleave_bands_scalar(planes, nbands, pixels, expected);
+    if (kernel) {
+      size_t done = kernel(planes, pixels, actual);
+      check(done <= pixels, name, nbands, pixels, "handled more pixels than given");
+      const uint8_t *rest[4];
+      for (int band = 0; band < nbands; band++)
+        rest[band] = planes[band] + done;
+      interleave_bands_scalar(rest, nbands, pixels - done, actual + done * nbands);
+    } else {
+      interleave_bands(planes, nbands, pixels, actual);
+    }
+
+    check(!memcmp(expected, actual, nbands * pixels), name, nbands, pixels, "output differs");
+    check(!memcmp(expected + nbands * pixels, actual + nbands * pixels, GUARD), name, nbands, pixels,
+          "wrote past the output");
+
+    free(data);
+    free(expected);
+    free(actual);
+  }
+}
+
+typedef size_t (*downsample_kernel)(const uint8_t *, const uint8_t *, size_t, uint8_t *);
+
+static void check_downsample(const char *name, downsample_kernel kernel, int nbands)
+{
+  uint32_t state = 2;
+
+  for (size_t l = 0; l < LENGTHS; l++) {
+    size_t width = lengths[l];
+    size_t size = (width + 1) / 2 * nbands;
+    uint8_t *top = malloc(width * nbands + 1);
+    uint8_t *bottom = malloc(width * nbands + 1);
+    uint8_t *expected = malloc(size + GUARD);
+    uint8_t *actual = malloc(size + GUARD);
+
+    fill_random(top, width * nbands + 1, &state);
+    fill_random(bottom, width * nbands + 1, &state);
+    memset(expected, 0xA5, size + GUARD);
+    memset(actual, 0xA5, size + GUARD);
+
+    downsample_rows_scalar(top, bottom, width, nbands, 0, expected);
+    if (kernel) {
+      size_t done = kernel(top, bottom, width, actual);
+      check(done <= (width + 1) / 2, name, nbands, width, "handled more pixel pairs than given");
+      downsample_rows_scalar(top, bottom, width, nbands, done, actual);
+    } else {
+      downsample_rows(top, bottom, width, nbands, actual);
+    }
+
+    check(!memcmp(expected, actual, size), name, nbands, width, "output differs");
+    check(!memcmp(expected + size, actual + size, GUARD), name, nbands, width, "wrote past the output");
+
+    free(top);
+    free(bottom);
+    free(expected);
+    free(actual);
+  }
+}
+
+typedef size_t (*deviates_kernel)(const uint8_t *, size_t, const uint8_t *, int, int *);
+
+// a uniform row with one sample pushed just past the threshold at every position in turn; the kernel plus the
+// scalar tail has to find each of them and must not flag the unchanged row
+static void check_deviates(const char *name, deviates_kernel kernel, int nbands)
+{
+  const int threshold = 3;
+  uint8_t pattern[UNIFORM_STEP];
+  uint8_t row[3 * UNIFORM_STEP + 12];
+  size_t length = sizeof(row) / nbands * nbands;
+
+  for (size_t i = 0; i < sizeof(row); i++)
+    row[i] = 100 + i % nbands * 40;
+  for (int i = 0; i < UNIFORM_STEP; i++)
+    pattern[i] = row[i % nbands];
+
+  for (size_t position = 0; position <= length; position++) {
+    uint8_t saved = position < length ? row[position] : 0;
+    if (position < length)
+      row[position] += position % 2 ? threshold + 1 : -(threshold + 1);
+
+    int deviates = 0;
+    size_t done = kernel(row, length, pattern, threshold, &deviates);
+    if (!deviates)
+      deviates = row_deviates_scalar(row, done, length, pattern, nbands, threshold);
+    check(deviates == (position < length), name, nbands, position, "wrong answer for the sample at this offset");
+
+    if (position < length)
+      row[position] = saved;
+  }
+}
+
+int main(void)
+{
+  for (int nbands = 1; nbands <= 4; nbands++)
+    check_interleave("interleave_bands", NULL, nbands);
+  for (int nbands = 1; nbands <= 4; nbands++)
+    check_downsample("downsample_rows", NULL, nbands);
+
+#ifdef HAVE_X86_KERNELS
+  if (__builtin_cpu_supports("ssse3")) {
+    check_interleave("interleave_rgb_ssse3", interleave_rgb_ssse3, 3);
+    check_downsample("downsample_gray_ssse3", downsample_gray_ssse3, 1);
+    check_downsample("downsample_rgb_ssse3", downsample_rgb_ssse3, 3);
+  } else {
+    printf("skipping the SSSE3 kernels\n");
+  }
+
+  if (__builtin_cpu_supports("sse2")) {
+    check_interleave("interleave_rgba_sse2", interleave_rgba_sse2, 4);
+    check_downsample("downsample_rgba_sse2", downsample_rgba_sse2, 4);
+    for (int nbands = 1; nbands <= 4; nbands++)
+      check_deviates("row_deviates_sse2", row_deviates_sse2, nbands);
+  } else {
+    printf("skipping the SSE2 kernels\n");
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    check_interleave("interleave_rgb_avx2", interleave_rgb_avx2, 3);
+    check_interleave("interleave_rgba_avx2", interleave_rgba_avx2, 4);
+    for (int nbands = 1; nbands <= 4; nbands++)
+      check_deviates("row_deviates_avx2", row_deviates_avx2, nbands);
+  } else {
+    printf("skipping the AVX2 kernels\n");
+  }
+#endif // HAVE_X86_KERNELS
+
+  if (failures) {
+    fprintf(stderr, "test-kernels: %d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("test-kernels: all kernels match the scalar code\n");
+  return 0;
+}
@@ -0,0 +1,209 @@
+// records sources and their outputs in a manifest, saves it, loads it back and checks what counts as unchanged
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "manifest.h"
+
+#define MANIFEST_NAME "manifest.tsv"
+
+static const char *source = "/data/Nord/dop20rgb_390_5820.ecw";
+static const char *parameters = "rows=1000 columns=1000";
+
+static int failures;
+
+static void check(int condition, const char *what)
+{
+  if (condition)
+    return;
+
+  fprintf(stderr, "FAIL: %s\n", what);
+  failures++;
+}
+
+static int exists(const char *directory, const char *name)
+{
+  char path[1024];
+  struct stat file_stat;
+
+  snprintf(path, sizeof(path), "%s/%s", directory, name);
+  return stat(path, &file_stat) == 0;
+}
+
+static void write_output(const char *path)
+{
+  FILE *out = fopen(path, "w");
+  check(out != NULL, "output written");
+  if (out)
+    fclose(out);
+}
+
+// writes an output file into 'directory' and records it, by its full path as the tools pass it
+static void add_output(output_manifest *manifest, const char *directory, const char *name)
+{
+  char path[1024];
+
+  snprintf(path, sizeof(path), "%s/%s", directory, name);
+  write_output(path);
+  check(output_manifest_add(manifest, source, path) == 0, "output added");
+}
+
+// a source only counts as unchanged once complete, with the same stamp and parameters and all outputs present
+static void check_cycle(output_manifest *manifest, const char *directory)
+{
+  source_stamp stamp = { .size = 123456, .mtime = 1700000000 };
+
+  check(!output_manifest_unchanged(manifest, source, &stamp, parameters), "unknown source changed");
+  check(output_manifest_add(manifest, source, "early.tif") != 0, "output of unknown source refused");
+
+  check(output_manifest_begin(manifest, source, &stamp, parameters) == 0, "source begun");
+  add_output(manifest, directory, "t-a-X0000_Y0000.tif");
+  add_output(manifest, directory, "t-a-X0001_Y0000.tif");
+  check(!output_manifest_unchanged(manifest, source, &stamp, parameters), "incomplete source changed");
+
+  output_manifest_complete(manifest, source);
+  check(output_manifest_unchanged(manifest, source, &stamp, parameters), "complete source unchanged");
+
+  source_stamp touched = stamp;
+  touched.mtime++;
+  check(!output_manifest_unchanged(manifest, source, &touched, parameters), "new mtime changed");
+  touched = stamp;
+  touched.size--;
+  check(!output_manifest_unchanged(manifest, source, &touched, parameters), "new size changed");
+  check(!output_manifest_unchanged(manifest, source, &stamp, "rows=500 columns=500"), "new parameters changed");
+
+  // beginning again removes what the source made before
+  check(output_manifest_begin(manifest, source, &stamp, parameters) == 0, "source begun again");
+  check(!exists(directory, "t-a-X0000_Y0000.tif") && !exists(directory, "t-a-X0001_Y0000.tif"),
+        "previous outputs removed");
+  add_output(manifest, directory, "t-a-X0000_Y0000.tif");
+  output_manifest_complete(manifest, source);
+  check(output_manifest_unchanged(manifest, source, &stamp, parameters), "redone source unchanged");
+
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/t-a-X0000_Y0000.tif", directory);
+  unlink(path);
+  check(!output_manifest_unchanged(manifest, source, &stamp, parameters), "missing output changed");
+  write_output(path);
+}
+
+// the manifest replaces the old one in one rename, leaving no temporary file, and reads back as it was saved
+static void check_reload(output_manifest *manifest, const char *directory)
+{
+  source_stamp stamp = { .size = 123456, .mtime = 1700000000 };
+  source_stamp partial = { .size = 1, .mtime = 2 };
+  char tmp_name[64];
+
+  check(output_manifest_begin(manifest, "/data/Sued/partial.ecw", &partial, parameters) == 0,
+        "second source begun");
+  check(save_output_manifest(manifest) == 0, "manifest saved");
+  snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", MANIFEST_NAME);
+  check(exists(directory, MANIFEST_NAME), "manifest in place");
+  check(!exists(directory, tmp_name), "temporary manifest renamed");
+
+  output_manifest *loaded = load_output_manifest(directory, MANIFEST_NAME);
+  check(loaded != NULL, "manifest loaded");
+  if (loaded == NULL)
+    return;
+
+  check(loaded->count == 2, "both sources loaded");
+  check(output_manifest_unchanged(loaded, source, &stamp, parameters), "reloaded source unchanged");
+  check(!output_manifest_unchanged(loaded, "/data/Sued/partial.ecw", &partial, parameters),
+        "reloaded partial source changed");
+  for (size_t i = 0; i < loaded->count; i++)
+    if (strcmp(loaded->records[i].source, source) == 0)
+      check(loaded->records[i].output_count == 1 &&
+            strcmp(loaded->records[i].outputs[0], "t-a-X0000_Y0000.tif") == 0, "outputs stored by name");
+  destroy_output_manifest(loaded);
+
+  // a save that cannot write its temporary file leaves the saved manifest alone
+  char tmp_path[1024];
+  snprintf(tmp_path, sizeof(tmp_path), "%s/%s", directory, tmp_name);
+  check(mkdir(tmp_path, 0700) == 0, "temporary path blocked");
+  check(save_output_manifest(manifest) != 0, "blocked save fails");
+  rmdir(tmp_path);
+  loaded = load_output_manifest(directory, MANIFEST_NAME);
+  check(loaded != NULL && loaded->count == 2, "saved manifest kept");
+  destroy_output_manifest(loaded);
+}
+
+// a checksum recorded without hashing, or a run without -H, compares only size and mtime
+static void check_checksums(output_manifest *manifest)
+{
+  source_stamp unhashed = { .size = 123456, .mtime = 1700000000 };
+  source_stamp hashed = unhashed;
+  hashed.checksum = 0x1234abcd;
+
+  check(output_manifest_unchanged(manifest, source, &hashed, parameters), "unhashed record ignores checksum");
+
+  check(output_manifest_begin(manifest, source, &hashed, parameters) == 0, "hashed source begun");
+  output_manifest_complete(manifest, source);
+  check(output_manifest_unchanged(manifest, source, &hashed, parameters), "same checksum unchanged");
+  check(output_manifest_unchanged(manifest, source, &unhashed, parameters), "unhashed run ignores checksum");
+
+  source_stamp other = hashed;
+  other.checksum = 0x4321dcba;
+  check(!output_manifest_unchanged(manifest, source, &other, parameters), "other checksum changed");
+}
+
+static void check_stamp(const char *directory)
+{
+  char path[1024];
+  source_stamp plain, hashed;
+
+  snprintf(path, sizeof(path), "%s/source.ecw", directory);
+  FILE *out = fopen(path, "w");
+  check(out != NULL, "source written");
+  if (out) {
+    fputs("not really a raster\n", out);
+    fclose(out);
+  }
+
+  check(stamp_source(path, 0, &plain) == 0 && plain.size == 20 && plain.checksum == 0, "source stamped");
+  check(stamp_source(path, 1, &hashed) == 0 && hashed.size == 20 && hashed.checksum != 0, "source hashed");
+  check(stamp_source("/nonexistent/source.ecw", 0, &plain) != 0, "missing source not stamped");
+  unlink(path);
+}
+
+static void remove_outputs(const char *directory)
+{
+  const char *names[] = { "t-a-X0000_Y0000.tif", "t-a-X0001_Y0000.tif", MANIFEST_NAME };
+  char path[1024];
+
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    snprintf(path, sizeof(path), "%s/%s", directory, names[i]);
+    unlink(path);
+  }
+}
+
+int main(void)
+{
+  char directory[] = "/tmp/test-manifest.XXXXXX";
+
+  if (mkdtemp(directory) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  output_manifest *manifest = load_output_manifest(directory, MANIFEST_NAME);
+  check(manifest != NULL && manifest->count == 0, "missing manifest loads empty");
+  if (manifest) {
+    check_cycle(manifest, directory);
+    check_reload(manifest, directory);
+    check_checksums(manifest);
+    destroy_output_manifest(manifest);
+  }
+  check_stamp(directory);
+  remove_outputs(directory);
+  rmdir(directory);
+
+  if (failures) {
+    fprintf(stderr, "test-manifest: %d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("test-manifest: all records saved, reloaded and compared\n");
+  return 0;
+}
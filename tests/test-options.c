@@ -0,0 +1,169 @@
+// parses the command line values shared by the tools and checks what is accepted and what is refused
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aerial-berlin.h"
+
+static int failures;
+
+static void check(int condition, const char *value, const char *what)
+{
+  if (condition)
+    return;
+
+  fprintf(stderr, "FAIL: '%s': %s\n", value, what);
+  failures++;
+}
+
+// 1/N and plain N, for N a power of two up to 64; a refused value leaves the scale as it was
+static void check_scale(void)
+{
+  const struct
+  {
+    const char *value;
+    int scale;
+  } accepted[] = {
+    { "1/1", 1 }, { "1/2", 2 }, { "4", 4 }, { "1/8", 8 }, { "16", 16 }, { "1/64", 64 },
+  };
+  const char *refused[] = { "1/3", "6", "0", "1/0", "-2", "1/128", "1/", "", "abc", "1/2x", "2/4", "1/ 2", "+2" };
+
+  for (size_t i = 0; i < sizeof(accepted) / sizeof(accepted[0]); i++) {
+    options *option = create_options();
+    check(parse_scale(option, accepted[i].value) == 0 && option->scale == accepted[i].scale, accepted[i].value,
+          "scale accepted");
+    destroy_options(option);
+  }
+
+  for (size_t i = 0; i < sizeof(refused) / sizeof(refused[0]); i++) {
+    options *option = create_options();
+    int scale = option->scale;
+    check(parse_scale(option, refused[i]) != 0 && option->scale == scale, refused[i], "scale refused");
+    destroy_options(option);
+  }
+}
+
+// minx,miny,maxx,maxy with the minimum below the maximum, nothing before or after
+static void check_bbox(void)
+{
+  const char *refused[] = {
+    "", "390000,5819000,391000", "390000,5819000,391000,5820000,0", "a,b,c,d", "391000,5819000,390000,5820000",
+    "390000,5820000,391000,5819000", "390000,5819000,390000,5820000", "390000,5819000,391000,5820000x",
+    "390000;5819000;391000;5820000",
+  };
+  const char *value = "390000,5819000.5,391000,5820000";
+  options *option = create_options();
+
+  check(parse_bbox(option, value) == 0 && option->has_bbox && option->bbox[0] == 390000.0 &&
+        option->bbox[1] == 5819000.5 && option->bbox[2] == 391000.0 && option->bbox[3] == 5820000.0, value,
+        "bbox accepted");
+  destroy_options(option);
+
+  for (size_t i = 0; i < sizeof(refused) / sizeof(refused[0]); i++) {
+    option = create_options();
+    check(parse_bbox(option, refused[i]) != 0 && !option->has_bbox, refused[i], "bbox refused");
+    destroy_options(option);
+  }
+}
+
+// parses 'json' as the GeoJSON file 'path'; 0 if it was accepted
+static int parse_json(options *option, const char *path, const char *json)
+{
+  FILE *out = fopen(path, "w");
+  if (out == NULL)
+    return -1;
+  fputs(json, out);
+  fclose(out);
+
+  int status = parse_aoi(option, path);
+  unlink(path);
+  return status;
+}
+
+// the envelope of all positions, whatever their nesting; longitude and latitude or no coordinates at all are refused
+static void check_aoi(const char *directory)
+{
+  const char *polygon =
+    "{\"type\": \"FeatureCollection\", \"features\": [\n"
+    "  {\"type\": \"Feature\", \"geometry\": {\"type\": \"Polygon\", \"coordinates\": [[[390000, 5819000],"
+    " [391000.5, 5819000], [391000.5, 5820000], [390000, 5820000], [390000, 5819000]]]}},\n"
+    "  {\"type\": \"Feature\", \"geometry\": {\"type\": \"Point\", \"coordinates\": [389500, 5821000, 34.5]}}\n"
+    "]}\n";
+  const char *lon_lat =
+    "{\"type\": \"Polygon\", \"coordinates\": [[[13.3, 52.4], [13.5, 52.4], [13.5, 52.6], [13.3, 52.4]]]}\n";
+  const char *empty = "{\"type\": \"FeatureCollection\", \"features\": []}\n";
+  char path[1024];
+  options *option = create_options();
+
+  snprintf(path, sizeof(path), "%s/aoi.geojson", directory);
+  check(parse_json(option, path, polygon) == 0 && option->has_bbox && option->bbox[0] == 389500.0 &&
+        option->bbox[1] == 5819000.0 && option->bbox[2] == 391000.5 && option->bbox[3] == 5821000.0, "polygon",
+        "envelope of all positions");
+  destroy_options(option);
+
+  option = create_options();
+  check(parse_json(option, path, lon_lat) != 0 && !option->has_bbox, "longitude and latitude", "aoi refused");
+  destroy_options(option);
+
+  option = create_options();
+  check(parse_json(option, path, empty) != 0 && !option->has_bbox, "no coordinates", "aoi refused");
+  check(parse_aoi(option, path) != 0 && !option->has_bbox, path, "missing file refused");
+  destroy_options(option);
+}
+
+// whether the regions kept for an area of interest, listed in the order they were requested, are the expected ones;
+// NULL expects the selection to fail
+static int selected(const char *bbox, const char *regions, const char *expected)
+{
+  options *option = create_options();
+  char kept[256] = "";
+
+  int status = parse_bbox(option, bbox) || (regions && parse_image_regions(option, regions)) ||
+               select_regions(option);
+  for (size_t i = 0; status == 0 && i < option->region_count; i++)
+    snprintf(kept + strlen(kept), sizeof(kept) - strlen(kept), "%s%s", i ? "," : "", option->requested_region[i]);
+  destroy_options(option);
+
+  return expected ? status == 0 && strcmp(kept, expected) == 0 : status != 0;
+}
+
+static void check_regions(void)
+{
+  options *option = create_options();
+  check(select_regions(option) == 0 && option->region_count == 0, "no bbox", "regions left alone");
+  destroy_options(option);
+
+  check(selected("392000,5816000,394000,5818000", NULL, "Mitte"), "inside Mitte", "regions selected");
+  check(selected("399500,5816000,400000,5817000", NULL, "Mitte,Ost"), "near Mitte and Ost", "regions selected");
+  check(selected("400000,5823000,400500,5823500", NULL, "Mitte,Nord,Nordost,Ost"), "near four cells",
+        "regions selected");
+  check(selected("392000,5816000,394000,5818000", "Nord,Mitte", "Mitte"), "requested regions", "regions selected");
+  check(selected("392000,5816000,394000,5818000", "Nord", NULL), "inside Mitte, only Nord requested",
+        "selection refused");
+  check(selected("300000,5700000,301000,5701000", NULL, NULL), "outside Berlin", "selection refused");
+}
+
+int main(void)
+{
+  char directory[] = "/tmp/test-options.XXXXXX";
+
+  if (mkdtemp(directory) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  check_scale();
+  check_bbox();
+  check_aoi(directory);
+  check_regions();
+  rmdir(directory);
+
+  if (failures) {
+    fprintf(stderr, "test-options: %d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("test-options: all values parsed as documented\n");
+  return 0;
+}
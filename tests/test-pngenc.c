@@ -0,0 +1,142 @@
+// encodes images with every profile, backend and thread count and decodes them again with stock libpng; images
+// above DEFLATE_PIECE_SIZE exercise the stitched zlib stream of the parallel encoder
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pngenc.h"
+
+static int failures;
+
+typedef struct
+{
+  const uint8_t *data;
+  size_t size;
+  size_t offset;
+} png_source;
+
+static void read_memory(png_structp png, png_bytep out, png_size_t length)
+{
+  png_source *source = png_get_io_ptr(png);
+
+  if (length > source->size - source->offset)
+    png_error(png, "read past the end of the PNG");
+  memcpy(out, source->data + source->offset, length);
+  source->offset += length;
+}
+
+// decodes 'png' and compares it with 'expected'; returns 1 if they differ or the PNG is broken
+static int decode_and_compare(const uint8_t *png, size_t size, const uint8_t *expected, size_t width, size_t height,
+                              int channels)
+{
+  png_structp reader = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info = reader ? png_create_info_struct(reader) : NULL;
+  png_source source = { .data = png, .size = size };
+  uint8_t *row = malloc(width * channels);
+  int status = 1;
+
+  if (reader == NULL || info == NULL || row == NULL) {
+    fprintf(stderr, "ERROR: Could not create PNG reader\n");
+    goto cleanup;
+  }
+
+  if (setjmp(png_jmpbuf(reader))) {
+    status = 1;
+    goto cleanup;
+  }
+
+  png_set_read_fn(reader, &source, read_memory);
+  png_read_info(reader, info);
+  if (png_get_image_width(reader, info) != width || png_get_image_height(reader, info) != height ||
+      png_get_channels(reader, info) != channels || png_get_bit_depth(reader, info) != 8)
+    goto cleanup;
+
+  status = 0;
+  for (size_t y = 0; y < height && !status; y++) {
+    png_read_row(reader, row, NULL);
+    status = memcmp(row, expected + y * width * channels, width * channels) != 0;
+  }
+  if (!status)
+    png_read_end(reader, NULL);
+
+cleanup:
+  png_destroy_read_struct(&reader, &info, NULL);
+  free(row);
+  return status;
+}
+
+// noise next to flat runs, so every filter and both literal and match heavy deflate blocks turn up
+static uint8_t *test_image(size_t width, size_t height, int channels)
+{
+  uint8_t *data = malloc(width * height * channels);
+  uint32_t state = 11;
+
+  for (size_t i = 0; i < width * height * channels; i++) {
+    state = state * 1664525 + 1013904223;
+    size_t x = i / channels % width;
+    data[i] = x % 64 < 24 ? (uint8_t) (x / 64 * 37 + i % channels) : (uint8_t) (state >> 24);
+  }
+
+  return data;
+}
+
+static void check(size_t width, size_t height, int channels, int profile, int backend, int threads)
+{
+  options option = { .png_profile = profile, .png_backend = backend, .threads = threads };
+  uint8_t *image = test_image(width, height, channels);
+  png_encoder *encoder = png_encoder_open_memory("test", width, height, channels, &option);
+  uint8_t *png = NULL;
+  size_t size = 0;
+  int status = encoder == NULL;
+
+  // uneven row blocks, so blocks straddle the piece boundaries
+  for (size_t y = 0; !status && y < height; y += 37) {
+    int count = height - y < 37 ? height - y : 37;
+    status = png_encoder_write_rows(encoder, image + y * width * channels, count);
+    if (status)
+      png_encoder_abort(encoder);
+  }
+  if (!status)
+    status = png_encoder_finish_memory(encoder, &png, &size);
+  if (!status)
+    status = decode_and_compare(png, size, image, width, height, channels);
+
+  if (status) {
+    fprintf(stderr, "FAIL: %zux%zu, %d bands, profile %d, %s, %d threads\n", width, height, channels, profile,
+            backend == PNG_BACKEND_LIBDEFLATE ? "libdeflate" : "zlib", threads);
+    failures++;
+  }
+
+  free(image);
+  free(png);
+}
+
+int main(void)
+{
+  // one piece, a few pieces, and more than one IDAT chunk
+  static const size_t sizes[][2] = { { 61, 17 }, { 701, 251 }, { 1601, 401 } };
+  static const int threads[] = { 1, 2, 3, 8 };
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    for (int channels = 1; channels <= 4; channels++) {
+      if (channels == 2)
+        continue;
+      for (int profile = PNG_PROFILE_DEFAULT; profile <= PNG_PROFILE_SMALL; profile++) {
+        for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+          check(sizes[s][0], sizes[s][1], channels, profile, PNG_BACKEND_LIBPNG, threads[t]);
+#ifdef HAVE_LIBDEFLATE
+          check(sizes[s][0], sizes[s][1], channels, profile, PNG_BACKEND_LIBDEFLATE, threads[t]);
+#endif // HAVE_LIBDEFLATE
+        }
+      }
+    }
+
+  if (failures) {
+    fprintf(stderr, "test-pngenc: %d images failed\n", failures);
+    return 1;
+  }
+
+  printf("test-pngenc: all images decode to their source\n");
+  return 0;
+}
@@ -0,0 +1,137 @@
+// checks the geometry behind ab-tile's reduced scales and areas of interest; the helpers are static, so the
+// translation unit is included whole
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tile.c"
+
+static int failures;
+
+static void check(int condition, int size, int scale, const char *what)
+{
+  if (condition)
+    return;
+
+  fprintf(stderr, "FAIL: %d pixels at 1/%d: %s\n", size, scale, what);
+  failures++;
+}
+
+// the reduced pixels of a raster split its full resolution pixels without gaps or overlaps, from the first to the
+// last one, each taking between one and 'scale' of them; also when 'scale' does not divide the raster size
+static void check_source_pixels(void)
+{
+  const int sizes[] = { 1, 2, 3, 7, 63, 64, 65, 333, 4999, 5000, 5001, 10000 };
+  const int scales[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    for (size_t j = 0; j < sizeof(scales) / sizeof(scales[0]); j++) {
+      int size = sizes[i];
+      int scale = scales[j];
+      int reduced = (size + scale - 1) / scale;
+      int spans_ok = 1;
+
+      check(source_pixel(0, size, scale) == 0, size, scale, "first pixel at the left or top edge");
+      check(source_pixel(reduced, size, scale) == size, size, scale, "last pixel at the right or bottom edge");
+      for (int pixel = 0; pixel < reduced; pixel++) {
+        int span = source_pixel(pixel + 1, size, scale) - source_pixel(pixel, size, scale);
+        spans_ok = spans_ok && span >= 1 && span <= scale;
+      }
+      check(spans_ok, size, scale, "each pixel reads 1 to scale source pixels");
+    }
+  }
+
+  // 5001 pixels at 1/4 are 1251 reduced ones, the last of them reading the 4 pixels left over
+  check(source_pixel(1250, 5001, 4) == 4997 && source_pixel(1251, 5001, 4) == 5001, 5001, 4,
+        "last reduced pixel reads the remaining source pixels");
+}
+
+// tiles of 100 pixels of the global grid along a raster of 500 pixels starting at pixel 1000, i.e. tiles 10 to 14
+static void check_clip_axis(void)
+{
+  const struct
+  {
+    const char *what;
+    double low;
+    double high;
+    int overlap;
+    int align;
+    int first;
+    int tiles;
+  } cases[] = {
+    { "outside before the raster", 0, 900, 0, 1, 0, 0 },
+    { "outside after the raster", 1600, 1700, 0, 1, 0, 0 },
+    { "touching the first edge", 900, 1000, 0, 1, 0, 0 },
+    { "touching the last edge", 1500, 1600, 0, 1, 0, 0 },
+    { "across the first edge", 950, 1050, 0, 1, 10, 1 },
+    { "across the last edge", 1450, 1600, 0, 1, 14, 1 },
+    { "covering the raster", 0, 2000, 0, 1, 10, 5 },
+    { "inside two tiles", 1230.5, 1330, 0, 1, 12, 2 },
+    { "ending on a tile edge", 1210, 1300, 0, 1, 12, 1 },
+    { "within one pixel", 1210.2, 1210.7, 0, 1, 12, 1 },
+    { "aligned for overviews", 1230.5, 1330, 0, 4, 12, 4 },
+    { "aligned before the raster", 1050, 1100, 0, 4, 8, 4 },
+    { "overlapping tiles", 1230.5, 1330, 20, 1, 15, 2 },
+  };
+
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    int first = 0;
+    int tiles = clip_axis(cases[i].low, cases[i].high, 1000, 500, 100, cases[i].overlap, cases[i].align, &first);
+    check(tiles == cases[i].tiles && (tiles == 0 || first == cases[i].first), 500, 1, cases[i].what);
+  }
+}
+
+// two neighbouring rasters of 500 x 500 pixels of 20 cm, not on multiples of the tile size, clipped to an area across
+// their border: both windows start on the same tile of the global grid, padded where it reaches past either raster
+static void check_clip_raster(void)
+{
+  options *option = create_options();
+  option->csize = option->rsize = 64;
+  option->bbox[0] = 390090;
+  option->bbox[1] = 5819950;
+  option->bbox[2] = 390110;
+  option->bbox[3] = 5819990;
+  option->has_bbox = 1;
+
+  raster_info west = {
+    .columns = 500, .rows = 500, .geo_transform = { 390000, 0.2, 0, 5820000, 0, -0.2 }
+  };
+  raster_info east = west;
+  east.geo_transform[0] = 390100;
+  clip_raster(&west, option);
+  clip_raster(&east, option);
+
+  // pixel 1950450 of the global grid starts the west raster's column 450, 1950500 the east raster
+  check(west.x_first == 30475 && west.x_tiles == 2 && east.x_first == 30476 && east.x_tiles == 2, 500, 1,
+        "tiles across the border");
+  check(west.x_offset == 30475 * 64 - 1950000 && west.x_begin == 0 && west.x_end == 500 - west.x_offset &&
+        west.columns == 128, 500, 1, "west window padded after the raster");
+  check(east.x_offset == 30476 * 64 - 1950500 && east.x_offset < 0 && east.x_begin == -east.x_offset &&
+        east.x_end == 128, 500, 1, "east window padded before the raster");
+  // rows count south from 10000 km: 20900000 is the top row of both rasters, 20900050 to 20900250 the area's rows
+  check(west.y_first == 326563 && west.y_tiles == 4 && west.y_offset == 326563 * 64 - 20900000 &&
+        east.y_first == west.y_first && east.y_tiles == west.y_tiles && east.y_offset == west.y_offset, 500, 1,
+        "same rows on both sides");
+
+  raster_info outside = {
+    .columns = 500, .rows = 500, .geo_transform = { 391000, 0.2, 0, 5820000, 0, -0.2 }
+  };
+  clip_raster(&outside, option);
+  check(outside.x_tiles == 0 && outside.y_tiles == 0, 500, 1, "raster outside the area skipped");
+
+  destroy_options(option);
+}
+
+int main(void)
+{
+  check_source_pixels();
+  check_clip_axis();
+  check_clip_raster();
+
+  if (failures) {
+    fprintf(stderr, "test-tile: %d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("test-tile: all windows map onto the source raster\n");
+  return 0;
+}
@@ -0,0 +1,295 @@
+// builds zip archives in memory and extracts them through zipstream in chunks of various sizes
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "zipstream.h"
+
+#define STORED 0
+#define DEFLATED 8
+// sizes follow the data in a descriptor, with or without its optional signature, or as zip64
+#define IN_HEADER 0
+#define DESCRIPTOR 1
+#define DESCRIPTOR_UNSIGNED 2
+#define DESCRIPTOR_ZIP64 3
+
+static int failures;
+
+static void check(int condition, const char *what, size_t chunk)
+{
+  if (condition)
+    return;
+
+  fprintf(stderr, "FAIL: %s (chunks of %zu bytes)\n", what, chunk);
+  failures++;
+}
+
+typedef struct
+{
+  uint8_t *data;
+  size_t size;
+} buffer;
+
+static void put(buffer *out, const void *data, size_t size)
+{
+  out->data = realloc(out->data, out->size + size);
+  memcpy(out->data + out->size, data, size);
+  out->size += size;
+}
+
+static void put_u16(buffer *out, uint16_t value)
+{
+  uint8_t bytes[2] = { value, value >> 8 };
+  put(out, bytes, 2);
+}
+
+static void put_u32(buffer *out, uint32_t value)
+{
+  put_u16(out, value);
+  put_u16(out, value >> 16);
+}
+
+static void put_u64(buffer *out, uint64_t value)
+{
+  put_u32(out, value);
+  put_u32(out, value >> 32);
+}
+
+static buffer deflate_raw(const uint8_t *data, size_t size)
+{
+  buffer out = { malloc(compressBound(size) + 64), 0 };
+  z_stream z = { 0 };
+
+  deflateInit2(&z, 6, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+  z.next_in = (Bytef *) data;
+  z.avail_in = size;
+  z.next_out = out.data;
+  z.avail_out = compressBound(size) + 64;
+  deflate(&z, Z_FINISH);
+  out.size = z.total_out;
+  deflateEnd(&z);
+
+  return out;
+}
+
+static void add_member(buffer *zip, const char *name, const uint8_t *data, size_t size, int method, int sizes)
+{
+  buffer body = method == DEFLATED ? deflate_raw(data, size) : (buffer) {
+    0
+  };
+  const uint8_t *stored = method == DEFLATED ? body.data : data;
+  size_t stored_size = method == DEFLATED ? body.size : size;
+  uint32_t crc = crc32(crc32(0L, Z_NULL, 0), data, size);
+
+  put_u32(zip, 0x04034b50);
+  put_u16(zip, sizes == DESCRIPTOR_ZIP64 ? 45 : 20);
+  put_u16(zip, sizes == IN_HEADER ? 0 : 1 << 3);
+  put_u16(zip, method);
+  put_u32(zip, 0);
+  put_u32(zip, sizes == IN_HEADER ? crc : 0);
+  put_u32(zip, sizes == IN_HEADER ? stored_size : sizes == DESCRIPTOR_ZIP64 ? UINT32_MAX : 0);
+  put_u32(zip, sizes == IN_HEADER ? size : sizes == DESCRIPTOR_ZIP64 ? UINT32_MAX : 0);
+  put_u16(zip, strlen(name));
+  put_u16(zip, sizes == DESCRIPTOR_ZIP64 ? 20 : 0);
+  put(zip, name, strlen(name));
+  if (sizes == DESCRIPTOR_ZIP64) {
+    put_u16(zip, 0x0001);
+    put_u16(zip, 16);
+    put_u64(zip, 0);
+    put_u64(zip, 0);
+  }
+  put(zip, stored, stored_size);
+
+  if (sizes == DESCRIPTOR || sizes == DESCRIPTOR_ZIP64)
+    put_u32(zip, 0x08074b50);
+  if (sizes != IN_HEADER)
+    put_u32(zip, crc);
+  if (sizes == DESCRIPTOR_ZIP64) {
+    put_u64(zip, stored_size);
+    put_u64(zip, size);
+  } else if (sizes != IN_HEADER) {
+    put_u32(zip, stored_size);
+    put_u32(zip, size);
+  }
+
+  free(body.data);
+}
+
+// the reader stops at the first central directory record, so its contents do not matter here
+static void add_central_directory(buffer *zip)
+{
+  put_u32(zip, 0x02014b50);
+  uint8_t rest[42] = { 0 };
+  put(zip, rest, sizeof(rest));
+  put_u32(zip, 0x06054b50);
+  uint8_t end[18] = { 0 };
+  put(zip, end, sizeof(end));
+}
+
+// compressible runs next to noise, more than one inflate output buffer long
+static uint8_t *member_data(size_t size, unsigned seed)
+{
+  uint8_t *data = malloc(size ? size : 1);
+  uint32_t state = seed;
+
+  for (size_t i = 0; i < size; i++) {
+    state = state * 1664525 + 1013904223;
+    data[i] = i / 4096 % 2 ? (uint8_t) (state >> 24) : (uint8_t) (i / 64);
+  }
+
+  return data;
+}
+
+typedef struct
+{
+  const char *name;
+  const char *file;
+  size_t size;
+  int method;
+  int sizes;
+  int extracted;
+} member;
+
+static const member members[] = {
+  { "DOP/dop20rgb_390_5820.ecw", "dop20rgb_390_5820.ecw", 200000, DEFLATED, IN_HEADER, 1 },
+  { "dop20rgb_392_5820.jp2", "dop20rgb_392_5820.jp2", 70001, STORED, IN_HEADER, 1 },
+  { "DOP/readme.txt", "readme.txt", 5000, DEFLATED, IN_HEADER, 0 },
+  { "DOP/dop20rgb_394_5820.ecw", "dop20rgb_394_5820.ecw", 150000, DEFLATED, DESCRIPTOR, 1 },
+  { "DOP/dop20rgb_396_5820.ECW", "dop20rgb_396_5820.ECW", 1, DEFLATED, DESCRIPTOR_UNSIGNED, 1 },
+  { "DOP/dop20rgb_398_5820.ecw", "dop20rgb_398_5820.ecw", 99999, DEFLATED, DESCRIPTOR_ZIP64, 1 },
+  { "DOP/", "DOP", 0, STORED, IN_HEADER, 0 },
+  { "DOP/empty.ecw", "empty.ecw", 0, STORED, IN_HEADER, 1 },
+};
+#define MEMBERS (sizeof(members) / sizeof(members[0]))
+
+static buffer build_zip(void)
+{
+  buffer zip = { 0 };
+
+  for (size_t m = 0; m < MEMBERS; m++) {
+    uint8_t *data = member_data(members[m].size, m);
+    add_member(&zip, members[m].name, data, members[m].size, members[m].method, members[m].sizes);
+    free(data);
+  }
+  add_central_directory(&zip);
+
+  return zip;
+}
+
+// feeds 'zip' in chunks of 'chunk' bytes; returns what zipstream_feed or zipstream_finish reported
+static int extract(const char *directory, const buffer *zip, size_t chunk, size_t *extracted)
+{
+  zipstream *stream = zipstream_create(directory, 0);
+  int status = stream == NULL;
+
+  for (size_t offset = 0; !status && offset < zip->size; offset += chunk)
+    status = zipstream_feed(stream, zip->data + offset, zip->size - offset < chunk ? zip->size - offset : chunk);
+  if (!status)
+    status = zipstream_finish(stream);
+  if (stream)
+    *extracted = zipstream_extracted(stream);
+  zipstream_destroy(stream);
+
+  return status;
+}
+
+static int file_matches(const char *directory, const member *m, unsigned seed)
+{
+  char path[1024];
+  struct stat file_stat;
+
+  snprintf(path, sizeof(path), "%s/%s", directory, m->file);
+  if (stat(path, &file_stat) != 0 || (size_t) file_stat.st_size != m->size)
+    return 0;
+
+  uint8_t *expected = member_data(m->size, seed);
+  uint8_t *actual = malloc(m->size ? m->size : 1);
+  FILE *file = fopen(path, "rb");
+  int matches = file && fread(actual, 1, m->size, file) == m->size && !memcmp(actual, expected, m->size);
+  if (file)
+    fclose(file);
+  free(expected);
+  free(actual);
+
+  return matches;
+}
+
+static size_t remove_files(const char *directory)
+{
+  DIR *dir = opendir(directory);
+  struct dirent *entry;
+  size_t count = 0;
+  char path[1024];
+
+  while (dir && (entry = readdir(dir))) {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+    unlink(path);
+    count++;
+  }
+  if (dir)
+    closedir(dir);
+
+  return count;
+}
+
+int main(void)
+{
+  static const size_t chunks[] = { 1, 3, 4, 7, 30, 4096, 65537, SIZE_MAX };
+  char directory[] = "/tmp/test-zipstream.XXXXXX";
+  buffer zip = build_zip();
+
+  if (mkdtemp(directory) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  size_t wanted = 0;
+  for (size_t m = 0; m < MEMBERS; m++)
+    wanted += members[m].extracted;
+
+  for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+    size_t chunk = chunks[c] < zip.size ? chunks[c] : zip.size;
+    size_t extracted = 0;
+    check(extract(directory, &zip, chunk, &extracted) == 0, "archive extracted", chunk);
+    check(extracted == wanted, "every raster extracted", chunk);
+    for (size_t m = 0; m < MEMBERS; m++)
+      if (members[m].extracted)
+        check(file_matches(directory, &members[m], m), members[m].name, chunk);
+    check(remove_files(directory) == wanted, "nothing but the rasters written", chunk);
+  }
+
+  // a flipped bit in the first member's data fails its CRC; nothing of it may be left behind
+  buffer broken = { 0 };
+  put(&broken, zip.data, zip.size);
+  broken.data[30 + strlen(members[0].name) + 100] ^= 0x01;
+  size_t extracted = 0;
+  check(extract(directory, &broken, 4096, &extracted) != 0 && extracted == 0, "corrupt member refused", 4096);
+  check(remove_files(directory) == 0, "corrupt member removed", 4096);
+  free(broken.data);
+
+  // an archive cut off before its central directory is incomplete, even if its members were fine; no partial
+  // files may be left behind
+  buffer truncated = { 0 };
+  put(&truncated, zip.data, zip.size - 46 - 22);
+  check(extract(directory, &truncated, 4096, &extracted) != 0, "truncated archive refused", 4096);
+  check(remove_files(directory) == extracted, "only complete members kept", 4096);
+  free(truncated.data);
+
+  rmdir(directory);
+  free(zip.data);
+
+  if (failures) {
+    fprintf(stderr, "test-zipstream: %d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("test-zipstream: all members extracted\n");
+  return 0;
+}